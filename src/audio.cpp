@@ -0,0 +1,637 @@
+#include "audio.h"
+#include "demux.h"
+#include "decoder.h"
+#include "telemetry.h"
+
+#include  <alsa/asoundlib.h>
+
+#include  <algorithm>
+#include  <chrono>
+#include  <condition_variable>
+#include  <mutex>
+#include  <stdexcept>
+#include  <string>
+#include  <thread>
+#include  <pthread.h>
+#include  <sched.h>
+#include  <errno.h>
+#include  <stdio.h>
+#include  <string.h>
+
+namespace audio
+{
+
+using steady = std::chrono::steady_clock;
+
+// decoded audio queued ahead of the sink
+static const uint32_t  ring_ms = 500;
+// the callback fills this much per call
+static const uint32_t  period_ms = 10;
+// ALSA buffer, the device plays this much behind the callback at most
+static const uint32_t  device_latency_ms = 40;
+
+static const uint64_t  no_epoch = UINT64_MAX;
+
+static struct
+{
+  sink_type     type = sink_type::device;
+  std::string   wav_path;
+} config;
+
+void  set_sink(sink_type type, const char* wav_path)
+{
+  config.type = type;
+  config.wav_path = wav_path ? wav_path : "";
+}
+
+sink_type  sink()
+{
+  return config.type;
+}
+
+ring::ring(size_t frames, uint32_t channels)
+  : channels(channels)
+  , capacity(1)
+{
+  while (capacity < frames)
+    capacity <<= 1;
+  buffer.resize(capacity * channels);
+}
+
+size_t  ring::write(const float* samples, size_t frames)
+{
+  const uint64_t h = head.load(std::memory_order_relaxed);
+  const uint64_t t = tail.load(std::memory_order_acquire);
+  frames = std::min<size_t>(frames, capacity - (size_t)(h - t));
+  for (size_t done = 0; done < frames;)
+  {
+    const size_t at = (size_t)(h + done) & (capacity - 1);
+    const size_t n = std::min(frames - done, capacity - at);
+    memcpy(&buffer[at * channels], samples + done * channels, n * channels * sizeof(float));
+    done += n;
+  }
+  head.store(h + frames, std::memory_order_release);
+  return frames;
+}
+
+size_t  ring::read(float* samples, size_t frames)
+{
+  const uint64_t t = tail.load(std::memory_order_relaxed);
+  const uint64_t h = head.load(std::memory_order_acquire);
+  frames = std::min<size_t>(frames, (size_t)(h - t));
+  for (size_t done = 0; done < frames;)
+  {
+    const size_t at = (size_t)(t + done) & (capacity - 1);
+    const size_t n = std::min(frames - done, capacity - at);
+    memcpy(samples + done * channels, &buffer[at * channels], n * channels * sizeof(float));
+    done += n;
+  }
+  tail.store(t + frames, std::memory_order_release);
+  return frames;
+}
+
+void  ring::clear()
+{
+  tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+static int64_t  to_ns(steady::time_point t)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+// Takes one period at a time from the sink thread.
+struct sink_output
+{
+  virtual ~sink_output() = default;
+  // blocks until the sink can take the period
+  virtual void     write(const float* samples, uint32_t frames) = 0;
+  // frames written and not played yet
+  virtual int64_t  delay() = 0;
+};
+
+// Paced by the wall clock, a period is played once write() returns.
+struct null_output : sink_output
+{
+  uint32_t            rate;
+  steady::time_point  deadline = steady::now();
+
+  explicit null_output(uint32_t rate) : rate(rate) {}
+
+  void  write(const float*, uint32_t frames) override
+  {
+    deadline += std::chrono::nanoseconds((int64_t)frames * 1000000000 / rate);
+    // after a stall carry on from now rather than rushing to catch up
+    deadline = std::max(deadline, steady::now());
+    std::this_thread::sleep_until(deadline);
+  }
+
+  int64_t  delay() override
+  {
+    return 0;
+  }
+};
+
+static void  put16(uint8_t* p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void  put32(uint8_t* p, uint32_t v)
+{
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+// 32-bit float WAV in real time, for checking A/V sync without a device.
+// The sizes in the header are filled in on close.
+struct wav_output : null_output
+{
+  static const size_t  header_size = 58;
+
+  FILE*     file = nullptr;
+  uint32_t  channels;
+  uint64_t  frames_written = 0;
+  bool      failed = false;
+
+  wav_output(const char* path, uint32_t rate, uint32_t channels)
+    : null_output(rate)
+    , channels(channels)
+  {
+    file = fopen(path, "wb");
+    if (!file)
+      throw std::runtime_error(std::string("[AUDIO] failed to create ") + path + ": " + strerror(errno));
+    write_header();
+  }
+
+  ~wav_output()
+  {
+    write_header();
+    fclose(file);
+  }
+
+  void  write_header()
+  {
+    const uint32_t dataSize = (uint32_t)std::min<uint64_t>(frames_written * channels * 4, UINT32_MAX - header_size);
+    uint8_t h[header_size];
+    memcpy(h, "RIFF", 4);
+    put32(h + 4, (uint32_t)(header_size - 8 + dataSize));
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put32(h + 16, 18);
+    put16(h + 20, 3);       // WAVE_FORMAT_IEEE_FLOAT
+    put16(h + 22, (uint16_t)channels);
+    put32(h + 24, rate);
+    put32(h + 28, rate * channels * 4);
+    put16(h + 32, (uint16_t)(channels * 4));
+    put16(h + 34, 32);
+    put16(h + 36, 0);
+    memcpy(h + 38, "fact", 4);
+    put32(h + 42, 4);
+    put32(h + 46, (uint32_t)frames_written);
+    memcpy(h + 50, "data", 4);
+    put32(h + 54, dataSize);
+    fseek(file, 0, SEEK_SET);
+    fwrite(h, 1, header_size, file);
+    fseek(file, 0, SEEK_END);
+  }
+
+  void  write(const float* samples, uint32_t frames) override
+  {
+    if (fwrite(samples, sizeof(float) * channels, frames, file) == frames)
+      frames_written += frames;
+    else if (!failed)
+    {
+      failed = true;
+      printf("[AUDIO] failed to write the WAV file\n");
+    }
+    null_output::write(samples, frames);
+  }
+};
+
+// The default ALSA device. Falls back to null pacing when the device fails
+// while playing.
+struct device_output : null_output
+{
+  snd_pcm_t*  pcm = nullptr;
+  uint32_t    channels;
+  bool        failed = false;
+
+  device_output(uint32_t rate, uint32_t channels)
+    : null_output(rate)
+    , channels(channels)
+  {
+    int err = snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
+    if (err >= 0)
+      err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_FLOAT, SND_PCM_ACCESS_RW_INTERLEAVED,
+                               channels, rate, 1, device_latency_ms * 1000);
+    if (err < 0)
+    {
+      if (pcm)
+        snd_pcm_close(pcm);
+      throw std::runtime_error(std::string("[AUDIO] no audio device: ") + snd_strerror(err));
+    }
+  }
+
+  ~device_output()
+  {
+    snd_pcm_drop(pcm);
+    snd_pcm_close(pcm);
+  }
+
+  void  write(const float* samples, uint32_t frames) override
+  {
+    if (failed)
+      return null_output::write(samples, frames);
+
+    while (frames > 0)
+    {
+      snd_pcm_sframes_t n = snd_pcm_writei(pcm, samples, frames);
+      if (n < 0)
+        n = snd_pcm_recover(pcm, (int)n, 1);
+      if (n < 0)
+      {
+        printf("[AUDIO] device failed (%s), dropping audio\n", snd_strerror((int)n));
+        failed = true;
+        deadline = steady::now();
+        return null_output::write(samples, frames);
+      }
+      samples += n * channels;
+      frames -= (uint32_t)n;
+    }
+  }
+
+  int64_t  delay() override
+  {
+    snd_pcm_sframes_t frames = 0;
+    if (failed || snd_pcm_delay(pcm, &frames) < 0)
+      return 0;
+    return std::max<snd_pcm_sframes_t>(0, frames);
+  }
+};
+
+static std::unique_ptr<sink_output>  open_output(uint32_t rate, uint32_t channels)
+{
+  switch (config.type)
+  {
+    case sink_type::wav:
+      return std::unique_ptr<sink_output>(new wav_output(config.wav_path.c_str(), rate, channels));
+    case sink_type::device:
+      try {
+        return std::unique_ptr<sink_output>(new device_output(rate, channels));
+      }
+      catch (std::exception const& e)
+      {
+        printf("%s, using the null sink\n", e.what());
+      }
+      break;
+    default:
+      break;
+  }
+  return std::unique_ptr<sink_output>(new null_output(rate));
+}
+
+// The clock as of the last period: now - base_ns, but not past limit_ns, the
+// end of the samples handed to the sink. Published by the sink thread
+// through a sequence lock, so the callback never waits for a reader.
+struct published_clock
+{
+  std::atomic<uint32_t>  seq {0};
+  std::atomic<uint64_t>  generation {0};
+  std::atomic<int64_t>   base_ns {0};
+  std::atomic<int64_t>   limit_ns {-1};     // -1 without a clock
+
+  void  store(uint64_t gen, int64_t base, int64_t limit)
+  {
+    const uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    generation.store(gen, std::memory_order_relaxed);
+    base_ns.store(base, std::memory_order_relaxed);
+    limit_ns.store(limit, std::memory_order_relaxed);
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  void  load(uint64_t& gen, int64_t& base, int64_t& limit) const
+  {
+    for (;;)
+    {
+      const uint32_t s = seq.load(std::memory_order_acquire);
+      gen = generation.load(std::memory_order_relaxed);
+      base = base_ns.load(std::memory_order_relaxed);
+      limit = limit_ns.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (!(s & 1) && seq.load(std::memory_order_relaxed) == s)
+        return;
+    }
+  }
+};
+
+struct stream::state
+{
+  demux::webm_reader            reader;
+  demux::audio_info             info;
+  decode::audio_decoder         decoder;
+  const uint32_t                rate;
+  const uint32_t                channels;
+  const uint32_t                period_frames;
+  ring                          queue;
+  std::unique_ptr<sink_output>  output;
+
+  // main thread -> decode thread
+  std::mutex                lock;
+  std::condition_variable   wake;
+  uint64_t                  generation = 0;
+  bool                      playing = false;
+  int64_t                   start_ns = 0;
+  bool                      quit = false;
+  std::atomic<uint64_t>     requested {0};    // generation clock_ns() reports for
+
+  // decode thread -> callback: the ring frame the current start() begins
+  // at, and its media time
+  std::atomic<uint64_t>     epoch_frame {no_epoch};
+  std::atomic<int64_t>      epoch_ns {0};
+  std::atomic<uint64_t>     epoch_generation {0};
+  std::atomic<bool>         flush {false};
+  std::atomic<bool>         ended {false};
+
+  // sink thread -> main thread
+  published_clock           clock;
+
+  std::thread               decode_thread;
+  std::thread               sink_thread;
+  std::atomic<bool>         stop_sink {false};
+
+  // decode thread only
+  uint64_t                  current = 0;      // generation being fed
+  std::vector<float>        pcm;
+  size_t                    sent = 0;         // frames of pcm in the ring
+  int64_t                   pcm_ns = 0;       // media time of the first frame of pcm
+  bool                      feeding = false;
+  int64_t                   target_ns = 0;
+  int64_t                   anchor_ns = -1;   // media time of the first sample decoded
+  uint64_t                  decoded_frames = 0;
+  demux::packet             pkt;
+
+  explicit state(const char* path)
+    : reader(path, demux::track_type::audio)
+    , info(reader.audio())
+    , decoder(info)
+    , rate(decoder.sample_rate())
+    , channels(decoder.channels())
+    , period_frames(rate * period_ms / 1000)
+    , queue(rate * ring_ms / 1000, channels)
+    , output(open_output(rate, channels))
+  {
+  }
+
+  int64_t  frames_ns(uint64_t frames) const
+  {
+    return (int64_t)(frames * 1000000000 / rate);
+  }
+
+  void  decode_loop();
+  void  begin(uint64_t gen, bool play, int64_t at);
+  bool  feed();
+  void  sink_loop();
+  void  render(float* samples, uint32_t frames);
+  void  publish_clock(uint64_t end_frame);
+};
+
+// Called from the decode thread for every start() and stop(). The ring is
+// emptied by the callback, the only side allowed to drop frames.
+void  stream::state::begin(uint64_t gen, bool play, int64_t at)
+{
+  epoch_frame.store(no_epoch, std::memory_order_release);
+  flush.store(true, std::memory_order_release);
+  while (flush.load(std::memory_order_acquire))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  current = gen;
+  ended = false;
+  pcm.clear();
+  sent = 0;
+  anchor_ns = -1;
+  decoded_frames = 0;
+  feeding = play;
+  target_ns = at;
+  if (play)
+  {
+    reader.seek(at - info.seek_preroll_ns);
+    decoder.reset();
+  }
+}
+
+// Hands the decoded samples to the ring, then decodes the next packet.
+// Returns false while the ring is full and once the track ended.
+bool  stream::state::feed()
+{
+  const size_t frames = pcm.size() / channels;
+  if (sent < frames)
+  {
+    const uint64_t at = queue.written();
+    const size_t written = queue.write(&pcm[sent * channels], frames - sent);
+    // published once samples are in the ring, so the callback doesn't count
+    // the wait for the first ones as underruns
+    if (written && epoch_frame.load(std::memory_order_relaxed) == no_epoch)
+    {
+      epoch_ns.store(pcm_ns + frames_ns(sent), std::memory_order_relaxed);
+      epoch_generation.store(current, std::memory_order_relaxed);
+      epoch_frame.store(at, std::memory_order_release);
+    }
+    sent += written;
+    if (sent < frames)
+      return false;
+  }
+  pcm.clear();
+  sent = 0;
+
+  if (!reader.read(pkt))
+  {
+    ended = true;
+    feeding = false;
+    return false;
+  }
+  const size_t count = decoder.decode(pkt, pcm);
+  if (!count)
+    return true;
+
+  // samples are timed from the first packet on, block times are rounded
+  // to the timecode scale
+  if (anchor_ns < 0)
+    anchor_ns = pkt.time_ns - info.codec_delay_ns;
+  const int64_t first_ns = anchor_ns + frames_ns(decoded_frames);
+  decoded_frames += count;
+
+  // the seek preroll and the Opus pre-skip lie before the target
+  size_t skip = 0;
+  if (first_ns < target_ns)
+    skip = std::min<size_t>(count, (size_t)((target_ns - first_ns) * rate / 1000000000));
+  pcm.erase(pcm.begin(), pcm.begin() + skip * channels);
+  pcm_ns = first_ns + frames_ns(skip);
+  return true;
+}
+
+void  stream::state::decode_loop()
+{
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> guard(lock);
+  while (!quit)
+  {
+    if (generation != seen)
+    {
+      seen = generation;
+      const bool play = playing;
+      const int64_t at = start_ns;
+      guard.unlock();
+      try {
+        begin(seen, play, at);
+      }
+      catch (std::exception const& e)
+      {
+        printf("%s\n", e.what());
+        feeding = false;
+      }
+      guard.lock();
+      continue;
+    }
+    if (!feeding)
+    {
+      wake.wait(guard);
+      continue;
+    }
+
+    guard.unlock();
+    bool more = false;
+    try {
+      more = feed();
+    }
+    catch (std::exception const& e)
+    {
+      printf("%s\n", e.what());
+      ended = true;
+      feeding = false;
+    }
+    guard.lock();
+    if (!more && feeding)
+      wake.wait_for(guard, std::chrono::milliseconds(period_ms));
+  }
+}
+
+// The real-time callback: no locks, no allocations.
+void  stream::state::render(float* samples, uint32_t frames)
+{
+  if (flush.load(std::memory_order_acquire))
+  {
+    queue.clear();
+    flush.store(false, std::memory_order_release);
+  }
+
+  const size_t got = queue.read(samples, frames);
+  if (got < frames)
+  {
+    std::fill(samples + got * channels, samples + frames * channels, 0.0f);
+    if (epoch_frame.load(std::memory_order_acquire) != no_epoch && !ended)
+      telemetry::add(telemetry::counter::audio_underruns);
+  }
+}
+
+// The last frame handed to the sink plays once the device delay ran out.
+void  stream::state::publish_clock(uint64_t end_frame)
+{
+  const uint64_t epoch = epoch_frame.load(std::memory_order_acquire);
+  const bool drained = ended && queue.consumed() == queue.written();
+  if (epoch == no_epoch || end_frame <= epoch || drained)
+  {
+    clock.store(0, 0, -1);
+    return;
+  }
+
+  const int64_t end_ns = epoch_ns.load(std::memory_order_relaxed) + frames_ns(end_frame - epoch);
+  const int64_t playing_ns = end_ns - frames_ns(output->delay());
+  // silence ahead of the first sample is still playing
+  if (playing_ns < epoch_ns.load(std::memory_order_relaxed))
+  {
+    clock.store(0, 0, -1);
+    return;
+  }
+  clock.store(epoch_generation.load(std::memory_order_relaxed),
+              to_ns(steady::now()) - playing_ns, end_ns);
+}
+
+void  stream::state::sink_loop()
+{
+  // best effort, needs CAP_SYS_NICE or an rtprio limit
+  sched_param param = {};
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+  pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+  std::vector<float> period(period_frames * channels);
+  while (!stop_sink)
+  {
+    render(period.data(), period_frames);
+    const uint64_t end = queue.consumed();
+    output->write(period.data(), period_frames);
+    publish_clock(end);
+  }
+}
+
+stream::stream(const char* path)
+  : impl(new state(path))
+{
+  static const char* const sinks[] = {"none", "null", "wav", "device"};
+  printf("[AUDIO] %s: %s, %u Hz, %u channels, %s sink\n", path,
+         impl->info.id == demux::codec::opus ? "opus" : "vorbis",
+         impl->rate, impl->channels, sinks[(int)config.type]);
+
+  state* s = impl.get();
+  impl->sink_thread = std::thread([s] { s->sink_loop(); });
+  impl->decode_thread = std::thread([s] { s->decode_loop(); });
+}
+
+stream::~stream()
+{
+  {
+    std::lock_guard<std::mutex> guard(impl->lock);
+    impl->quit = true;
+  }
+  impl->wake.notify_one();
+  impl->decode_thread.join();
+  impl->stop_sink = true;
+  impl->sink_thread.join();
+}
+
+void  stream::start(int64_t time_ns)
+{
+  {
+    std::lock_guard<std::mutex> guard(impl->lock);
+    impl->generation++;
+    impl->playing = true;
+    impl->start_ns = std::max<int64_t>(0, time_ns);
+    impl->requested = impl->generation;
+  }
+  impl->wake.notify_one();
+}
+
+void  stream::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(impl->lock);
+    impl->generation++;
+    impl->playing = false;
+    impl->requested = impl->generation;
+  }
+  impl->wake.notify_one();
+}
+
+int64_t  stream::clock_ns() const
+{
+  uint64_t generation;
+  int64_t base, limit;
+  impl->clock.load(generation, base, limit);
+  if (limit < 0 || generation != impl->requested)
+    return -1;
+  return std::min(to_ns(steady::now()) - base, limit);
+}
+
+} // namespace audio
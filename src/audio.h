@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Audio of file playback. The audio track is decoded on its own thread into
+// a lock-free ring, which the sink's real-time callback drains. The position
+// the sink has played up to is the master clock video is presented against.
+namespace audio
+{
+  enum class sink_type
+  {
+    none,       // no audio, video runs on the wall clock
+    null,       // takes the samples in real time and throws them away
+    wav,        // like null, and writes them to a WAV file
+    device      // the default ALSA device, null when there is none
+  };
+  // for streams opened from now on
+  void        set_sink(sink_type type, const char* wav_path = nullptr);
+  sink_type   sink();
+
+  // Single producer, single consumer ring of interleaved sample frames.
+  // Neither side blocks or allocates, so the consumer can run in an audio
+  // callback.
+  class ring
+  {
+  public:
+    // capacity is rounded up to a power of two
+    ring(size_t frames, uint32_t channels);
+    ring(ring const&) = delete;
+    ring& operator=(ring const&) = delete;
+
+    // both return the number of frames copied
+    size_t  write(const float* samples, size_t frames);   // producer
+    size_t  read(float* samples, size_t frames);          // consumer
+    // drops the frames written so far, consumer only
+    void    clear();
+
+    // frames written / read since construction
+    uint64_t  written() const { return head.load(std::memory_order_acquire); }
+    uint64_t  consumed() const { return tail.load(std::memory_order_acquire); }
+
+  private:
+    std::vector<float>     buffer;
+    uint32_t               channels;
+    size_t                 capacity;
+    std::atomic<uint64_t>  head {0};
+    std::atomic<uint64_t>  tail {0};
+  };
+
+  // Plays the Opus or Vorbis track of a WebM file through the sink chosen by
+  // set_sink().
+  class stream
+  {
+  public:
+    // Throws std::runtime_error when the track can't be read or decoded.
+    explicit stream(const char* path);
+    ~stream();
+    stream(stream const&) = delete;
+    stream& operator=(stream const&) = delete;
+
+    // plays from time_ns on
+    void  start(int64_t time_ns);
+    // drops the queued samples, the sink plays silence until the next start()
+    void  stop();
+
+    // Media time of the sample the sink plays now. -1 until the first sample
+    // since start() reached the sink, after stop() and once the track ended.
+    int64_t  clock_ns() const;
+
+  private:
+    struct state;
+    std::unique_ptr<state>  impl;
+  };
+}
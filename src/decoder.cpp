@@ -0,0 +1,420 @@
+#include "decoder.h"
+
+#include  <vpx/vpx_decoder.h>
+#include  <vpx/vp8dx.h>
+#include  <opus_multistream.h>
+#include  <vorbis/codec.h>
+
+#include  <stdexcept>
+#include  <string>
+#include  <string.h>
+
+namespace decode
+{
+
+struct vpx_decoder::state
+{
+  vpx_codec_ctx_t   ctx = {};
+  demux::codec      codec = demux::codec::unknown;
+  bool              initialized = false;
+
+  ~state()
+  {
+    if (initialized)
+      vpx_codec_destroy(&ctx);
+  }
+
+  void  fail(const char* what)
+  {
+    std::string message = std::string("[VPX] ") + what + ": " + vpx_codec_error(&ctx);
+    if (const char* detail = vpx_codec_error_detail(&ctx))
+      message += std::string(" (") + detail + ")";
+    throw std::runtime_error(message);
+  }
+};
+
+vpx_decoder::vpx_decoder(demux::codec codec, unsigned threads_num)
+  : impl(new state)
+{
+  vpx_codec_iface_t* iface = nullptr;
+  if (codec == demux::codec::vp8)
+    iface = vpx_codec_vp8_dx();
+  else if (codec == demux::codec::vp9)
+    iface = vpx_codec_vp9_dx();
+  else
+    throw std::runtime_error("[VPX] unsupported codec");
+
+  vpx_codec_dec_cfg_t cfg = {};
+  cfg.threads = threads_num;
+  if (vpx_codec_dec_init(&impl->ctx, iface, &cfg, 0) != VPX_CODEC_OK)
+    impl->fail("failed to initialize decoder");
+  impl->initialized = true;
+  impl->codec = codec;
+}
+
+vpx_decoder::~vpx_decoder() = default;
+
+// VP8 is always BT.601, VP9 signals it and defaults to BT.709
+static color_matrix  to_color_matrix(demux::codec codec, vpx_color_space_t cs)
+{
+  switch (cs)
+  {
+    case VPX_CS_BT_601:
+    case VPX_CS_SMPTE_170:
+      return color_matrix::bt601;
+    case VPX_CS_BT_2020:
+      return color_matrix::bt2020;
+    case VPX_CS_UNKNOWN:
+      return codec == demux::codec::vp8 ? color_matrix::bt601 : color_matrix::bt709;
+    default:
+      return color_matrix::bt709;
+  }
+}
+
+bool  vpx_decoder::decode(demux::packet const& pkt, video_frame& picture)
+{
+  if (vpx_codec_decode(&impl->ctx, pkt.data.data(), pkt.data.size(), nullptr, 0) != VPX_CODEC_OK)
+    impl->fail("failed to decode frame");
+
+  vpx_codec_iter_t iter = nullptr;
+  vpx_image_t* img = vpx_codec_get_frame(&impl->ctx, &iter);
+  if (!img)
+    return false;
+  if (img->fmt != VPX_IMG_FMT_I420)
+    throw std::runtime_error("[VPX] only 8-bit 4:2:0 video is supported");
+
+  picture.width = img->d_w;
+  picture.height = img->d_h;
+  picture.matrix = to_color_matrix(impl->codec, img->cs);
+  picture.full_range = img->range == VPX_CR_FULL_RANGE;
+  picture.bit_depth = img->bit_depth;
+  const int planes[3] = {VPX_PLANE_Y, VPX_PLANE_U, VPX_PLANE_V};
+  for (int i = 0; i < 3; ++i)
+  {
+    picture.planes[i] = img->planes[planes[i]];
+    picture.strides[i] = img->stride[planes[i]];
+  }
+  return true;
+}
+
+void  vpx_decoder::skip_loop_filter(bool skip)
+{
+  if (impl->codec == demux::codec::vp9)
+    vpx_codec_control(&impl->ctx, VP9_SET_SKIP_LOOP_FILTER, skip ? 1 : 0);
+}
+
+// Opus output rate, whatever the input rate in the OpusHead was
+static const uint32_t  opus_rate = 48000;
+// longest Opus packet, 120 ms
+static const int       opus_max_frames = opus_rate * 120 / 1000;
+
+struct audio_decoder::state
+{
+  uint32_t            rate = 0;
+  uint32_t            channels = 0;
+
+  OpusMSDecoder*      opus = nullptr;
+
+  vorbis_info         info;
+  vorbis_comment      comment;
+  vorbis_dsp_state    dsp;
+  vorbis_block        block;
+  bool                vorbis_headers = false;
+  bool                vorbis_ready = false;
+  int64_t             packetno = 0;
+
+  ~state()
+  {
+    if (opus)
+      opus_multistream_decoder_destroy(opus);
+    if (vorbis_ready)
+    {
+      vorbis_block_clear(&block);
+      vorbis_dsp_clear(&dsp);
+    }
+    if (vorbis_headers)
+    {
+      vorbis_comment_clear(&comment);
+      vorbis_info_clear(&info);
+    }
+  }
+
+  void  init_opus(std::vector<uint8_t> const& head);
+  void  init_vorbis(std::vector<uint8_t> const& headers);
+};
+
+// OpusHead: magic, version, channels, pre-skip, input rate, output gain,
+// channel mapping family and for families other than 0 the mapping table
+void  audio_decoder::state::init_opus(std::vector<uint8_t> const& head)
+{
+  if (head.size() < 19 || memcmp(head.data(), "OpusHead", 8) != 0)
+    throw std::runtime_error("[OPUS] missing OpusHead");
+
+  channels = head[9];
+  const int16_t gain = (int16_t)(head[16] | head[17] << 8);
+  const uint8_t family = head[18];
+  int streams = 1;
+  int coupled = channels > 1 ? 1 : 0;
+  unsigned char mapping[255] = {0, 1};
+  if (family != 0)
+  {
+    if (head.size() < 21u + channels)
+      throw std::runtime_error("[OPUS] truncated channel mapping");
+    streams = head[19];
+    coupled = head[20];
+    memcpy(mapping, &head[21], channels);
+  }
+  else if (channels < 1 || channels > 2)
+    throw std::runtime_error("[OPUS] bad channel count");
+
+  int error = OPUS_OK;
+  opus = opus_multistream_decoder_create(opus_rate, channels, streams, coupled, mapping, &error);
+  if (error != OPUS_OK)
+    throw std::runtime_error(std::string("[OPUS] failed to initialize decoder: ") + opus_strerror(error));
+  if (gain)
+    opus_multistream_decoder_ctl(opus, OPUS_SET_GAIN(gain));
+  rate = opus_rate;
+}
+
+// CodecPrivate holds the identification, comment and setup headers with
+// Xiph lacing: the packet count - 1, then the sizes of all but the last
+// packet as runs of 255 ending in a smaller byte
+void  audio_decoder::state::init_vorbis(std::vector<uint8_t> const& headers)
+{
+  const uint8_t* data = headers.data();
+  const size_t size = headers.size();
+  if (size < 1 || data[0] != 2)
+    throw std::runtime_error("[VORBIS] bad codec private data");
+
+  size_t sizes[3] = {};
+  size_t pos = 1;
+  for (int i = 0; i < 2; ++i)
+  {
+    uint8_t b;
+    do {
+      if (pos >= size)
+        throw std::runtime_error("[VORBIS] bad codec private data");
+      b = data[pos++];
+      sizes[i] += b;
+    } while (b == 255);
+  }
+  if (pos + sizes[0] + sizes[1] > size)
+    throw std::runtime_error("[VORBIS] bad codec private data");
+  sizes[2] = size - pos - sizes[0] - sizes[1];
+
+  vorbis_info_init(&info);
+  vorbis_comment_init(&comment);
+  vorbis_headers = true;
+  for (int i = 0; i < 3; ++i)
+  {
+    ogg_packet op = {};
+    op.packet = const_cast<unsigned char*>(data + pos);
+    op.bytes = (long)sizes[i];
+    op.b_o_s = i == 0;
+    op.packetno = i;
+    if (vorbis_synthesis_headerin(&info, &comment, &op) < 0)
+      throw std::runtime_error("[VORBIS] bad header packet");
+    pos += sizes[i];
+  }
+
+  if (vorbis_synthesis_init(&dsp, &info) != 0)
+    throw std::runtime_error("[VORBIS] failed to initialize decoder");
+  vorbis_block_init(&dsp, &block);
+  vorbis_ready = true;
+  rate = (uint32_t)info.rate;
+  channels = (uint32_t)info.channels;
+  packetno = 3;
+}
+
+audio_decoder::audio_decoder(demux::audio_info const& info)
+  : impl(new state)
+{
+  if (info.id == demux::codec::opus)
+    impl->init_opus(info.private_data);
+  else if (info.id == demux::codec::vorbis)
+    impl->init_vorbis(info.private_data);
+  else
+    throw std::runtime_error("[AUDIO] unsupported codec");
+}
+
+audio_decoder::~audio_decoder() = default;
+
+uint32_t  audio_decoder::sample_rate() const
+{
+  return impl->rate;
+}
+
+uint32_t  audio_decoder::channels() const
+{
+  return impl->channels;
+}
+
+size_t  audio_decoder::decode(demux::packet const& pkt, std::vector<float>& pcm)
+{
+  state& s = *impl;
+  const size_t base = pcm.size();
+  if (s.opus)
+  {
+    pcm.resize(base + opus_max_frames * s.channels);
+    const int frames = opus_multistream_decode_float(s.opus, pkt.data.data(), (opus_int32)pkt.data.size(),
+                                                     pcm.data() + base, opus_max_frames, 0);
+    if (frames < 0)
+    {
+      pcm.resize(base);
+      throw std::runtime_error(std::string("[OPUS] failed to decode packet: ") + opus_strerror(frames));
+    }
+    pcm.resize(base + frames * s.channels);
+    return frames;
+  }
+
+  ogg_packet op = {};
+  op.packet = const_cast<unsigned char*>(pkt.data.data());
+  op.bytes = (long)pkt.data.size();
+  op.granulepos = -1;
+  op.packetno = s.packetno++;
+  if (vorbis_synthesis(&s.block, &op) != 0)
+    throw std::runtime_error("[VORBIS] failed to decode packet");
+  vorbis_synthesis_blockin(&s.dsp, &s.block);
+
+  size_t total = 0;
+  float** channels = nullptr;
+  int frames;
+  while ((frames = vorbis_synthesis_pcmout(&s.dsp, &channels)) > 0)
+  {
+    const size_t at = pcm.size();
+    pcm.resize(at + frames * s.channels);
+    for (int i = 0; i < frames; ++i)
+      for (uint32_t c = 0; c < s.channels; ++c)
+        pcm[at + i * s.channels + c] = channels[c][i];
+    vorbis_synthesis_read(&s.dsp, frames);
+    total += frames;
+  }
+  return total;
+}
+
+void  audio_decoder::reset()
+{
+  if (impl->opus)
+    opus_multistream_decoder_ctl(impl->opus, OPUS_RESET_STATE);
+  else
+    vorbis_synthesis_restart(&impl->dsp);
+}
+
+struct bit_reader
+{
+  const uint8_t*  data;
+  size_t          size;
+  size_t          pos = 0;
+
+  uint32_t  read(int bits)
+  {
+    uint32_t value = 0;
+    for (; bits > 0; --bits, ++pos)
+    {
+      size_t byte = pos >> 3;
+      uint32_t bit = byte < size ? (data[byte] >> (7 - (pos & 7))) & 1 : 0;
+      value = (value << 1) | bit;
+    }
+    return value;
+  }
+};
+
+// reads the VP9 uncompressed header up to refresh_frame_flags
+static bool  vp9_frame_is_reference(const uint8_t* data, size_t size)
+{
+  bit_reader br {data, size};
+  if (br.read(2) != 2)
+    return true;
+
+  uint32_t profile = br.read(1);
+  profile |= br.read(1) << 1;
+  if (profile == 3)
+    br.read(1);
+  if (br.read(1))       // show_existing_frame
+    return false;
+
+  const bool keyframe = br.read(1) == 0;
+  const bool showFrame = br.read(1);
+  const bool errorResilient = br.read(1);
+  if (keyframe)
+    return true;
+
+  const bool intraOnly = showFrame ? false : br.read(1);
+  if (!errorResilient)
+    br.read(2);         // reset_frame_context
+  if (intraOnly)
+  {
+    br.read(24);        // sync code
+    if (profile > 0)
+    {
+      if (profile >= 2)
+        br.read(1);     // bit depth
+      const bool odd = profile == 1 || profile == 3;
+      if (br.read(3) != 7)    // color space other than sRGB
+        br.read(odd ? 4 : 1);
+      else if (odd)
+        br.read(1);
+    }
+  }
+  return br.read(8) != 0;     // refresh_frame_flags
+}
+
+bool  is_droppable(demux::codec codec, demux::packet const& pkt)
+{
+  if (codec != demux::codec::vp9 || pkt.keyframe || pkt.data.empty())
+    return false;
+
+  const uint8_t* data = pkt.data.data();
+  const size_t size = pkt.data.size();
+
+  // a superframe is droppable only when none of its frames is a reference
+  const uint8_t marker = data[size - 1];
+  if ((marker & 0xe0) == 0xc0)
+  {
+    const uint32_t framesNum = (marker & 7) + 1;
+    const uint32_t mag = ((marker >> 3) & 3) + 1;
+    const size_t indexSize = 2 + mag * framesNum;
+    if (size >= indexSize && data[size - indexSize] == marker)
+    {
+      const uint8_t* sizes = data + size - indexSize + 1;
+      size_t offset = 0;
+      for (uint32_t f = 0; f < framesNum; ++f, sizes += mag)
+      {
+        size_t frameSize = 0;
+        for (uint32_t b = 0; b < mag; ++b)
+          frameSize |= (size_t)sizes[b] << (8 * b);
+        if (offset + frameSize > size - indexSize ||
+            vp9_frame_is_reference(data + offset, frameSize))
+          return false;
+        offset += frameSize;
+      }
+      return true;
+    }
+  }
+  return !vp9_frame_is_reference(data, size);
+}
+
+bool  is_keyframe(demux::codec codec, demux::packet const& pkt)
+{
+  if (pkt.data.empty())
+    return false;
+  // the VP8 frame tag starts with the inverse keyframe bit
+  if (codec == demux::codec::vp8)
+    return (pkt.data[0] & 1) == 0;
+  if (codec != demux::codec::vp9)
+    return false;
+
+  // the first frame of a superframe is the one that decides
+  bit_reader br {pkt.data.data(), pkt.data.size()};
+  if (br.read(2) != 2)
+    return false;
+  uint32_t profile = br.read(1);
+  profile |= br.read(1) << 1;
+  if (profile == 3)
+    br.read(1);
+  if (br.read(1))       // show_existing_frame
+    return false;
+  return br.read(1) == 0;
+}
+
+} // namespace decode
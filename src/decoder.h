@@ -0,0 +1,67 @@
+#pragma once
+
+#include "demux.h"
+#include "frame.h"
+
+#include <memory>
+#include <vector>
+
+namespace decode
+{
+  // libvpx VP8/VP9 decoder. Throws std::runtime_error on setup and decode
+  // errors.
+  class vpx_decoder
+  {
+  public:
+    vpx_decoder(demux::codec codec, unsigned threads_num);
+    ~vpx_decoder();
+    vpx_decoder(vpx_decoder const&) = delete;
+    vpx_decoder& operator=(vpx_decoder const&) = delete;
+
+    // Returns false when the packet produced no picture (e.g. a hidden
+    // alt-ref frame). The picture stays valid until the next decode() call.
+    bool  decode(demux::packet const& pkt, video_frame& picture);
+
+    // VP9 only, trades quality for decode speed
+    void  skip_loop_filter(bool skip);
+
+  private:
+    struct state;
+    std::unique_ptr<state>  impl;
+  };
+
+  // libopus / libvorbis decoder of an audio track, producing interleaved
+  // float samples. Throws std::runtime_error on setup and decode errors.
+  class audio_decoder
+  {
+  public:
+    explicit audio_decoder(demux::audio_info const& info);
+    ~audio_decoder();
+    audio_decoder(audio_decoder const&) = delete;
+    audio_decoder& operator=(audio_decoder const&) = delete;
+
+    // Opus always decodes at 48 kHz
+    uint32_t  sample_rate() const;
+    uint32_t  channels() const;
+
+    // Appends the decoded sample frames to pcm and returns their number.
+    // Vorbis overlaps consecutive packets, the first packet after a reset
+    // yields nothing.
+    size_t  decode(demux::packet const& pkt, std::vector<float>& pcm);
+    // forgets the previous packets, before decoding from another position
+    void    reset();
+
+  private:
+    struct state;
+    std::unique_ptr<state>  impl;
+  };
+
+  // True when no later frame can reference the packet, so it can be dropped
+  // without corrupting the following ones. Only VP9 headers are parsed,
+  // VP8 packets are always reported as references.
+  bool  is_droppable(demux::codec codec, demux::packet const& pkt);
+
+  // Reads the keyframe flag from the VP8 or VP9 frame header, for containers
+  // that don't carry it.
+  bool  is_keyframe(demux::codec codec, demux::packet const& pkt);
+}
@@ -0,0 +1,300 @@
+#include "demux.h"
+
+#include  <mkvparser/mkvparser.h>
+#include  <mkvparser/mkvreader.h>
+
+#include  <algorithm>
+#include  <stdexcept>
+#include  <string>
+#include  <string.h>
+
+namespace demux
+{
+
+struct webm_reader::state
+{
+  std::string             path;
+  mkvparser::MkvReader    reader;
+  mkvparser::Segment*     segment = nullptr;
+  const mkvparser::Track* track = nullptr;
+  codec                   track_codec = codec::unknown;
+  bool                    loaded = false;
+
+  // sequential read position: frames of entry from frame_idx on are next
+  bool                          started = false;
+  const mkvparser::Cluster*     cluster = nullptr;
+  const mkvparser::BlockEntry*  entry = nullptr;
+  int                           frame_idx = 0;
+
+  ~state()
+  {
+    delete segment;
+    reader.Close();
+  }
+
+  void  check(long long status, const char* what) const
+  {
+    if (status < 0)
+      throw std::runtime_error("[DEMUX] " + path + ": " + what);
+  }
+
+  // Cluster headers are parsed lazily: keyframe extraction through the
+  // cues only touches the clusters it needs, sequential reads need all.
+  void  load_clusters()
+  {
+    if (loaded)
+      return;
+    check(segment->Load(), "failed to load clusters");
+    loaded = true;
+  }
+
+  const mkvparser::Cues*  load_cues()
+  {
+    const mkvparser::Cues* cues = segment->GetCues();
+    if (!cues)
+      return nullptr;
+    while (!cues->DoneParsing())
+      cues->LoadCuePoint();
+    return cues;
+  }
+
+  bool  in_track(const mkvparser::BlockEntry* e) const
+  {
+    const mkvparser::Block* block = e->GetBlock();
+    return block && block->GetTrackNumber() == track->GetNumber();
+  }
+
+  // keyframe entry at or before time_ns, through the cues when there are any
+  const mkvparser::BlockEntry*  find_keyframe(int64_t time_ns)
+  {
+    if (const mkvparser::Cues* cues = load_cues())
+    {
+      const mkvparser::CuePoint* cp = nullptr;
+      const mkvparser::CuePoint::TrackPosition* tp = nullptr;
+      if (cues->Find(time_ns, track, cp, tp))
+      {
+        const mkvparser::BlockEntry* e = cues->GetBlock(cp, tp);
+        if (e && !e->EOS())
+          return e;
+      }
+    }
+
+    load_clusters();
+    const mkvparser::BlockEntry* e = nullptr;
+    if (track->Seek(time_ns, e) < 0 || !e || e->EOS())
+      return nullptr;
+    return e;
+  }
+
+  bool  read_frame(const mkvparser::BlockEntry* e, int idx, packet& pkt)
+  {
+    const mkvparser::Block* block = e->GetBlock();
+    const mkvparser::Block::Frame& frame = block->GetFrame(idx);
+
+    pkt.data.resize(frame.len);
+    if (frame.Read(&reader, pkt.data.data()) < 0)
+      return false;
+    pkt.time_ns = block->GetTime(e->GetCluster());
+    pkt.keyframe = block->IsKey();
+    return true;
+  }
+
+  // advances the read position to the next block of the track
+  bool  next_entry()
+  {
+    while (cluster && !cluster->EOS())
+    {
+      long status = entry ? cluster->GetNext(entry, entry)
+                          : cluster->GetFirst(entry);
+      if (status < 0)
+        return false;
+
+      if (!entry || entry->EOS())
+      {
+        cluster = segment->GetNext(cluster);
+        entry = nullptr;
+        continue;
+      }
+
+      if (in_track(entry))
+      {
+        frame_idx = 0;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+static codec  to_codec(const char* id)
+{
+  if (!id)
+    return codec::unknown;
+  if (!strcmp(id, "V_VP8"))
+    return codec::vp8;
+  if (!strcmp(id, "V_VP9"))
+    return codec::vp9;
+  if (!strcmp(id, "A_OPUS"))
+    return codec::opus;
+  if (!strcmp(id, "A_VORBIS"))
+    return codec::vorbis;
+  return codec::unknown;
+}
+
+webm_reader::webm_reader(const char* path, track_type type)
+  : impl(new state)
+{
+  impl->path = path;
+  if (impl->reader.Open(path))
+    throw std::runtime_error(std::string("[DEMUX] failed to open ") + path);
+
+  long long pos = 0;
+  mkvparser::EBMLHeader header;
+  impl->check(header.Parse(&impl->reader, pos), "not an EBML file");
+  if (mkvparser::Segment::CreateInstance(&impl->reader, pos, impl->segment) != 0)
+    impl->check(-1, "no segment");
+  impl->check(impl->segment->ParseHeaders(), "failed to parse segment headers");
+
+  const long kind = type == track_type::video ? mkvparser::Track::kVideo
+                                              : mkvparser::Track::kAudio;
+  const mkvparser::Tracks* tracks = impl->segment->GetTracks();
+  for (unsigned long i = 0; tracks && i < tracks->GetTracksCount(); ++i)
+  {
+    const mkvparser::Track* track = tracks->GetTrackByIndex(i);
+    if (track && track->GetType() == kind)
+    {
+      impl->track = track;
+      break;
+    }
+  }
+  if (!impl->track)
+    impl->check(-1, type == track_type::video ? "no video track" : "no audio track");
+
+  impl->track_codec = to_codec(impl->track->GetCodecId());
+}
+
+webm_reader::~webm_reader() = default;
+
+codec  webm_reader::video_codec() const
+{
+  return impl->track_codec;
+}
+
+uint32_t  webm_reader::width() const
+{
+  return static_cast<const mkvparser::VideoTrack*>(impl->track)->GetWidth();
+}
+
+uint32_t  webm_reader::height() const
+{
+  return static_cast<const mkvparser::VideoTrack*>(impl->track)->GetHeight();
+}
+
+audio_info  webm_reader::audio() const
+{
+  const mkvparser::AudioTrack* track = static_cast<const mkvparser::AudioTrack*>(impl->track);
+  audio_info info;
+  info.id = impl->track_codec;
+  info.sample_rate = (uint32_t)track->GetSamplingRate();
+  info.channels = (uint32_t)track->GetChannels();
+  size_t size = 0;
+  if (const unsigned char* data = track->GetCodecPrivate(size))
+    info.private_data.assign(data, data + size);
+  info.codec_delay_ns = (int64_t)track->GetCodecDelay();
+  info.seek_preroll_ns = (int64_t)track->GetSeekPreRoll();
+  return info;
+}
+
+bool  webm_reader::has_audio() const
+{
+  const mkvparser::Tracks* tracks = impl->segment->GetTracks();
+  for (unsigned long i = 0; tracks && i < tracks->GetTracksCount(); ++i)
+  {
+    const mkvparser::Track* track = tracks->GetTrackByIndex(i);
+    if (track && track->GetType() == mkvparser::Track::kAudio)
+      return true;
+  }
+  return false;
+}
+
+int64_t  webm_reader::duration_ns() const
+{
+  const mkvparser::SegmentInfo* info = impl->segment->GetInfo();
+  return info ? std::max(0ll, info->GetDuration()) : 0;
+}
+
+std::vector<int64_t>  webm_reader::keyframes()
+{
+  std::vector<int64_t> result;
+
+  if (const mkvparser::Cues* cues = impl->load_cues())
+  {
+    for (const mkvparser::CuePoint* cp = cues->GetFirst(); cp; cp = cues->GetNext(cp))
+    {
+      if (cp->Find(impl->track))
+        result.push_back(cp->GetTime(impl->segment));
+    }
+    if (!result.empty())
+      return result;
+  }
+
+  impl->load_clusters();
+  const mkvparser::Cluster* cluster = impl->segment->GetFirst();
+  while (cluster && !cluster->EOS())
+  {
+    const mkvparser::BlockEntry* e = nullptr;
+    cluster->GetFirst(e);
+    while (e && !e->EOS())
+    {
+      if (impl->in_track(e) && e->GetBlock()->IsKey())
+        result.push_back(e->GetBlock()->GetTime(cluster));
+      if (cluster->GetNext(e, e) < 0)
+        break;
+    }
+    cluster = impl->segment->GetNext(cluster);
+  }
+  return result;
+}
+
+bool  webm_reader::read_keyframe(int64_t time_ns, packet& pkt)
+{
+  const mkvparser::BlockEntry* e = impl->find_keyframe(time_ns);
+  return e && impl->read_frame(e, 0, pkt);
+}
+
+bool  webm_reader::read(packet& pkt)
+{
+  if (!impl->started)
+  {
+    impl->load_clusters();
+    impl->cluster = impl->segment->GetFirst();
+    impl->entry = nullptr;
+    impl->started = true;
+  }
+
+  while (!impl->entry ||
+         impl->frame_idx >= impl->entry->GetBlock()->GetFrameCount())
+  {
+    if (!impl->next_entry())
+      return false;
+  }
+  return impl->read_frame(impl->entry, impl->frame_idx++, pkt);
+}
+
+void  webm_reader::seek(int64_t time_ns)
+{
+  impl->load_clusters();
+  impl->started = true;
+  const mkvparser::BlockEntry* e = impl->find_keyframe(std::max<int64_t>(0, time_ns));
+  if (!e)
+  {
+    impl->cluster = impl->segment->GetFirst();
+    impl->entry = nullptr;
+    return;
+  }
+  impl->cluster = e->GetCluster();
+  impl->entry = e;
+  impl->frame_idx = 0;
+}
+
+} // namespace demux
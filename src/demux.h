@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+namespace demux
+{
+  enum class codec
+  {
+    unknown,
+    vp8,
+    vp9,
+    opus,
+    vorbis
+  };
+
+  enum class track_type
+  {
+    video,
+    audio
+  };
+
+  struct audio_info
+  {
+    codec                 id = codec::unknown;
+    uint32_t              sample_rate = 0;
+    uint32_t              channels = 0;
+    // CodecPrivate: the OpusHead, or the three Xiph-laced Vorbis headers
+    std::vector<uint8_t>  private_data;
+    // Opus pre-skip, subtracted from the block times
+    int64_t               codec_delay_ns = 0;
+    // decoding has to start this much before a seek target to converge
+    int64_t               seek_preroll_ns = 0;
+  };
+
+  struct packet
+  {
+    std::vector<uint8_t>  data;
+    int64_t               time_ns = 0;
+    bool                  keyframe = false;
+  };
+
+  // Reads the first video (or audio) track of a WebM file through libwebm's
+  // mkvparser. Throws std::runtime_error when the file can't be opened or
+  // parsed, or has no such track.
+  class webm_reader
+  {
+  public:
+    explicit webm_reader(const char* path, track_type type = track_type::video);
+    ~webm_reader();
+    webm_reader(webm_reader const&) = delete;
+    webm_reader& operator=(webm_reader const&) = delete;
+
+    // video track only
+    codec     video_codec() const;
+    uint32_t  width() const;
+    uint32_t  height() const;
+    // audio track only
+    audio_info  audio() const;
+
+    int64_t   duration_ns() const;
+    bool      has_audio() const;
+
+    // Keyframe times from the cue index. Files without cues are scanned,
+    // which has to walk every cluster.
+    std::vector<int64_t>  keyframes();
+
+    // the last keyframe at or before time_ns, without touching the
+    // sequential read position
+    bool  read_keyframe(int64_t time_ns, packet& pkt);
+
+    // sequential read of the track
+    bool  read(packet& pkt);
+    // moves the sequential read position to the keyframe at or before time_ns
+    void  seek(int64_t time_ns);
+
+  private:
+    struct state;
+    std::unique_ptr<state>  impl;
+  };
+}
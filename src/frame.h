@@ -0,0 +1,120 @@
+#pragma once
+
+#include "hostmem.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+// Y'CbCr to RGB conversion matrix
+enum class color_matrix : uint8_t
+{
+  bt601,
+  bt709,
+  bt2020
+};
+
+// Decoded 8-bit 4:2:0 picture. Planes are owned by the producer and only
+// have to stay valid for the duration of the call they are passed to.
+struct video_frame
+{
+  uint32_t        width = 0;
+  uint32_t        height = 0;
+  const uint8_t*  planes[3] = {};
+  int             strides[3] = {};
+  color_matrix    matrix = color_matrix::bt709;
+  bool            full_range = false;
+  uint8_t         bit_depth = 8;
+  // set when the planes lie in a hostmem block the renderer may import
+  const uint8_t*  host_block = nullptr;
+  size_t          host_block_size = 0;
+};
+
+// Owned copy of a decoded frame with tightly packed planes, so it can be
+// queued while the decoder reuses its buffers. The planes share one hostmem
+// block, each starting 16-byte aligned.
+struct video_picture
+{
+  int64_t               time_ns = 0;
+  uint32_t              width = 0;
+  uint32_t              height = 0;
+  color_matrix          matrix = color_matrix::bt709;
+  bool                  full_range = false;
+  uint8_t               bit_depth = 8;
+  hostmem::block        memory;
+  size_t                offsets[3] = {};
+  // the GPU reads the planes until this frame completes its upload stage,
+  // see v3d::upload_host_frame()
+  uint64_t              gpu_serial = 0;
+
+  void  assign(video_frame const& frame, int64_t time)
+  {
+    time_ns = time;
+    width = frame.width;
+    height = frame.height;
+    matrix = frame.matrix;
+    full_range = frame.full_range;
+    bit_depth = frame.bit_depth;
+    gpu_serial = 0;
+
+    size_t size = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+      offsets[i] = size;
+      size += ((size_t)stride(i) * plane_height(i) + 15) & ~(size_t)15;
+    }
+    memory.reserve(size);
+    for (int i = 0; i < 3; ++i)
+    {
+      const uint32_t w = stride(i);
+      for (uint32_t y = 0; y < plane_height(i); ++y)
+        memcpy(memory.data() + offsets[i] + y * w, frame.planes[i] + y * frame.strides[i], w);
+    }
+  }
+
+  video_frame  frame() const
+  {
+    video_frame result;
+    result.width = width;
+    result.height = height;
+    result.matrix = matrix;
+    result.full_range = full_range;
+    result.bit_depth = bit_depth;
+    for (int i = 0; i < 3; ++i)
+    {
+      result.planes[i] = memory.data() + offsets[i];
+      result.strides[i] = stride(i);
+    }
+    result.host_block = memory.data();
+    result.host_block_size = memory.size();
+    return result;
+  }
+
+  uint32_t  stride(int plane) const { return plane == 0 ? width : (width + 1) / 2; }
+  uint32_t  plane_height(int plane) const { return plane == 0 ? height : (height + 1) / 2; }
+};
+
+// Takes a spare picture whose planes the GPU no longer reads, or returns
+// nullptr. completed is the last frame done with its upload stage. With
+// NUMA placement a picture on the calling thread's node comes first.
+inline std::unique_ptr<video_picture>  take_spare(std::vector<std::unique_ptr<video_picture>>& spare,
+                                                  uint64_t completed)
+{
+  const int node = hostmem::local_node();
+  size_t found = spare.size();
+  for (size_t i = spare.size(); i-- > 0;)
+  {
+    if (spare[i]->gpu_serial > completed)
+      continue;
+    if (found == spare.size() || spare[i]->memory.node() == node)
+      found = i;
+    if (spare[i]->memory.node() == node)
+      break;
+  }
+  if (found == spare.size())
+    return nullptr;
+  std::unique_ptr<video_picture> pic = std::move(spare[found]);
+  spare.erase(spare.begin() + found);
+  return pic;
+}
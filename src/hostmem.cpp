@@ -0,0 +1,151 @@
+#include "hostmem.h"
+
+#include  <algorithm>
+#include  <atomic>
+#include  <errno.h>
+#include  <new>
+#include  <stdio.h>
+#include  <stdlib.h>
+#include  <string.h>
+#include  <sys/mman.h>
+#include  <sys/syscall.h>
+#include  <unistd.h>
+
+namespace hostmem
+{
+
+static const size_t  huge_page_size = 2 << 20;
+
+// from <numaif.h>, which comes with libnuma's headers
+static const int       mpol_preferred = 1;
+static const unsigned  mpol_mf_move = 1 << 1;
+static const unsigned  numa_max_nodes = 1024;
+
+static std::atomic<size_t>        block_alignment {0};
+static std::atomic<page_mode>     pages {page_mode::normal};
+static std::atomic<bool>          numa_local {false};
+static std::atomic<bool>          hugetlb_warned {false};
+static std::atomic<release_hook>  hook {nullptr};
+
+static size_t  page_size()
+{
+  static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+void  set_alignment(size_t alignment)
+{
+  block_alignment = std::max(alignment, page_size());
+}
+
+size_t  alignment()
+{
+  const size_t alignment = block_alignment;
+  return alignment ? alignment : page_size();
+}
+
+void  set_page_mode(page_mode mode)
+{
+  pages = mode;
+}
+
+void  set_numa_local(bool enabled)
+{
+  numa_local = enabled;
+}
+
+int  local_node()
+{
+  if (!numa_local)
+    return -1;
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+    return -1;
+  return (int)node;
+}
+
+void  set_release_hook(release_hook h)
+{
+  hook = h;
+}
+
+// Prefers the node for new pages and moves the ones already faulted in,
+// which posix_memalign() may hand back from an earlier block. Pages still
+// come from elsewhere when the node is out of memory. False when the
+// policy couldn't be set.
+static bool  place_on_node(void* p, size_t size, int node)
+{
+  if (node < 0 || node >= (int)numa_max_nodes)
+    return false;
+  unsigned long mask[numa_max_nodes / (8 * sizeof(unsigned long))] = {};
+  mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, p, size, mpol_preferred, mask, (unsigned long)numa_max_nodes,
+                 mpol_mf_move) == 0;
+}
+
+block::~block()
+{
+  release();
+}
+
+void  block::reserve(size_t size)
+{
+  // pictures smaller than half a huge page would mostly waste it
+  const page_mode mode = pages;
+  const bool huge = mode != page_mode::normal && size >= huge_page_size / 2;
+  const size_t align = huge ? std::max(alignment(), huge_page_size) : alignment();
+  // a block from before an alignment change is replaced, so it can be imported
+  if (size <= capacity && (uintptr_t)ptr % align == 0 && capacity % align == 0)
+    return;
+
+  release();
+  const size_t rounded = (size + align - 1) / align * align;
+  void* p = nullptr;
+  if (huge && mode == page_mode::explicit_huge)
+  {
+    p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED)
+    {
+      p = nullptr;
+      if (!hugetlb_warned.exchange(true))
+        printf("[HOSTMEM] no explicit huge pages available (%s), using transparent ones\n",
+               strerror(errno));
+    }
+    else
+      mapped = true;
+  }
+  if (!p)
+  {
+    if (posix_memalign(&p, align, rounded) != 0)
+      throw std::bad_alloc();
+    if (huge)
+      madvise(p, rounded, MADV_HUGEPAGE);
+  }
+  ptr = (uint8_t*)p;
+  capacity = rounded;
+
+  // not counted as local when the kernel wouldn't place it
+  numa_node = local_node();
+  if (!place_on_node(ptr, capacity, numa_node))
+    numa_node = -1;
+}
+
+void  block::release()
+{
+  if (!ptr)
+    return;
+  if (release_hook h = hook)
+    h(ptr);
+  if (mapped)
+    munmap(ptr, capacity);
+  else
+    free(ptr);
+  ptr = nullptr;
+  capacity = 0;
+  mapped = false;
+  numa_node = -1;
+}
+
+} // namespace hostmem
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Aligned host memory for decoded pictures. The renderer can import such
+// blocks (VK_EXT_external_memory_host) and copy from them on the GPU, which
+// needs the address and size aligned to the device's
+// minImportedHostPointerAlignment.
+namespace hostmem
+{
+  // Alignment of blocks allocated from now on, never below the page size.
+  void    set_alignment(size_t alignment);
+  size_t  alignment();
+
+  // Backing of blocks of a huge page or more; a 4K picture spans thousands
+  // of 4K pages otherwise. Explicit huge pages come from the hugetlbfs pool
+  // (vm.nr_hugepages) and fall back to transparent ones when it is empty.
+  enum class page_mode
+  {
+    normal,
+    transparent_huge,
+    explicit_huge
+  };
+  void  set_page_mode(page_mode mode);
+
+  // Places new blocks on the NUMA node of the allocating thread, which is
+  // the decode task that writes them.
+  void  set_numa_local(bool enabled);
+  // node of the calling thread, -1 without NUMA placement
+  int   local_node();
+
+  // Called with every block about to be freed, so an importer can wait for
+  // the GPU and drop its import first. May be called from any thread.
+  using release_hook = void (*)(const void* data);
+  void  set_release_hook(release_hook hook);
+
+  class block
+  {
+  public:
+    block() = default;
+    ~block();
+    block(block const&) = delete;
+    block& operator=(block const&) = delete;
+
+    // Keeps the block (and its address) when it is large enough already,
+    // the contents are not preserved otherwise.
+    void  reserve(size_t size);
+
+    uint8_t*        data() { return ptr; }
+    const uint8_t*  data() const { return ptr; }
+    // the allocated size, a multiple of the alignment
+    size_t          size() const { return capacity; }
+    // NUMA node the block was placed on, -1 without NUMA placement
+    int             node() const { return numa_node; }
+
+  private:
+    void  release();
+
+    uint8_t*  ptr = nullptr;
+    size_t    capacity = 0;
+    bool      mapped = false;     // hugetlbfs mapping rather than the heap
+    int       numa_node = -1;
+  };
+}
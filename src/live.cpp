@@ -0,0 +1,553 @@
+#include "live.h"
+#include "demux.h"
+#include "decoder.h"
+#include "tasks.h"
+#include "telemetry.h"
+#include "v3d.h"
+
+#include  <webm/callback.h>
+#include  <webm/reader.h>
+#include  <webm/status.h>
+#include  <webm/webm_parser.h>
+
+#include  <algorithm>
+#include  <atomic>
+#include  <chrono>
+#include  <deque>
+#include  <mutex>
+#include  <stdexcept>
+#include  <string>
+#include  <thread>
+#include  <vector>
+#include  <errno.h>
+#include  <fcntl.h>
+#include  <poll.h>
+#include  <stdio.h>
+#include  <string.h>
+#include  <unistd.h>
+
+namespace playback
+{
+
+using steady = std::chrono::steady_clock;
+
+static const uint32_t  queue_capacity = 4;
+// beyond this many packets the oldest GOP is thrown away even if the
+// presentation side never asked for it
+static const size_t    jitter_capacity = 1024;
+// ingest wakes up this often to notice a shutdown on an idle pipe
+static const int       poll_timeout_ms = 100;
+// lag above chase_factor * latency plays faster, above skip_factor * latency
+// jumps to the newest keyframe; the next jump waits until the lag fell back
+// below chase_factor * latency
+static const int64_t   chase_factor = 2;
+static const int64_t   skip_factor = 8;
+static const double    chase_rate = 1.25;
+static const steady::duration  report_interval = std::chrono::seconds(5);
+
+// webm::Reader over a pipe. Returns kWouldBlock while no data arrives so the
+// ingest loop can check for shutdown between Feed() calls.
+class pipe_reader : public webm::Reader
+{
+public:
+  pipe_reader(int fd, std::atomic<bool> const& stop) : fd(fd), stop(stop) {}
+  ~pipe_reader() override { close(fd); }
+
+  webm::Status  Read(std::size_t num_to_read, std::uint8_t* buffer,
+                     std::uint64_t* num_actually_read) override
+  {
+    *num_actually_read = 0;
+    while (num_to_read > 0)
+    {
+      pollfd pfd {fd, POLLIN, 0};
+      int ready = poll(&pfd, 1, poll_timeout_ms);
+      if (ready < 0 && errno != EINTR)
+        throw std::runtime_error(std::string("[LIVE] poll failed: ") + strerror(errno));
+      if (ready <= 0 || stop)
+        break;
+
+      ssize_t n = read(fd, buffer, num_to_read);
+      if (n < 0)
+      {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        throw std::runtime_error(std::string("[LIVE] read failed: ") + strerror(errno));
+      }
+      if (n == 0)
+        return webm::Status(*num_actually_read ? webm::Status::kOkPartial
+                                               : webm::Status::kEndOfFile);
+      *num_actually_read += n;
+      position += n;
+      buffer += n;
+      num_to_read -= n;
+    }
+    if (num_to_read == 0)
+      return webm::Status(webm::Status::kOkCompleted);
+    return webm::Status(*num_actually_read ? webm::Status::kOkPartial
+                                           : webm::Status::kWouldBlock);
+  }
+
+  webm::Status  Skip(std::uint64_t num_to_skip, std::uint64_t* num_actually_skipped) override
+  {
+    *num_actually_skipped = 0;
+    uint8_t scratch[4096];
+    while (num_to_skip > 0)
+    {
+      std::uint64_t n = 0;
+      webm::Status status = Read(std::min<std::uint64_t>(num_to_skip, sizeof(scratch)), scratch, &n);
+      *num_actually_skipped += n;
+      num_to_skip -= n;
+      if (!status.completed_ok())
+        return *num_actually_skipped ? webm::Status(webm::Status::kOkPartial) : status;
+    }
+    return webm::Status(webm::Status::kOkCompleted);
+  }
+
+  std::uint64_t  Position() const override { return position; }
+
+private:
+  int                       fd;
+  std::atomic<bool> const&  stop;
+  std::uint64_t             position = 0;
+};
+
+struct live_player::state : public webm::Callback
+{
+  std::string   path;
+  int64_t       latency_ns;
+
+  // shared between ingest, decode task and main thread
+  mutable std::mutex                            lock;
+  std::deque<demux::packet>                     packets;      // jitter buffer
+  std::deque<std::unique_ptr<video_picture>>    queue;
+  std::vector<std::unique_ptr<video_picture>>   spare;
+  uint64_t                                      generation = 0;
+  demux::codec                                  codec = demux::codec::unknown;
+  int64_t                                       newest_ns = -1;
+  bool                                          ended = false;
+
+  std::thread                 ingest_thread;
+  tasks::group                decode_tasks;
+  std::atomic<bool>           decoding {false};
+  std::atomic<bool>           stop {false};
+  std::atomic<uint64_t>       received {0};
+  std::atomic<uint64_t>       decoded {0};
+  std::atomic<uint64_t>       skipped {0};
+
+  // ingest thread only
+  uint64_t        timecode_scale = 1000000;
+  uint64_t        video_track = 0;
+  demux::codec    track_codec = demux::codec::unknown;
+  int64_t         cluster_ns = 0;
+  bool            in_video_block = false;
+  bool            in_block_group = false;
+  demux::packet   pending;
+
+  // decode task only
+  std::unique_ptr<decode::vpx_decoder>  decoder;
+  bool                                  wait_keyframe = true;
+
+  // main thread only
+  bool                clock_started = false;
+  steady::time_point  anchor_wall;
+  int64_t             anchor_ns = 0;
+  double              rate = 1.0;
+  int64_t             lag_ns = 0;
+  bool                skip_armed = true;
+  uint64_t            presented = 0;
+  uint64_t            dropped = 0;
+  steady::time_point  last_report;
+  std::unique_ptr<video_picture>  shown;   // uploaded again after a device loss
+
+  state(const char* path, uint32_t latency_ms)
+    : path(path)
+    , latency_ns(int64_t(latency_ms) * 1000000)
+  {
+  }
+
+  void  ingest(int fd);
+  void  push_packet(demux::packet&& pkt);
+  size_t  drop_to_keyframe();
+
+  void  decode_some();
+  void  start_decoding();
+
+  int64_t  clock_at(steady::time_point now) const;
+  void  reanchor(steady::time_point now, int64_t position_ns, double new_rate);
+  void  chase(steady::time_point now);
+  void  report(steady::time_point now);
+
+  // webm::Callback
+  webm::Status  OnInfo(webm::ElementMetadata const&, webm::Info const& info) override
+  {
+    if (info.timecode_scale.is_present())
+      timecode_scale = info.timecode_scale.value();
+    return webm::Status(webm::Status::kOkCompleted);
+  }
+
+  webm::Status  OnTrackEntry(webm::ElementMetadata const&, webm::TrackEntry const& track) override
+  {
+    if (video_track || track.track_type.value() != webm::TrackType::kVideo)
+      return webm::Status(webm::Status::kOkCompleted);
+
+    demux::codec c = demux::codec::unknown;
+    if (track.codec_id.value() == "V_VP8")
+      c = demux::codec::vp8;
+    else if (track.codec_id.value() == "V_VP9")
+      c = demux::codec::vp9;
+    else
+      throw std::runtime_error("[LIVE] unsupported codec " + track.codec_id.value());
+
+    video_track = track.track_number.value();
+    track_codec = c;
+    printf("[LIVE] %s: %s %llux%llu\n", path.c_str(), track.codec_id.value().c_str(),
+           (unsigned long long)track.video.value().pixel_width.value(),
+           (unsigned long long)track.video.value().pixel_height.value());
+    std::lock_guard<std::mutex> guard(lock);
+    codec = c;
+    return webm::Status(webm::Status::kOkCompleted);
+  }
+
+  webm::Status  OnClusterBegin(webm::ElementMetadata const&, webm::Cluster const& cluster,
+                               webm::Action* action) override
+  {
+    cluster_ns = cluster.timecode.value() * timecode_scale;
+    *action = webm::Action::kRead;
+    return webm::Status(webm::Status::kOkCompleted);
+  }
+
+  webm::Status  begin_block(webm::Block const& block, bool keyframe, webm::Action* action)
+  {
+    in_video_block = video_track && block.track_number == video_track;
+    in_block_group = false;
+    *action = in_video_block ? webm::Action::kRead : webm::Action::kSkip;
+    pending.time_ns = cluster_ns + int64_t(block.timecode) * int64_t(timecode_scale);
+    pending.keyframe = keyframe;
+    return webm::Status(webm::Status::kOkCompleted);
+  }
+
+  webm::Status  OnSimpleBlockBegin(webm::ElementMetadata const&, webm::SimpleBlock const& block,
+                                   webm::Action* action) override
+  {
+    return begin_block(block, block.is_key_frame, action);
+  }
+
+  webm::Status  OnBlockBegin(webm::ElementMetadata const&, webm::Block const& block,
+                             webm::Action* action) override
+  {
+    // BlockGroups carry no keyframe flag, OnFrame() reads it from the
+    // frame header
+    webm::Status status = begin_block(block, false, action);
+    in_block_group = true;
+    return status;
+  }
+
+  // called again with the remaining size when the pipe ran dry mid-frame
+  webm::Status  OnFrame(webm::FrameMetadata const& metadata, webm::Reader* reader,
+                        std::uint64_t* bytes_remaining) override
+  {
+    if (!in_video_block)
+      return webm::Callback::OnFrame(metadata, reader, bytes_remaining);
+
+    const size_t offset = pending.data.size();
+    pending.data.resize(offset + *bytes_remaining);
+    std::uint64_t n = 0;
+    webm::Status status = reader->Read(*bytes_remaining, pending.data.data() + offset, &n);
+    *bytes_remaining -= n;
+    pending.data.resize(offset + n);
+    if (*bytes_remaining == 0 && status.completed_ok())
+    {
+      if (in_block_group)
+        pending.keyframe = decode::is_keyframe(track_codec, pending);
+      const int64_t time = pending.time_ns;
+      const bool keyframe = pending.keyframe;
+      push_packet(std::move(pending));
+      pending = demux::packet();
+      // laced frames share the block timestamp
+      pending.time_ns = time;
+      pending.keyframe = keyframe;
+    }
+    return status;
+  }
+};
+
+void  live_player::state::push_packet(demux::packet&& pkt)
+{
+  ++received;
+  std::lock_guard<std::mutex> guard(lock);
+  newest_ns = std::max(newest_ns, pkt.time_ns);
+  packets.push_back(std::move(pkt));
+  if (packets.size() > jitter_capacity)
+    drop_to_keyframe();
+}
+
+// Throws away everything before the newest buffered keyframe. The decode
+// task is still fine afterwards: the next packet it sees is that keyframe.
+// Returns the number of packets dropped. Expects the lock held.
+size_t  live_player::state::drop_to_keyframe()
+{
+  auto key = std::find_if(packets.rbegin(), packets.rend(),
+                          [] (demux::packet const& pkt) { return pkt.keyframe; });
+  if (key == packets.rend())
+    return 0;
+  const size_t count = packets.rend() - key - 1;
+  if (count == 0)
+    return 0;
+  packets.erase(packets.begin(), packets.begin() + count);
+  skipped += count;
+  telemetry::add(telemetry::counter::frames_skipped, count);
+
+  generation++;
+  for (auto& pic: queue)
+    spare.push_back(std::move(pic));
+  queue.clear();
+  return count;
+}
+
+void  live_player::state::ingest(int fd)
+{
+  try {
+    pipe_reader reader(fd, stop);
+    webm::WebmParser parser;
+    for (;;)
+    {
+      webm::Status status = parser.Feed(this, &reader);
+      if (stop || status.completed_ok())
+        break;
+      if (status.code == webm::Status::kEndOfFile)
+        break;
+      if (status.code != webm::Status::kWouldBlock && status.code != webm::Status::kOkPartial)
+      {
+        printf("[LIVE] %s: parse error %d\n", path.c_str(), (int)status.code);
+        break;
+      }
+    }
+  }
+  catch (std::exception const& e)
+  {
+    printf("%s\n", e.what());
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  ended = true;
+}
+
+// Runs on the task pool while there are packets and room in the queue;
+// update() starts it again.
+void  live_player::state::decode_some()
+{
+  video_frame frame;
+  while (!stop)
+  {
+    demux::packet pkt;
+    uint64_t gen;
+    demux::codec c;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (queue.size() >= queue_capacity || packets.empty() || codec == demux::codec::unknown)
+        break;
+      pkt = std::move(packets.front());
+      packets.pop_front();
+      gen = generation;
+      c = codec;
+    }
+
+    if (!pkt.keyframe && wait_keyframe)
+    {
+      ++skipped;
+      telemetry::add(telemetry::counter::frames_skipped);
+      continue;
+    }
+    wait_keyframe = false;
+
+    try {
+      if (!decoder)
+        decoder.reset(new decode::vpx_decoder(c, tasks::decoder_threads(1)));
+      telemetry::timer timer(telemetry::histogram::decode);
+      if (!decoder->decode(pkt, frame))
+        continue;
+    }
+    catch (std::exception const& e)
+    {
+      // a corrupt or truncated packet: resync at the next keyframe
+      printf("%s\n", e.what());
+      wait_keyframe = true;
+      continue;
+    }
+    ++decoded;
+    telemetry::add(telemetry::counter::frames_decoded);
+
+    std::unique_ptr<video_picture> pic;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!spare.empty())
+        pic = take_spare(spare, v3d::completed_frame(v3d::stage::upload));
+    }
+    if (!pic)
+      pic.reset(new video_picture);
+    pic->assign(frame, pkt.time_ns);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (generation != gen)
+      spare.push_back(std::move(pic));
+    else
+      queue.push_back(std::move(pic));
+  }
+  decoding = false;
+}
+
+void  live_player::state::start_decoding()
+{
+  bool expected = false;
+  if (!decoding.compare_exchange_strong(expected, true))
+    return;
+  tasks::submit([this] { decode_some(); }, tasks::lane::background, &decode_tasks);
+}
+
+int64_t  live_player::state::clock_at(steady::time_point now) const
+{
+  double elapsed = std::chrono::duration<double, std::nano>(now - anchor_wall).count();
+  return anchor_ns + (int64_t)(elapsed * rate);
+}
+
+void  live_player::state::reanchor(steady::time_point now, int64_t position_ns, double new_rate)
+{
+  anchor_wall = now;
+  anchor_ns = position_ns;
+  rate = new_rate;
+}
+
+// Keeps the playback clock latency_ns behind the newest received frame.
+// Expects the lock held.
+void  live_player::state::chase(steady::time_point now)
+{
+  const int64_t clock = clock_at(now);
+  lag_ns = newest_ns - clock;
+
+  if (lag_ns < latency_ns * chase_factor)
+    skip_armed = true;
+  if (skip_armed && lag_ns > latency_ns * skip_factor && drop_to_keyframe())
+  {
+    printf("[LIVE] %.0f ms behind the live edge, skipping ahead\n", lag_ns / 1e6);
+    skip_armed = false;
+    // the keyframe shows after one latency period of buffering
+    reanchor(now + std::chrono::nanoseconds(latency_ns), packets.front().time_ns, 1.0);
+    return;
+  }
+
+  if (rate == 1.0 && lag_ns > latency_ns * chase_factor)
+    reanchor(now, clock, chase_rate);
+  else if (rate != 1.0 && lag_ns <= latency_ns)
+    reanchor(now, clock, 1.0);
+}
+
+void  live_player::state::report(steady::time_point now)
+{
+  if (now - last_report < report_interval)
+    return;
+  last_report = now;
+
+  std::lock_guard<std::mutex> guard(lock);
+  printf("[LIVE] received %llu, decoded %llu, presented %llu, dropped %llu, skipped %llu, "
+         "buffered %u, lag %.0f ms, rate %gx\n",
+         (unsigned long long)received, (unsigned long long)decoded,
+         (unsigned long long)presented, (unsigned long long)dropped,
+         (unsigned long long)skipped, (unsigned)(packets.size() + queue.size()),
+         lag_ns / 1e6, rate);
+}
+
+live_player::live_player(const char* path, uint32_t latency_ms)
+  : impl(new state(path, latency_ms))
+{
+  // without O_NONBLOCK opening a FIFO waits for the writer; the ingest
+  // thread polls for data anyway
+  int fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO)
+                                  : open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error(std::string("[LIVE] failed to open ") + path + ": " + strerror(errno));
+
+  impl->last_report = steady::now();
+  state* s = impl.get();
+  impl->ingest_thread = std::thread([s, fd] { s->ingest(fd); });
+}
+
+live_player::~live_player()
+{
+  impl->stop = true;
+  impl->ingest_thread.join();
+  tasks::wait(impl->decode_tasks);
+}
+
+bool  live_player::update()
+{
+  state& s = *impl;
+  const steady::time_point now = steady::now();
+
+  std::unique_ptr<video_picture> due;
+  bool finished;
+  {
+    std::lock_guard<std::mutex> guard(s.lock);
+    // hold the first frame back by the target latency to fill the buffer
+    if (!s.clock_started && !s.queue.empty())
+    {
+      s.clock_started = true;
+      s.reanchor(now + std::chrono::nanoseconds(s.latency_ns), s.queue.front()->time_ns, 1.0);
+    }
+
+    if (s.clock_started)
+    {
+      s.chase(now);
+      const int64_t clock = s.clock_at(now);
+      while (!s.queue.empty() && s.queue.front()->time_ns <= clock)
+      {
+        if (due)
+        {
+          ++s.dropped;
+          telemetry::add(telemetry::counter::frames_dropped);
+          s.spare.push_back(std::move(due));
+        }
+        due = std::move(s.queue.front());
+        s.queue.pop_front();
+      }
+
+      // the stream stalled and the clock ran past everything received:
+      // buffer up again instead of showing the next frames in a burst
+      if (s.queue.empty() && s.packets.empty() && !s.ended && clock > s.newest_ns + s.latency_ns)
+        s.clock_started = false;
+    }
+    finished = s.ended && s.packets.empty() && s.queue.empty();
+    telemetry::set(telemetry::gauge::decoded_queue, s.queue.size());
+    telemetry::set(telemetry::gauge::jitter_buffer, s.packets.size());
+  }
+
+  if (due)
+  {
+    due->gpu_serial = v3d::upload_host_frame(due->frame());
+    ++s.presented;
+    telemetry::add(telemetry::counter::frames_presented);
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (s.shown)
+      s.spare.push_back(std::move(s.shown));
+    s.shown = std::move(due);
+  }
+  else if (s.shown && v3d::source_lost())
+    s.shown->gpu_serial = v3d::upload_host_frame(s.shown->frame());
+
+  s.report(now);
+  s.start_decoding();
+  return !(finished && !s.decoding);
+}
+
+live_stats  live_player::stats() const
+{
+  live_stats result;
+  result.received = impl->received;
+  result.decoded = impl->decoded;
+  result.skipped = impl->skipped;
+  result.presented = impl->presented;
+  result.dropped = impl->dropped;
+  result.lag_ns = impl->lag_ns;
+  result.rate = impl->rate;
+  return result;
+}
+
+} // namespace playback
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+
+namespace playback
+{
+  struct live_stats
+  {
+    uint64_t  received = 0;
+    uint64_t  decoded = 0;
+    uint64_t  presented = 0;
+    uint64_t  dropped = 0;      // decoded, but a newer frame was due
+    uint64_t  skipped = 0;      // thrown away undecoded to catch up
+    int64_t   lag_ns = 0;       // newest received frame - playback clock
+    double    rate = 1.0;
+  };
+
+  // Plays an unbounded WebM stream from stdin ("-"), a pipe or a FIFO. An
+  // ingest thread parses the stream incrementally (clusters of unknown size
+  // are fine) into a jitter buffer of latency_ms. When the buffer grows,
+  // playback speeds up; when it grows far past that, it jumps ahead to
+  // the newest buffered keyframe.
+  class live_player
+  {
+  public:
+    live_player(const char* path, uint32_t latency_ms);
+    ~live_player();
+    live_player(live_player const&) = delete;
+    live_player& operator=(live_player const&) = delete;
+
+    // Call once per main loop iteration. Returns false once the stream
+    // ended and the last frame has been shown.
+    bool  update();
+
+    live_stats  stats() const;
+
+  private:
+    struct state;
+    std::unique_ptr<state>  impl;
+  };
+}
@@ -0,0 +1,771 @@
+#include "player.h"
+#include "audio.h"
+#include "demux.h"
+#include "decoder.h"
+#include "tasks.h"
+#include "telemetry.h"
+#include "v3d.h"
+
+#include  <algorithm>
+#include  <atomic>
+#include  <chrono>
+#include  <cmath>
+#include  <deque>
+#include  <list>
+#include  <mutex>
+#include  <vector>
+#include  <stdio.h>
+#include  <stdlib.h>
+#include  <string.h>
+
+namespace playback
+{
+
+using steady = std::chrono::steady_clock;
+
+static const uint32_t  queue_capacity = 8;
+// degrade quickly, recover only after the queue stayed full for a while
+static const steady::duration  escalate_interval = std::chrono::milliseconds(500);
+static const steady::duration  recover_interval = std::chrono::seconds(3);
+static const steady::duration  report_interval = std::chrono::seconds(5);
+// video waits at most this long for the first audio sample to play
+static const steady::duration  audio_start_timeout = std::chrono::milliseconds(500);
+
+// above this speed only keyframes are decoded
+static const double    trick_speed = 2.0;
+// reverse playback caches decoded GOPs up to this many bytes of pictures
+static const size_t    gop_cache_bytes = size_t(256) << 20;
+
+const char*  to_string(degrade_level level)
+{
+  switch (level)
+  {
+    case degrade_level::none: return "none";
+    case degrade_level::skip_loop_filter: return "skip-loop-filter";
+    case degrade_level::drop_nonref: return "drop-nonref";
+    case degrade_level::keyframes_only: return "keyframes-only";
+  }
+  return "unknown";
+}
+
+enum class decode_mode
+{
+  sequential,   // every frame, forward
+  keyframes,    // keyframes only, either direction
+  reverse       // every frame, backwards through the GOP cache
+};
+
+// What the decode task should produce. Every change bumps the generation,
+// frames of older generations are thrown away.
+struct decode_request
+{
+  uint64_t      generation = 0;
+  decode_mode   mode = decode_mode::sequential;
+  int           direction = 1;
+  int64_t       position_ns = -1;   // continue past this frame, -1 from the start
+};
+
+// Consecutive decoded frames. Covers the predecessor of any time in
+// (frames.front()->time_ns, end_ns].
+struct gop_segment
+{
+  int64_t                                       end_ns = 0;
+  std::vector<std::unique_ptr<video_picture>>   frames;
+};
+
+struct player::state
+{
+  demux::webm_reader    reader;
+  decode::vpx_decoder   decoder;
+
+  // shared with the decode task
+  std::mutex                                    lock;
+  std::deque<std::unique_ptr<video_picture>>    queue;    // in presentation order
+  std::vector<std::unique_ptr<video_picture>>   spare;
+  decode_request                                request;
+  bool                                          exhausted = false;
+
+  tasks::group                decode_tasks;
+  std::atomic<bool>           decoding {false};
+  std::atomic<bool>           stop {false};
+  std::atomic<degrade_level>  level {degrade_level::none};
+  std::atomic<uint64_t>       decoded {0};
+  std::atomic<uint64_t>       skipped {0};
+  std::atomic<int64_t>        clock_ns {0};
+
+  // decode task only
+  uint64_t                generation_seen = UINT64_MAX;
+  bool                    wait_keyframe = false;
+  bool                    loop_filter_skipped = false;
+  int64_t                 next_ns = -1;
+  std::vector<int64_t>    keyframes;
+  bool                    keyframes_loaded = false;
+  std::list<gop_segment>  gop_cache;      // most recently used first
+  size_t                  cached_bytes = 0;
+
+  // main thread only
+  double              speed = 1.0;
+  bool                step_pending = false;
+  bool                clock_started = false;
+  bool                audio_started = false;
+  bool                audio_clock_seen = false;
+  steady::time_point  audio_started_at;
+  steady::time_point  anchor_wall;
+  int64_t             anchor_ns = 0;
+  int64_t             last_shown_ns = -1;
+  std::unique_ptr<video_picture>  shown;   // uploaded again after a device loss
+  std::unique_ptr<audio::stream>  sound;   // null without an audio track or sink
+  int64_t             frame_duration_ns = 0;
+  uint64_t            presented = 0;
+  uint64_t            dropped = 0;
+  uint64_t            late = 0;
+  uint64_t            starved = 0;     // late with nothing decoded ahead
+  uint64_t            starved_seen = 0;
+  bool                queue_full = false;
+  steady::time_point  full_since;
+  steady::time_point  level_changed;
+  steady::time_point  last_report;
+
+  explicit state(const char* path)
+    : reader(path)
+    , decoder(reader.video_codec(), tasks::decoder_threads(1))
+  {
+  }
+
+  void  decode_some();
+  void  begin_request(decode_request const& r);
+  bool  decode_sequential(decode_request const& r);
+  bool  decode_keyframe(decode_request const& r);
+  bool  decode_reverse(decode_request const& r);
+  gop_segment*  find_segment(int64_t target_ns);
+  gop_segment*  decode_segment(int64_t target_ns);
+  void  load_keyframes();
+  std::unique_ptr<video_picture>  take_picture();
+  void  recycle(gop_segment& segment);
+  bool  deliver(uint64_t generation, video_frame const& frame, int64_t time_ns);
+  bool  decode_packet(demux::packet const& pkt, video_frame& frame);
+
+  void  start_decoding();
+  void  issue_request(decode_mode mode, int direction);
+  int64_t  clock_at(steady::time_point now) const;
+  int64_t  sync_clock(steady::time_point now);
+  void     stop_audio();
+  void  adapt(uint32_t queued, steady::time_point now);
+  void  report(steady::time_point now);
+};
+
+static decode_mode  mode_for_speed(double speed)
+{
+  if (std::fabs(speed) > trick_speed)
+    return decode_mode::keyframes;
+  return speed < 0 ? decode_mode::reverse : decode_mode::sequential;
+}
+
+void  player::state::load_keyframes()
+{
+  if (keyframes_loaded)
+    return;
+  keyframes = reader.keyframes();
+  keyframes_loaded = true;
+}
+
+bool  player::state::decode_packet(demux::packet const& pkt, video_frame& frame)
+{
+  telemetry::timer timer(telemetry::histogram::decode);
+  if (!decoder.decode(pkt, frame))
+    return false;
+  ++decoded;
+  telemetry::add(telemetry::counter::frames_decoded);
+  return true;
+}
+
+std::unique_ptr<video_picture>  player::state::take_picture()
+{
+  std::unique_ptr<video_picture> pic;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!spare.empty())
+      pic = take_spare(spare, v3d::completed_frame(v3d::stage::upload));
+  }
+  if (!pic)
+    pic.reset(new video_picture);
+  return pic;
+}
+
+void  player::state::recycle(gop_segment& segment)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto& pic: segment.frames)
+  {
+    cached_bytes -= pic->memory.size();
+    spare.push_back(std::move(pic));
+  }
+  segment.frames.clear();
+}
+
+// copies the frame into the queue unless the request changed meanwhile
+bool  player::state::deliver(uint64_t generation, video_frame const& frame, int64_t time_ns)
+{
+  std::unique_ptr<video_picture> pic = take_picture();
+  pic->assign(frame, time_ns);
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (request.generation != generation)
+  {
+    spare.push_back(std::move(pic));
+    return false;
+  }
+  queue.push_back(std::move(pic));
+  return true;
+}
+
+void  player::state::begin_request(decode_request const& r)
+{
+  next_ns = r.position_ns;
+  if (r.mode == decode_mode::sequential && r.position_ns >= 0)
+  {
+    // references are rebuilt from the keyframe before the position
+    reader.seek(r.position_ns);
+    wait_keyframe = false;
+  }
+}
+
+bool  player::state::decode_sequential(decode_request const& r)
+{
+  demux::packet pkt;
+  video_frame frame;
+  for (;;)
+  {
+    if (!reader.read(pkt))
+      return false;
+
+    // after skipping an inter frame the references are stale until the
+    // next keyframe
+    const degrade_level lvl = level;
+    if (!pkt.keyframe && (wait_keyframe || lvl >= degrade_level::keyframes_only))
+    {
+      wait_keyframe = true;
+      ++skipped;
+      telemetry::add(telemetry::counter::frames_skipped);
+      continue;
+    }
+    wait_keyframe = false;
+
+    if (lvl >= degrade_level::drop_nonref &&
+        decode::is_droppable(reader.video_codec(), pkt))
+    {
+      ++skipped;
+      telemetry::add(telemetry::counter::frames_skipped);
+      continue;
+    }
+
+    const bool skipLoopFilter = lvl >= degrade_level::skip_loop_filter;
+    if (skipLoopFilter != loop_filter_skipped)
+    {
+      decoder.skip_loop_filter(skipLoopFilter);
+      loop_filter_skipped = skipLoopFilter;
+    }
+
+    // frames before a seek position are only decoded for their references
+    if (!decode_packet(pkt, frame) || pkt.time_ns < next_ns)
+      continue;
+    deliver(r.generation, frame, pkt.time_ns);
+    return true;
+  }
+}
+
+// next keyframe past both the last one delivered and the clock
+bool  player::state::decode_keyframe(decode_request const& r)
+{
+  load_keyframes();
+  const int64_t clock = clock_ns;
+
+  int64_t key = -1;
+  if (r.direction > 0)
+  {
+    auto it = std::upper_bound(keyframes.begin(), keyframes.end(), std::max(next_ns, clock - 1));
+    if (it != keyframes.end())
+      key = *it;
+  }
+  else
+  {
+    const int64_t limit = next_ns < 0 ? clock + 1 : std::min(next_ns, clock + 1);
+    auto it = std::lower_bound(keyframes.begin(), keyframes.end(), limit);
+    if (it != keyframes.begin())
+      key = *(it - 1);
+  }
+  if (key < 0)
+    return false;
+  next_ns = key;
+
+  demux::packet pkt;
+  video_frame frame;
+  if (reader.read_keyframe(key, pkt) && decode_packet(pkt, frame))
+    deliver(r.generation, frame, pkt.time_ns);
+  return true;
+}
+
+gop_segment*  player::state::find_segment(int64_t target_ns)
+{
+  for (auto it = gop_cache.begin(); it != gop_cache.end(); ++it)
+  {
+    if (it->frames.front()->time_ns < target_ns && target_ns <= it->end_ns)
+    {
+      gop_cache.splice(gop_cache.begin(), gop_cache, it);
+      return &gop_cache.front();
+    }
+  }
+  return nullptr;
+}
+
+// Decodes the GOP from the keyframe before target_ns up to it once and
+// caches all of it, so stepping back through the GOP is served from the
+// cache. A GOP larger than gop_cache_bytes keeps its last part that fits.
+gop_segment*  player::state::decode_segment(int64_t target_ns)
+{
+  load_keyframes();
+  auto key = std::lower_bound(keyframes.begin(), keyframes.end(), target_ns);
+  if (key == keyframes.begin())
+    return nullptr;
+  reader.seek(*(key - 1));
+
+  gop_segment segment;
+  segment.end_ns = target_ns;
+  std::deque<std::unique_ptr<video_picture>> window;
+  size_t window_bytes = 0;
+
+  demux::packet pkt;
+  video_frame frame;
+  while (reader.read(pkt) && pkt.time_ns < target_ns)
+  {
+    if (!decode_packet(pkt, frame))
+      continue;
+
+    std::unique_ptr<video_picture> pic;
+    if (!window.empty() && window_bytes + window.front()->memory.size() > gop_cache_bytes)
+    {
+      pic = std::move(window.front());
+      window.pop_front();
+      window_bytes -= pic->memory.size();
+    }
+    else
+      pic = take_picture();
+    pic->assign(frame, pkt.time_ns);
+    window_bytes += pic->memory.size();
+    window.push_back(std::move(pic));
+  }
+  if (window.empty())
+    return nullptr;
+
+  for (auto& pic: window)
+    segment.frames.push_back(std::move(pic));
+  cached_bytes += window_bytes;
+  gop_cache.push_front(std::move(segment));
+
+  while (cached_bytes > gop_cache_bytes && gop_cache.size() > 1)
+  {
+    recycle(gop_cache.back());
+    gop_cache.pop_back();
+  }
+  return &gop_cache.front();
+}
+
+bool  player::state::decode_reverse(decode_request const& r)
+{
+  if (next_ns < 0)
+    return false;
+
+  gop_segment* segment = find_segment(next_ns);
+  if (!segment)
+    segment = decode_segment(next_ns);
+  if (!segment)
+    return false;
+
+  // the predecessor of next_ns
+  video_picture* prev = nullptr;
+  for (auto& pic: segment->frames)
+  {
+    if (pic->time_ns < next_ns)
+      prev = pic.get();
+  }
+  if (!prev)
+    return false;
+
+  next_ns = prev->time_ns;
+  deliver(r.generation, prev->frame(), prev->time_ns);
+  return true;
+}
+
+// Runs on the task pool until the queue is full; update() starts it again
+// once there is room.
+void  player::state::decode_some()
+{
+  try {
+    while (!stop)
+    {
+      decode_request r;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (queue.size() >= queue_capacity || exhausted)
+          break;
+        r = request;
+      }
+
+      if (r.generation != generation_seen)
+      {
+        begin_request(r);
+        generation_seen = r.generation;
+      }
+
+      bool more = false;
+      switch (r.mode)
+      {
+        case decode_mode::sequential: more = decode_sequential(r); break;
+        case decode_mode::keyframes: more = decode_keyframe(r); break;
+        case decode_mode::reverse: more = decode_reverse(r); break;
+      }
+
+      if (!more)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (request.generation == r.generation)
+          exhausted = true;
+        break;
+      }
+    }
+  }
+  catch (std::exception const& e)
+  {
+    printf("%s\n", e.what());
+    std::lock_guard<std::mutex> guard(lock);
+    exhausted = true;
+  }
+  decoding = false;
+}
+
+void  player::state::start_decoding()
+{
+  bool expected = false;
+  if (!decoding.compare_exchange_strong(expected, true))
+    return;
+  tasks::submit([this] { decode_some(); }, tasks::lane::background, &decode_tasks);
+}
+
+// Drops the queued frames and makes the decode task continue from the
+// frame on screen in a different mode.
+void  player::state::issue_request(decode_mode mode, int direction)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  request.generation++;
+  request.mode = mode;
+  request.direction = direction;
+  request.position_ns = last_shown_ns;
+  if (mode == decode_mode::sequential && last_shown_ns >= 0)
+    request.position_ns = last_shown_ns + 1;
+
+  for (auto& pic: queue)
+    spare.push_back(std::move(pic));
+  queue.clear();
+  exhausted = false;
+  clock_started = false;
+  clock_ns = std::max<int64_t>(0, last_shown_ns);
+  stop_audio();
+}
+
+int64_t  player::state::clock_at(steady::time_point now) const
+{
+  double elapsed = std::chrono::duration<double, std::nano>(now - anchor_wall).count();
+  return anchor_ns + (int64_t)(elapsed * speed);
+}
+
+// At 1x the audio sink's position is the clock. Until the sink plays the
+// first sample the clock holds at the start position, so it doesn't run
+// ahead and jump back. The wall clock carries on from the last audio
+// position at other speeds, once the audio track ended and when the sink
+// doesn't start within audio_start_timeout.
+int64_t  player::state::sync_clock(steady::time_point now)
+{
+  if (sound && speed == 1.0)
+  {
+    if (!audio_started)
+    {
+      anchor_ns = clock_at(now);
+      anchor_wall = now;
+      sound->start(anchor_ns);
+      audio_started = true;
+      audio_clock_seen = false;
+      audio_started_at = now;
+    }
+    const int64_t audio_ns = sound->clock_ns();
+    if (audio_ns >= 0)
+    {
+      audio_clock_seen = true;
+      anchor_wall = now;
+      anchor_ns = audio_ns;
+      return audio_ns;
+    }
+    if (!audio_clock_seen && now - audio_started_at < audio_start_timeout)
+    {
+      anchor_wall = now;
+      return anchor_ns;
+    }
+  }
+  return clock_at(now);
+}
+
+void  player::state::stop_audio()
+{
+  if (audio_started)
+  {
+    sound->stop();
+    audio_started = false;
+  }
+}
+
+// A frame shown late with nothing decoded behind it means decoding fell
+// behind: step the level up, at most once per escalate_interval. Drops to
+// catch up with a full queue are the display's doing and don't count. Step
+// back down one level when the queue has stayed full for recover_interval.
+void  player::state::adapt(uint32_t queued, steady::time_point now)
+{
+  const degrade_level lvl = level;
+  // trick play drops frames on purpose
+  if (mode_for_speed(speed) != decode_mode::sequential || speed > 1.0)
+  {
+    starved_seen = starved;
+    return;
+  }
+
+  if (starved > starved_seen)
+  {
+    starved_seen = starved;
+    queue_full = false;
+    if (lvl < degrade_level::keyframes_only && now - level_changed >= escalate_interval)
+    {
+      level = (degrade_level)((int)lvl + 1);
+      level_changed = now;
+      printf("[PLAYER] decoding behind, degrade level %s\n", to_string(level));
+    }
+    return;
+  }
+
+  if (queued < queue_capacity)
+  {
+    queue_full = false;
+    return;
+  }
+  if (!queue_full)
+  {
+    queue_full = true;
+    full_since = now;
+  }
+  if (lvl > degrade_level::none && now - full_since >= recover_interval &&
+      now - level_changed >= recover_interval)
+  {
+    level = (degrade_level)((int)lvl - 1);
+    level_changed = now;
+    full_since = now;
+    printf("[PLAYER] decoding recovered, degrade level %s\n", to_string(level));
+  }
+}
+
+void  player::state::report(steady::time_point now)
+{
+  if (now - last_report < report_interval)
+    return;
+  last_report = now;
+
+  std::lock_guard<std::mutex> guard(lock);
+  printf("[PLAYER] decoded %llu, skipped %llu, presented %llu, dropped %llu, late %llu, "
+         "queue %u/%u, degrade level %s, speed %gx\n",
+         (unsigned long long)decoded, (unsigned long long)skipped,
+         (unsigned long long)presented, (unsigned long long)dropped,
+         (unsigned long long)late, (unsigned)queue.size(), queue_capacity,
+         to_string(level), speed);
+}
+
+player::player(const char* path)
+  : impl(new state(path))
+{
+  printf("[PLAYER] %s: %ux%u\n", path, impl->reader.width(), impl->reader.height());
+  if (audio::sink() != audio::sink_type::none && impl->reader.has_audio())
+  {
+    try {
+      impl->sound.reset(new audio::stream(path));
+    }
+    catch (std::exception const& e)
+    {
+      printf("%s, playing without audio\n", e.what());
+    }
+  }
+  impl->last_report = steady::now();
+  impl->start_decoding();
+}
+
+player::~player()
+{
+  impl->stop = true;
+  tasks::wait(impl->decode_tasks);
+}
+
+bool  player::update()
+{
+  state& s = *impl;
+  const steady::time_point now = steady::now();
+
+  std::unique_ptr<video_picture> due;
+  uint32_t queued;
+  bool exhausted;
+  bool playsToEnd;
+  {
+    std::lock_guard<std::mutex> guard(s.lock);
+    // the clock starts with the first frame decoded for the request
+    if (!s.clock_started && !s.queue.empty())
+    {
+      s.clock_started = true;
+      s.anchor_wall = now;
+      s.anchor_ns = s.queue.front()->time_ns;
+    }
+
+    if (s.speed == 0)
+    {
+      if (s.step_pending && !s.queue.empty())
+      {
+        due = std::move(s.queue.front());
+        s.queue.pop_front();
+        s.step_pending = false;
+      }
+    }
+    else if (s.clock_started)
+    {
+      const int64_t clock = s.sync_clock(now);
+      s.clock_ns = clock;
+      auto isDue = [&s, clock] (video_picture const& pic)
+        {
+          return s.speed > 0 ? pic.time_ns <= clock : pic.time_ns >= clock;
+        };
+      while (!s.queue.empty() && isDue(*s.queue.front()))
+      {
+        if (due)
+        {
+          ++s.dropped;
+          telemetry::add(telemetry::counter::frames_dropped);
+          s.spare.push_back(std::move(due));
+        }
+        due = std::move(s.queue.front());
+        s.queue.pop_front();
+      }
+      const int64_t lateness = due ? (s.speed > 0 ? clock - due->time_ns : due->time_ns - clock)
+                                   : 0;
+      if (due && s.frame_duration_ns > 0 &&
+          lateness > s.frame_duration_ns * std::fabs(s.speed))
+      {
+        ++s.late;
+        telemetry::add(telemetry::counter::frames_late);
+        if (s.queue.empty())
+          ++s.starved;
+      }
+    }
+    queued = s.queue.size();
+    telemetry::set(telemetry::gauge::decoded_queue, queued);
+    exhausted = s.exhausted;
+    playsToEnd = s.request.mode == decode_mode::sequential;
+  }
+
+  if (due)
+  {
+    due->gpu_serial = v3d::upload_host_frame(due->frame());
+    ++s.presented;
+    telemetry::add(telemetry::counter::frames_presented);
+    if (s.last_shown_ns >= 0 && due->time_ns != s.last_shown_ns)
+    {
+      int64_t delta = std::llabs(due->time_ns - s.last_shown_ns);
+      s.frame_duration_ns = s.frame_duration_ns ? std::min(s.frame_duration_ns, delta) : delta;
+    }
+    s.last_shown_ns = due->time_ns;
+
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (s.shown)
+      s.spare.push_back(std::move(s.shown));
+    s.shown = std::move(due);
+  }
+  else if (s.shown && v3d::source_lost())
+    s.shown->gpu_serial = v3d::upload_host_frame(s.shown->frame());
+
+  s.adapt(queued, now);
+  s.report(now);
+
+  if (!exhausted && queued < queue_capacity)
+    s.start_decoding();
+
+  if (exhausted && queued == 0 && !s.decoding)
+  {
+    if (playsToEnd)
+      return false;
+    // trick play stops at either end of the file
+    if (s.speed != 0)
+    {
+      printf("[PLAYER] trick play reached the %s\n", s.speed > 0 ? "end" : "start");
+      s.speed = 0;
+    }
+  }
+  return true;
+}
+
+void  player::set_speed(double speed)
+{
+  state& s = *impl;
+  speed = std::max(-max_speed, std::min(max_speed, speed));
+
+  // keep the picture on screen where it is
+  const steady::time_point now = steady::now();
+  s.anchor_wall = now;
+  s.anchor_ns = std::max<int64_t>(0, s.last_shown_ns);
+  s.step_pending = false;
+  s.stop_audio();
+
+  if (speed != 0)
+  {
+    const decode_mode mode = mode_for_speed(speed);
+    const int direction = speed > 0 ? 1 : -1;
+    if (mode != s.request.mode || direction != s.request.direction)
+      s.issue_request(mode, direction);
+  }
+  s.speed = speed;
+  printf("[PLAYER] speed %gx\n", speed);
+}
+
+double  player::speed() const
+{
+  return impl->speed;
+}
+
+void  player::step(int direction)
+{
+  state& s = *impl;
+  if (s.speed != 0)
+    set_speed(0);
+
+  direction = direction < 0 ? -1 : 1;
+  const decode_mode mode = direction > 0 ? decode_mode::sequential : decode_mode::reverse;
+  if (mode != s.request.mode || direction != s.request.direction)
+    s.issue_request(mode, direction);
+  s.step_pending = true;
+}
+
+player_stats  player::stats() const
+{
+  player_stats result;
+  result.decoded = impl->decoded;
+  result.skipped = impl->skipped;
+  result.presented = impl->presented;
+  result.dropped = impl->dropped;
+  result.late = impl->late;
+  result.level = impl->level;
+  result.speed = impl->speed;
+  std::lock_guard<std::mutex> guard(impl->lock);
+  result.queued = impl->queue.size();
+  return result;
+}
+
+} // namespace playback
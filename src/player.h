@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+
+namespace playback
+{
+  // Decode speed trade-offs, enabled in order while decoding can't keep up
+  // with the presentation clock.
+  enum class degrade_level
+  {
+    none,
+    skip_loop_filter,   // VP9 only
+    drop_nonref,        // skip frames no other frame references
+    keyframes_only
+  };
+  const char*  to_string(degrade_level level);
+
+  struct player_stats
+  {
+    uint64_t        decoded = 0;
+    uint64_t        skipped = 0;    // not decoded because of degradation
+    uint64_t        presented = 0;
+    uint64_t        dropped = 0;    // decoded, but another frame was due first
+    uint64_t        late = 0;       // shown more than a frame after it was due
+    uint32_t        queued = 0;
+    degrade_level   level = degrade_level::none;
+    double          speed = 1.0;
+  };
+
+  // Plays the video track of a WebM file: packets are decoded on the task
+  // pool into a small queue, update() hands the frame due at the playback
+  // clock to v3d::upload_frame(). With an audio track and sink the clock
+  // follows the audio at 1x.
+  class player
+  {
+  public:
+    // fastest trick play speed, either direction
+    static constexpr double  max_speed = 32.0;
+
+    explicit player(const char* path);
+    ~player();
+    player(player const&) = delete;
+    player& operator=(player const&) = delete;
+
+    // Call once per main loop iteration. Returns false once the last frame
+    // has been shown.
+    bool  update();
+
+    // Negative speeds play backwards, 0 pauses. Up to 2x every frame is
+    // decoded (backwards through a cache of decoded GOPs), faster
+    // speeds only decode keyframes.
+    void    set_speed(double speed);
+    double  speed() const;
+    // pauses and shows the next (direction > 0) or previous frame
+    void    step(int direction);
+
+    player_stats  stats() const;
+
+  private:
+    struct state;
+    std::unique_ptr<state>  impl;
+  };
+}
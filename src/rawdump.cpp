@@ -0,0 +1,352 @@
+#include "rawdump.h"
+#include "demux.h"
+#include "decoder.h"
+#include "frame.h"
+#include "tasks.h"
+#include "telemetry.h"
+
+#include  <algorithm>
+#include  <atomic>
+#include  <chrono>
+#include  <cmath>
+#include  <stdexcept>
+#include  <errno.h>
+#include  <fcntl.h>
+#include  <limits.h>
+#include  <stdio.h>
+#include  <stdlib.h>
+#include  <string.h>
+#include  <sys/uio.h>
+#include  <unistd.h>
+
+namespace rawdump
+{
+
+using steady = std::chrono::steady_clock;
+
+// O_DIRECT wants buffer addresses, sizes and file offsets aligned to the
+// logical block size; 4096 covers every common device
+static const size_t  direct_alignment = 4096;
+static const size_t  staging_size = 8 << 20;
+
+static void  fail(std::string const& path, const char* what)
+{
+  throw std::runtime_error("[DUMP] " + path + ": " + what + ": " + strerror(errno));
+}
+
+// Frame output to one file. Buffered files get one writev() per frame
+// straight from the decoder's planes. Direct files collect frames in an
+// aligned staging buffer and write it in large aligned chunks.
+class output_file
+{
+public:
+  output_file(std::string const& path, bool direct)
+    : path(path)
+  {
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (direct)
+    {
+      fd = open(path.c_str(), flags | O_DIRECT, 0644);
+      // tmpfs and some network file systems refuse O_DIRECT
+      if (fd < 0 && errno == EINVAL)
+        printf("[DUMP] %s: O_DIRECT not supported, using buffered writes\n", path.c_str());
+      else if (fd >= 0 && posix_memalign((void**)&staging, direct_alignment, staging_size) != 0)
+      {
+        close(fd);
+        throw std::runtime_error("[DUMP] out of memory");
+      }
+    }
+    if (fd < 0)
+      fd = open(path.c_str(), flags, 0644);
+    if (fd < 0)
+      fail(path, "failed to create");
+  }
+
+  ~output_file()
+  {
+    free(staging);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  output_file(output_file const&) = delete;
+  output_file& operator=(output_file const&) = delete;
+
+  void  write(const void* data, size_t size)
+  {
+    if (staging)
+      append(data, size);
+    else
+      add(data, size);
+  }
+
+  // header (may be empty) and the visible part of the frame's planes
+  void  write_frame(std::string const& header, video_frame const& frame)
+  {
+    if (!header.empty())
+      write(header.data(), header.size());
+    for (int i = 0; i < 3; ++i)
+    {
+      const uint32_t w = i == 0 ? frame.width : (frame.width + 1) / 2;
+      const uint32_t h = i == 0 ? frame.height : (frame.height + 1) / 2;
+      if ((uint32_t)frame.strides[i] == w)
+        write(frame.planes[i], (size_t)w * h);
+      else
+        for (uint32_t y = 0; y < h; ++y)
+          write(frame.planes[i] + (size_t)y * frame.strides[i], w);
+    }
+    // the iovecs point into decoder memory that the next decode reuses
+    if (!staging)
+      flush_iov();
+  }
+
+  void  finish()
+  {
+    if (!staging)
+    {
+      flush_iov();
+      return;
+    }
+    const size_t aligned = used & ~(direct_alignment - 1);
+    write_all(staging, aligned);
+    if (used > aligned)
+    {
+      // the unaligned tail can't go through O_DIRECT
+      int flags = fcntl(fd, F_GETFL);
+      if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)
+        fail(path, "failed to clear O_DIRECT");
+      write_all(staging + aligned, used - aligned);
+    }
+    used = 0;
+  }
+
+  uint64_t  bytes_written() const { return written; }
+
+private:
+  void  add(const void* data, size_t size)
+  {
+    if (iov.size() >= IOV_MAX)
+      flush_iov();
+    iov.push_back({const_cast<void*>(data), size});
+  }
+
+  void  flush_iov()
+  {
+    size_t first = 0;
+    while (first < iov.size())
+    {
+      const int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+      ssize_t n = writev(fd, iov.data() + first, count);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        fail(path, "write failed");
+      }
+      written += n;
+      // skip what was written, a short write leaves a partial iovec
+      for (; first < iov.size() && (size_t)n >= iov[first].iov_len; ++first)
+        n -= iov[first].iov_len;
+      if (n > 0)
+      {
+        iov[first].iov_base = (uint8_t*)iov[first].iov_base + n;
+        iov[first].iov_len -= n;
+      }
+    }
+    iov.clear();
+  }
+
+  void  append(const void* data, size_t size)
+  {
+    const uint8_t* src = (const uint8_t*)data;
+    while (size > 0)
+    {
+      const size_t n = std::min(size, staging_size - used);
+      memcpy(staging + used, src, n);
+      used += n;
+      src += n;
+      size -= n;
+      if (used == staging_size)
+      {
+        write_all(staging, used);
+        used = 0;
+      }
+    }
+  }
+
+  void  write_all(const uint8_t* data, size_t size)
+  {
+    while (size > 0)
+    {
+      ssize_t n = ::write(fd, data, size);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        fail(path, "write failed");
+      }
+      written += n;
+      data += n;
+      size -= n;
+    }
+  }
+
+  std::string           path;
+  int                   fd = -1;
+  uint8_t*              staging = nullptr;
+  size_t                used = 0;
+  std::vector<iovec>    iov;
+  uint64_t              written = 0;
+};
+
+// WebM only has millisecond timestamps, so the frame rate from the first
+// frame interval is snapped to the usual broadcast rates
+static void  frame_rate(int64_t interval_ns, uint32_t& num, uint32_t& den)
+{
+  static const uint32_t rates[][2] = {
+    {24000, 1001}, {24, 1}, {25, 1}, {30000, 1001}, {30, 1},
+    {48, 1}, {50, 1}, {60000, 1001}, {60, 1}, {120, 1}
+  };
+  num = 25;
+  den = 1;
+  if (interval_ns <= 0)
+    return;
+
+  const double fps = 1e9 / interval_ns;
+  for (auto const& r: rates)
+  {
+    if (std::fabs(fps - double(r[0]) / r[1]) < fps * 0.02)
+    {
+      num = r[0];
+      den = r[1];
+      return;
+    }
+  }
+  num = (uint32_t)std::lround(fps * 1000);
+  den = 1000;
+}
+
+static std::string  output_path(options const& opts, std::string const& input)
+{
+  size_t slash = input.find_last_of('/');
+  std::string name = input.substr(slash == std::string::npos ? 0 : slash + 1);
+  size_t dot = name.find_last_of('.');
+  if (dot != std::string::npos && dot > 0)
+    name.resize(dot);
+  return opts.out_dir + "/" + name + (opts.fmt == format::y4m ? ".y4m" : ".yuv");
+}
+
+struct file_result
+{
+  uint64_t  frames = 0;
+  uint64_t  bytes = 0;
+  uint32_t  width = 0;
+  uint32_t  height = 0;
+};
+
+static file_result  process_file(options const& opts, std::string const& path,
+                                 unsigned decoder_threads)
+{
+  demux::webm_reader reader(path.c_str());
+  decode::vpx_decoder decoder(reader.video_codec(), decoder_threads);
+  output_file out(output_path(opts, path), opts.direct_io);
+
+  const bool y4m = opts.fmt == format::y4m;
+  const std::string frameHeader = y4m ? "FRAME\n" : "";
+
+  file_result result;
+  // Y4M needs the frame rate up front: the first frame waits for the
+  // timestamp of the second one
+  video_picture first;
+  bool headerWritten = false;
+  auto writeHeader = [&] (int64_t interval_ns)
+    {
+      // buffered writes only reference the header until write_frame()
+      char header[128];
+      if (y4m)
+      {
+        uint32_t num, den;
+        frame_rate(interval_ns, num, den);
+        int n = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C420jpeg\n",
+                         first.width, first.height, num, den);
+        out.write(header, n);
+      }
+      out.write_frame(frameHeader, first.frame());
+      headerWritten = true;
+    };
+
+  demux::packet pkt;
+  video_frame frame;
+  while (reader.read(pkt))
+  {
+    {
+      telemetry::timer timer(telemetry::histogram::decode);
+      if (!decoder.decode(pkt, frame))
+        continue;
+    }
+    ++result.frames;
+    telemetry::add(telemetry::counter::frames_decoded);
+    if (result.frames == 1)
+    {
+      first.assign(frame, pkt.time_ns);
+      result.width = frame.width;
+      result.height = frame.height;
+      continue;
+    }
+    if (y4m && (frame.width != result.width || frame.height != result.height))
+      throw std::runtime_error("[DUMP] " + path + ": resolution changes can't be stored in Y4M");
+    if (!headerWritten)
+      writeHeader(pkt.time_ns - first.time_ns);
+    out.write_frame(frameHeader, frame);
+  }
+  if (result.frames == 0)
+    throw std::runtime_error("[DUMP] " + path + ": no frames decoded");
+  if (!headerWritten)
+    writeHeader(0);
+
+  out.finish();
+  result.bytes = out.bytes_written();
+  return result;
+}
+
+unsigned  run(options const& opts, std::vector<std::string> const& files)
+{
+  const unsigned decoderThreads = tasks::decoder_threads(files.size());
+  const steady::time_point start = steady::now();
+
+  std::atomic<unsigned> failed {0};
+  std::atomic<uint64_t> totalFrames {0};
+  std::atomic<uint64_t> totalBytes {0};
+  tasks::group batch;
+  for (std::string const& path: files)
+  {
+    tasks::submit([&opts, &path, &failed, &totalFrames, &totalBytes, decoderThreads]
+      {
+        try {
+          const steady::time_point begin = steady::now();
+          file_result r = process_file(opts, path, decoderThreads);
+          const double seconds = std::chrono::duration<double>(steady::now() - begin).count();
+          printf("[DUMP] %s: %ux%u, %llu frames, %.1f fps, %.1f MiB/s\n",
+                 output_path(opts, path).c_str(), r.width, r.height,
+                 (unsigned long long)r.frames, r.frames / seconds,
+                 r.bytes / seconds / (1 << 20));
+          totalFrames += r.frames;
+          totalBytes += r.bytes;
+        }
+        catch (std::exception const& e)
+        {
+          printf("%s\n", e.what());
+          ++failed;
+        }
+      }, tasks::lane::background, &batch);
+  }
+  tasks::wait(batch);
+
+  const double seconds = std::chrono::duration<double>(steady::now() - start).count();
+  printf("[DUMP] total: %llu frames in %.2f s, %.1f fps, %.1f MiB/s\n",
+         (unsigned long long)totalFrames.load(), seconds, totalFrames / seconds,
+         totalBytes / seconds / (1 << 20));
+  return failed;
+}
+
+} // namespace rawdump
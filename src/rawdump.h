@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Headless decode-to-file export: demux and decode only, every frame is
+// written as Y4M or as raw I420 planes. Doubles as a decode throughput
+// benchmark without presentation in the way.
+namespace rawdump
+{
+  enum class format
+  {
+    y4m,
+    yuv     // planes only, no headers
+  };
+
+  struct options
+  {
+    std::string   out_dir = ".";
+    format        fmt = format::y4m;
+    bool          direct_io = false;  // O_DIRECT, bypasses the page cache
+  };
+
+  // Files are decoded in parallel on the task pool. Returns the number of
+  // files that failed.
+  unsigned  run(options const& opts, std::vector<std::string> const& files);
+}
@@ -0,0 +1,102 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// First pass of the separable scaler: filters the video horizontally at
+// source height and converts it to RGB.
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out vec4 outColor;
+
+// pipeline permutation, see PipelineKey in v3d.cpp
+layout(constant_id = 0) const int  COLOR_MATRIX = 1;  // 0 - BT.601, 1 - BT.709, 2 - BT.2020
+layout(constant_id = 1) const bool FULL_RANGE = false;
+layout(constant_id = 2) const int  BIT_DEPTH = 8;
+layout(constant_id = 3) const int  FILTER = 1;        // 1 - bicubic, 2 - lanczos
+
+layout(push_constant) uniform Scaler {
+    vec2  srcSize;
+    float scale;
+    int   radius;       // taps on each side of the sample
+} scaler;
+
+const float PI = 3.14159265359;
+
+// Catmull-Rom
+float cubic(float x) {
+    x = abs(x);
+    if (x < 1.0)
+        return (1.5 * x - 2.5) * x * x + 1.0;
+    if (x < 2.0)
+        return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+    return 0.0;
+}
+
+float lanczos3(float x) {
+    if (abs(x) < 1e-5)
+        return 1.0;
+    if (abs(x) >= 3.0)
+        return 0.0;
+    float px = PI * x;
+    return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+}
+
+float kernel(float x) {
+    return FILTER == 1 ? cubic(x) : lanczos3(x);
+}
+
+#ifdef YCBCR
+// multi-planar image behind an immutable Y'CbCr conversion sampler. The
+// sampler only reconstructs chroma (identity model), it returns Cr, Y, Cb.
+layout(set = 0, binding = 0) uniform sampler2D video;
+
+vec3 sample_video(vec2 coord) {
+    return texture(video, coord).gbr;
+}
+#else
+layout(set = 0, binding = 0) uniform sampler2D planeY;
+layout(set = 0, binding = 1) uniform sampler2D planeU;
+layout(set = 0, binding = 2) uniform sampler2D planeV;
+
+vec3 sample_video(vec2 coord) {
+    return vec3(texture(planeY, coord).r,
+                texture(planeU, coord).r,
+                texture(planeV, coord).r);
+}
+#endif
+
+vec3 to_rgb(vec3 yuv) {
+    // deeper samples sit in the low bits of 16-bit texels
+    if (BIT_DEPTH > 8)
+        yuv *= 65535.0 / float((1 << BIT_DEPTH) - 1);
+    if (FULL_RANGE) {
+        yuv -= vec3(0.0, 128.0 / 255.0, 128.0 / 255.0);
+    } else {
+        yuv -= vec3(16.0 / 255.0, 128.0 / 255.0, 128.0 / 255.0);
+        yuv *= vec3(255.0 / 219.0, 255.0 / 224.0, 255.0 / 224.0);
+    }
+    float kr = COLOR_MATRIX == 0 ? 0.299 : (COLOR_MATRIX == 2 ? 0.2627 : 0.2126);
+    float kb = COLOR_MATRIX == 0 ? 0.114 : (COLOR_MATRIX == 2 ? 0.0593 : 0.0722);
+    float kg = 1.0 - kr - kb;
+    return vec3(yuv.x + 2.0 * (1.0 - kr) * yuv.z,
+                yuv.x - 2.0 * kb * (1.0 - kb) / kg * yuv.y - 2.0 * kr * (1.0 - kr) / kg * yuv.z,
+                yuv.x + 2.0 * (1.0 - kb) * yuv.y);
+}
+
+void main() {
+    // widen the kernel when downscaling so it low-passes the source
+    float stretch = max(1.0 / scaler.scale, 1.0);
+    float center = uv.x * scaler.srcSize.x - 0.5;
+    float base = floor(center);
+
+    vec3 sum = vec3(0.0);
+    float weights = 0.0;
+    for (int i = 1 - scaler.radius; i <= scaler.radius; ++i) {
+        float pos = base + float(i);
+        float w = kernel((pos - center) / stretch);
+        vec2 coord = vec2((pos + 0.5) / scaler.srcSize.x, uv.y);
+        sum += w * sample_video(coord);
+        weights += w;
+    }
+    outColor = vec4(to_rgb(sum / weights), 1.0);
+}
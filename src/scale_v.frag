@@ -0,0 +1,62 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Second pass of the separable scaler: filters the horizontally scaled RGB
+// image vertically into the destination rectangle.
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out vec4 outColor;
+
+// pipeline permutation, see PipelineKey in v3d.cpp
+layout(constant_id = 3) const int  FILTER = 1;        // 1 - bicubic, 2 - lanczos
+
+layout(set = 1, binding = 0) uniform sampler2D intermediate;
+
+layout(push_constant) uniform Scaler {
+    vec2  srcSize;
+    float scale;
+    int   radius;       // taps on each side of the sample
+} scaler;
+
+const float PI = 3.14159265359;
+
+// Catmull-Rom
+float cubic(float x) {
+    x = abs(x);
+    if (x < 1.0)
+        return (1.5 * x - 2.5) * x * x + 1.0;
+    if (x < 2.0)
+        return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+    return 0.0;
+}
+
+float lanczos3(float x) {
+    if (abs(x) < 1e-5)
+        return 1.0;
+    if (abs(x) >= 3.0)
+        return 0.0;
+    float px = PI * x;
+    return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+}
+
+float kernel(float x) {
+    return FILTER == 1 ? cubic(x) : lanczos3(x);
+}
+
+void main() {
+    float stretch = max(1.0 / scaler.scale, 1.0);
+    float center = uv.y * scaler.srcSize.y - 0.5;
+    float base = floor(center);
+
+    vec3 sum = vec3(0.0);
+    float weights = 0.0;
+    for (int i = 1 - scaler.radius; i <= scaler.radius; ++i) {
+        float pos = base + float(i);
+        float w = kernel((pos - center) / stretch);
+        vec2 coord = vec2(uv.x, (pos + 0.5) / scaler.srcSize.y);
+        sum += w * texture(intermediate, coord).rgb;
+        weights += w;
+    }
+    outColor = vec4(clamp(sum / weights, 0.0, 1.0), 1.0);
+}
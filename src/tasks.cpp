@@ -0,0 +1,369 @@
+#include "tasks.h"
+
+#include  <vector>
+#include  <deque>
+#include  <memory>
+#include  <mutex>
+#include  <thread>
+#include  <condition_variable>
+#include  <algorithm>
+#include  <exception>
+#include  <string>
+#include  <dirent.h>
+#include  <pthread.h>
+#include  <sched.h>
+#include  <stdio.h>
+#include  <stdlib.h>
+
+namespace tasks
+{
+
+struct entry
+{
+  task    fn;
+  group*  owner = nullptr;
+};
+
+// one deque per lane; the owning worker pops from the back, thieves take
+// from the front
+struct worker_queue
+{
+  std::mutex          lock;
+  std::deque<entry>   lanes[2];
+};
+
+static std::vector<std::unique_ptr<worker_queue>> queues;
+static std::vector<std::thread>  workers;
+
+static std::mutex               sleep_lock;
+static std::condition_variable  wake;
+static std::atomic<int>         queued {0};
+static std::atomic<unsigned>    next_queue {0};
+static bool                     stop = false;
+
+static thread_local int  worker_idx = -1;
+
+void finish(group* g)
+{
+  if (g)
+    g->pending.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+static bool  pop_own(int idx, int l, entry& e)
+{
+  worker_queue& q = *queues[idx];
+  std::lock_guard<std::mutex> guard(q.lock);
+  if (q.lanes[l].empty())
+    return false;
+  e = std::move(q.lanes[l].back());
+  q.lanes[l].pop_back();
+  return true;
+}
+
+static bool  steal(int idx, int l, entry& e)
+{
+  worker_queue& q = *queues[idx];
+  std::unique_lock<std::mutex> guard(q.lock, std::try_to_lock);
+  if (!guard.owns_lock() || q.lanes[l].empty())
+    return false;
+  e = std::move(q.lanes[l].front());
+  q.lanes[l].pop_front();
+  return true;
+}
+
+static bool  take(int idx, entry& e)
+{
+  if (queued.load(std::memory_order_acquire) == 0)
+    return false;
+
+  const int queuesNum = (int)queues.size();
+  for (int l = 0; l < 2; ++l)
+  {
+    if (idx >= 0 && pop_own(idx, l, e))
+    {
+      queued.fetch_sub(1, std::memory_order_acq_rel);
+      return true;
+    }
+
+    int start = idx >= 0 ? idx + 1 : 0;
+    for (int i = 0; i < queuesNum; ++i)
+    {
+      int victim = (start + i) % queuesNum;
+      if (victim != idx && steal(victim, l, e))
+      {
+        queued.fetch_sub(1, std::memory_order_acq_rel);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void  run(entry& e)
+{
+  try {
+    e.fn();
+  }
+  catch (std::exception const& ex)
+  {
+    printf("[TASKS] task failed: %s\n", ex.what());
+  }
+  finish(e.owner);
+}
+
+static void  worker_loop(int idx)
+{
+  worker_idx = idx;
+  for (;;)
+  {
+    entry e;
+    if (take(idx, e))
+    {
+      run(e);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> guard(sleep_lock);
+    wake.wait(guard, [] { return stop || queued.load() > 0; });
+    if (stop && queued.load() == 0)
+      break;
+  }
+}
+
+void  init(unsigned threads_num)
+{
+  if (!workers.empty())
+    return;
+
+  if (threads_num == 0)
+    threads_num = std::max(1u, std::thread::hardware_concurrency());
+
+  stop = false;
+  for (unsigned i = 0; i < threads_num; ++i)
+    queues.push_back(std::make_unique<worker_queue>());
+  for (unsigned i = 0; i < threads_num; ++i)
+    workers.emplace_back(worker_loop, (int)i);
+
+  printf("[TASKS] %u workers\n", threads_num);
+}
+
+void  shutdown()
+{
+  {
+    std::lock_guard<std::mutex> guard(sleep_lock);
+    stop = true;
+  }
+  wake.notify_all();
+
+  for (std::thread& t: workers)
+    t.join();
+  workers.clear();
+  queues.clear();
+}
+
+void  submit(task&& t, lane l, group* g)
+{
+  if (g)
+    g->pending.fetch_add(1, std::memory_order_acq_rel);
+
+  // no pool: run inline so callers work the same way without threads
+  if (queues.empty())
+  {
+    entry e {std::move(t), g};
+    run(e);
+    return;
+  }
+
+  int idx = worker_idx >= 0 ? worker_idx
+                            : (int)(next_queue.fetch_add(1) % queues.size());
+  {
+    worker_queue& q = *queues[idx];
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.lanes[(int)l].push_back({std::move(t), g});
+  }
+  queued.fetch_add(1, std::memory_order_acq_rel);
+
+  {
+    std::lock_guard<std::mutex> guard(sleep_lock);
+  }
+  wake.notify_one();
+}
+
+void  wait(group& g)
+{
+  while (!g.done())
+  {
+    entry e;
+    if (take(worker_idx, e))
+      run(e);
+    else
+      std::this_thread::yield();
+  }
+}
+
+// "0-7,16-23"
+static std::vector<int>  parse_cpu_list(const char* text)
+{
+  std::vector<int> cpus;
+  const char* p = text;
+  while (*p)
+  {
+    char* end;
+    const long first = strtol(p, &end, 10);
+    if (end == p)
+      break;
+    long last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (long cpu = first; cpu <= last; ++cpu)
+      cpus.push_back((int)cpu);
+    p = *end == ',' ? end + 1 : end;
+  }
+  return cpus;
+}
+
+// CPUs of every node that has any, from sysfs
+static std::vector<std::vector<int>>  numa_node_cpus()
+{
+  std::vector<std::vector<int>> nodes;
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (!dir)
+    return nodes;
+  while (dirent* ent = readdir(dir))
+  {
+    int node;
+    if (sscanf(ent->d_name, "node%d", &node) != 1)
+      continue;
+    std::string path = std::string("/sys/devices/system/node/") + ent->d_name + "/cpulist";
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+      continue;
+    char list[4096] = {};
+    if (fgets(list, sizeof(list), file))
+    {
+      std::vector<int> cpus = parse_cpu_list(list);
+      if (!cpus.empty())
+        nodes.push_back(std::move(cpus));
+    }
+    fclose(file);
+  }
+  closedir(dir);
+  return nodes;
+}
+
+// SMT siblings of the CPU, from sysfs
+static std::vector<int>  cpu_siblings(int cpu)
+{
+  std::vector<int> siblings;
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                     "/topology/thread_siblings_list";
+  if (FILE* file = fopen(path.c_str(), "r"))
+  {
+    char list[256] = {};
+    if (fgets(list, sizeof(list), file))
+      siblings = parse_cpu_list(list);
+    fclose(file);
+  }
+  if (siblings.empty())
+    siblings.push_back(cpu);
+  return siblings;
+}
+
+// Whole cores of one node, with all their SMT siblings, at least
+// group_cpus logical CPUs per group unless the node has fewer.
+static std::vector<std::vector<int>>  core_groups(size_t group_cpus)
+{
+  std::vector<std::vector<int>> nodes = numa_node_cpus();
+  if (nodes.empty())
+  {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    nodes.emplace_back();
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &allowed))
+          nodes.back().push_back(cpu);
+  }
+
+  std::vector<std::vector<int>> groups;
+  for (std::vector<int> const& node: nodes)
+  {
+    const size_t first = groups.size();
+    std::vector<int> group;
+    std::vector<int> taken;
+    for (int cpu: node)
+    {
+      if (std::find(taken.begin(), taken.end(), cpu) != taken.end())
+        continue;
+      for (int sibling: cpu_siblings(cpu))
+        if (std::find(node.begin(), node.end(), sibling) != node.end() &&
+            std::find(taken.begin(), taken.end(), sibling) == taken.end())
+        {
+          group.push_back(sibling);
+          taken.push_back(sibling);
+        }
+      if (group.size() >= group_cpus)
+      {
+        groups.push_back(std::move(group));
+        group.clear();
+      }
+    }
+    // the cores left over join the node's last group
+    if (!group.empty() && groups.size() > first)
+      groups.back().insert(groups.back().end(), group.begin(), group.end());
+    else if (!group.empty())
+      groups.push_back(std::move(group));
+  }
+  return groups;
+}
+
+void  pin_workers(pinning p)
+{
+  if (p == pinning::none || workers.empty())
+    return;
+
+  // the decoder threads a worker starts share its CPUs, so a group has
+  // room for as many of them as one stream gets
+  std::vector<std::vector<int>> sets;
+  if (p == pinning::nodes)
+    sets = numa_node_cpus();
+  else
+    sets = core_groups(decoder_threads(1));
+  if (sets.empty())
+  {
+    printf("[TASKS] no CPU topology, workers not pinned\n");
+    return;
+  }
+
+  for (size_t i = 0; i < workers.size(); ++i)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: sets[i % sets.size()])
+      if (cpu < CPU_SETSIZE)
+        CPU_SET(cpu, &set);
+    pthread_setaffinity_np(workers[i].native_handle(), sizeof(set), &set);
+  }
+  printf("[TASKS] %zu workers pinned to %zu %s\n", workers.size(), sets.size(),
+         p == pinning::nodes ? "NUMA nodes" : "core groups");
+}
+
+unsigned  workers_count()
+{
+  return workers.size();
+}
+
+int   current_worker()
+{
+  return worker_idx;
+}
+
+unsigned  decoder_threads(unsigned streams_num)
+{
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  unsigned share = cores / std::max(1u, streams_num);
+  // VP9 tile threading does not scale past 8 threads
+  return std::min(8u, std::max(1u, share));
+}
+
+} // namespace tasks
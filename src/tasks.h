@@ -0,0 +1,63 @@
+#pragma once
+
+#include <functional>
+#include <atomic>
+
+namespace tasks
+{
+  // Work lanes. Workers always drain present-critical work (their own and
+  // stolen) before touching background work.
+  enum class lane
+  {
+    present,
+    background
+  };
+
+  using task = std::function<void()>;
+
+  // Counts outstanding tasks so a caller can wait for a batch to finish.
+  class group
+  {
+  public:
+    group() = default;
+    group(group const&) = delete;
+    group& operator=(group const&) = delete;
+
+    bool  done() const { return pending.load(std::memory_order_acquire) == 0; }
+
+  private:
+    friend void submit(task&&, lane, group*);
+    friend void finish(group*);
+
+    std::atomic<int>  pending {0};
+  };
+
+  // threads_num == 0 sizes the pool from std::thread::hardware_concurrency()
+  void  init(unsigned threads_num = 0);
+  void  shutdown();
+
+  void  submit(task&& t, lane l = lane::background, group* g = nullptr);
+  // runs queued tasks on the calling thread until the group is empty
+  void  wait(group& g);
+
+  // Binds the workers to CPUs round-robin: to groups of whole cores within
+  // a node, large enough for one stream's decoder threads, or to the NUMA
+  // nodes, so the pictures a worker decodes into stay on its node. Decoder
+  // threads started from a worker inherit its CPUs.
+  enum class pinning
+  {
+    none,
+    cores,
+    nodes
+  };
+  void  pin_workers(pinning p);
+
+  unsigned  workers_count();
+  // worker index of the calling thread or -1 for foreign threads
+  int       current_worker();
+
+  // libvpx spawns its own threads per decoder instance. Split the cores
+  // between simultaneously decoded streams so decoders and pool workers
+  // don't oversubscribe the machine.
+  unsigned  decoder_threads(unsigned streams_num);
+}
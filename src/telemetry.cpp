@@ -0,0 +1,191 @@
+#include "telemetry.h"
+
+#include  <atomic>
+#include  <condition_variable>
+#include  <mutex>
+#include  <string>
+#include  <thread>
+#include  <stdio.h>
+
+namespace telemetry
+{
+
+// upper bounds in microseconds, the last bucket is +Inf
+static const uint32_t  bucket_bounds_us[] = {250, 500, 1000, 2000, 4000, 8000, 16000, 33000, 66000};
+static const int       buckets_num = sizeof(bucket_bounds_us) / sizeof(bucket_bounds_us[0]) + 1;
+
+struct histogram_data
+{
+  std::atomic<uint64_t>  buckets[buckets_num];
+  std::atomic<uint64_t>  sum_ns {0};
+  std::atomic<uint64_t>  count {0};
+};
+
+struct metric_info
+{
+  const char*  name;
+  const char*  help;
+};
+
+static const metric_info  counter_info[] = {
+  {"vplay_frames_decoded_total", "Frames decoded."},
+  {"vplay_frames_skipped_total", "Frames not decoded to keep up or catch up."},
+  {"vplay_frames_presented_total", "Frames handed to the renderer."},
+  {"vplay_frames_dropped_total", "Decoded frames replaced by a newer one before presentation."},
+  {"vplay_frames_late_total", "Frames presented more than a frame after they were due."},
+  {"vplay_frames_rendered_total", "Frames rendered and presented to the swapchain."},
+  {"vplay_gpu_recoveries_total", "Device or surface losses the renderer recovered from."},
+  {"vplay_audio_underruns_total", "Audio periods played partly silent because decoding fell behind."},
+};
+
+static const metric_info  gauge_info[] = {
+  {"vplay_decoded_queue_frames", "Decoded frames waiting for presentation."},
+  {"vplay_jitter_buffer_packets", "Live stream packets waiting for the decoder."},
+  {"vplay_gpu_frames_in_flight", "Frames submitted to the GPU and not completed yet."},
+  {"vplay_gpu_memory_bytes", "Device memory allocated by the renderer."},
+  {"vplay_gpu_memory_headroom_bytes", "Device-local memory budget not in use yet."},
+  {"vplay_time_to_first_frame_microseconds", "From process start to the first video frame rendered."},
+};
+
+static const metric_info  histogram_info[] = {
+  {"vplay_decode_seconds", "Time to decode one packet."},
+  {"vplay_upload_seconds", "Time to copy one frame into the staging buffer."},
+  {"vplay_record_seconds", "Time to record the command buffers of one frame."},
+};
+
+static_assert(sizeof(counter_info) / sizeof(counter_info[0]) == (size_t)counter::count, "");
+static_assert(sizeof(gauge_info) / sizeof(gauge_info[0]) == (size_t)gauge::count, "");
+static_assert(sizeof(histogram_info) / sizeof(histogram_info[0]) == (size_t)histogram::count, "");
+
+static std::atomic<uint64_t>  counters[(size_t)counter::count];
+static std::atomic<int64_t>   gauges[(size_t)gauge::count];
+static histogram_data         histograms[(size_t)histogram::count];
+
+static struct
+{
+  std::string               path;
+  std::chrono::milliseconds interval {1000};
+  std::thread               thread;
+  std::mutex                lock;
+  std::condition_variable   wake;
+  bool                      stop = false;
+} writer;
+
+void  add(counter c, uint64_t n)
+{
+  counters[(size_t)c].fetch_add(n, std::memory_order_relaxed);
+}
+
+void  set(gauge g, int64_t value)
+{
+  gauges[(size_t)g].store(value, std::memory_order_relaxed);
+}
+
+void  add(gauge g, int64_t delta)
+{
+  gauges[(size_t)g].fetch_add(delta, std::memory_order_relaxed);
+}
+
+void  observe(histogram h, std::chrono::nanoseconds elapsed)
+{
+  histogram_data& data = histograms[(size_t)h];
+  const uint64_t ns = elapsed.count() > 0 ? elapsed.count() : 0;
+  int bucket = 0;
+  while (bucket < buckets_num - 1 && ns > bucket_bounds_us[bucket] * 1000ull)
+    ++bucket;
+  data.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  data.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+  data.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void  write_header(FILE* file, metric_info const& info, const char* type)
+{
+  fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", info.name, info.help, info.name, type);
+}
+
+static bool  write_snapshot()
+{
+  const std::string tmp = writer.path + ".tmp";
+  FILE* file = fopen(tmp.c_str(), "w");
+  if (!file)
+    return false;
+
+  for (size_t i = 0; i < (size_t)counter::count; ++i)
+  {
+    write_header(file, counter_info[i], "counter");
+    fprintf(file, "%s %llu\n", counter_info[i].name,
+            (unsigned long long)counters[i].load(std::memory_order_relaxed));
+  }
+  for (size_t i = 0; i < (size_t)gauge::count; ++i)
+  {
+    write_header(file, gauge_info[i], "gauge");
+    fprintf(file, "%s %lld\n", gauge_info[i].name,
+            (long long)gauges[i].load(std::memory_order_relaxed));
+  }
+  for (size_t i = 0; i < (size_t)histogram::count; ++i)
+  {
+    histogram_data const& data = histograms[i];
+    const char* name = histogram_info[i].name;
+    write_header(file, histogram_info[i], "histogram");
+    // buckets are cumulative in the exposition format
+    uint64_t cumulative = 0;
+    for (int b = 0; b < buckets_num; ++b)
+    {
+      cumulative += data.buckets[b].load(std::memory_order_relaxed);
+      if (b < buckets_num - 1)
+        fprintf(file, "%s_bucket{le=\"%g\"} %llu\n", name, bucket_bounds_us[b] / 1e6,
+                (unsigned long long)cumulative);
+      else
+        fprintf(file, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+    }
+    fprintf(file, "%s_sum %.9f\n%s_count %llu\n", name,
+            data.sum_ns.load(std::memory_order_relaxed) / 1e9, name,
+            (unsigned long long)cumulative);
+  }
+
+  bool ok = !ferror(file);
+  ok = fclose(file) == 0 && ok;
+  return ok && rename(tmp.c_str(), writer.path.c_str()) == 0;
+}
+
+static void  writer_loop()
+{
+  bool failed = false;
+  std::unique_lock<std::mutex> guard(writer.lock);
+  for (;;)
+  {
+    const bool stopping = writer.wake.wait_for(guard, writer.interval, [] { return writer.stop; });
+    guard.unlock();
+    const bool ok = write_snapshot();
+    if (!ok && !failed)
+      printf("[TELEMETRY] failed to write %s\n", writer.path.c_str());
+    failed = !ok;
+    guard.lock();
+    if (stopping)
+      break;
+  }
+}
+
+void  start(const char* path, uint32_t interval_ms)
+{
+  stop();
+  writer.path = path;
+  writer.interval = std::chrono::milliseconds(interval_ms ? interval_ms : 1000);
+  writer.stop = false;
+  writer.thread = std::thread(writer_loop);
+  printf("[TELEMETRY] writing %s every %u ms\n", path, (unsigned)writer.interval.count());
+}
+
+void  stop()
+{
+  if (!writer.thread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> guard(writer.lock);
+    writer.stop = true;
+  }
+  writer.wake.notify_one();
+  writer.thread.join();
+}
+
+} // namespace telemetry
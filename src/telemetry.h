@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+
+// Process-wide playback counters, exported in the Prometheus text format
+// to a file that a node_exporter textfile collector (or anything else) can
+// scrape. Updates are relaxed atomics and cost next to nothing when no
+// file is configured.
+namespace telemetry
+{
+  enum class counter
+  {
+    frames_decoded,
+    frames_skipped,       // not decoded: degradation or catching up live
+    frames_presented,
+    frames_dropped,       // decoded, but a newer frame was due
+    frames_late,
+    frames_rendered,
+    gpu_recoveries,       // device or surface losses recovered from
+    audio_underruns,      // audio periods the decoder didn't fill in time
+    count
+  };
+
+  enum class gauge
+  {
+    decoded_queue,        // decoded frames waiting for presentation
+    jitter_buffer,        // live packets waiting for the decoder
+    frames_in_flight,     // submitted to the GPU, not completed
+    gpu_memory_bytes,
+    gpu_memory_headroom_bytes,  // device-local budget left to the process
+    time_to_first_frame_us,
+    count
+  };
+
+  enum class histogram
+  {
+    decode,
+    upload,               // copy into the staging buffer
+    record,               // command buffer recording
+    count
+  };
+
+  void  add(counter c, uint64_t n = 1);
+  void  set(gauge g, int64_t value);
+  void  add(gauge g, int64_t delta);
+  void  observe(histogram h, std::chrono::nanoseconds elapsed);
+
+  // Rewrites path every interval_ms from a background thread, through a
+  // temporary file and rename() so readers never see a partial file.
+  void  start(const char* path, uint32_t interval_ms = 1000);
+  // writes a last snapshot and stops the writer
+  void  stop();
+
+  // measures the scope into a histogram
+  class timer
+  {
+  public:
+    explicit timer(histogram h) : h(h), begin(std::chrono::steady_clock::now()) {}
+    ~timer() { observe(h, std::chrono::steady_clock::now() - begin); }
+    timer(timer const&) = delete;
+    timer& operator=(timer const&) = delete;
+
+  private:
+    histogram                               h;
+    std::chrono::steady_clock::time_point   begin;
+  };
+}
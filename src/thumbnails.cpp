@@ -0,0 +1,217 @@
+#include "thumbnails.h"
+#include "demux.h"
+#include "decoder.h"
+#include "tasks.h"
+
+#include  <png.h>
+
+#include  <algorithm>
+#include  <atomic>
+#include  <stdexcept>
+#include  <stdio.h>
+#if defined(__SSE2__)
+#include  <emmintrin.h>
+#endif
+
+namespace thumbnails
+{
+
+// keeps a contact sheet below 1 GB of pixels
+static const uint64_t  max_sheet_side = 16384;
+
+struct rgb_image
+{
+  uint32_t              width = 0;
+  uint32_t              height = 0;
+  std::vector<uint8_t>  pixels;
+};
+
+static inline uint8_t  clamp8(int v)
+{
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// columns[x] += row[x]; SSE2 widens and adds 16 pixels per step
+static void  accumulate_row(const uint8_t* row, uint32_t* columns, uint32_t width)
+{
+  uint32_t x = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 16 <= width; x += 16)
+  {
+    const __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+    const __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+    const __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+    __m128i* acc = (__m128i*)(columns + x);
+    _mm_storeu_si128(acc + 0, _mm_add_epi32(_mm_loadu_si128(acc + 0), _mm_unpacklo_epi16(lo, zero)));
+    _mm_storeu_si128(acc + 1, _mm_add_epi32(_mm_loadu_si128(acc + 1), _mm_unpackhi_epi16(lo, zero)));
+    _mm_storeu_si128(acc + 2, _mm_add_epi32(_mm_loadu_si128(acc + 2), _mm_unpacklo_epi16(hi, zero)));
+    _mm_storeu_si128(acc + 3, _mm_add_epi32(_mm_loadu_si128(acc + 3), _mm_unpackhi_epi16(hi, zero)));
+  }
+#endif
+  for (; x < width; ++x)
+    columns[x] += row[x];
+}
+
+// Area-averaging resize of one plane. Source rows are summed into a column
+// accumulator first; that pass touches every source pixel and is the one
+// done with SIMD.
+static void  box_resize(const uint8_t* src, int stride, uint32_t src_w, uint32_t src_h,
+                        uint8_t* dst, uint32_t dst_w, uint32_t dst_h)
+{
+  std::vector<uint32_t> columns(src_w);
+  for (uint32_t dy = 0; dy < dst_h; ++dy)
+  {
+    uint32_t y0 = dy * src_h / dst_h;
+    uint32_t y1 = std::max(y0 + 1, (dy + 1) * src_h / dst_h);
+
+    std::fill(columns.begin(), columns.end(), 0);
+    for (uint32_t y = y0; y < y1; ++y)
+      accumulate_row(src + y * stride, columns.data(), src_w);
+
+    for (uint32_t dx = 0; dx < dst_w; ++dx)
+    {
+      uint32_t x0 = dx * src_w / dst_w;
+      uint32_t x1 = std::max(x0 + 1, (dx + 1) * src_w / dst_w);
+      uint32_t sum = 0;
+      for (uint32_t x = x0; x < x1; ++x)
+        sum += columns[x];
+      uint32_t area = (x1 - x0) * (y1 - y0);
+      dst[dy * dst_w + dx] = (sum + area / 2) / area;
+    }
+  }
+}
+
+// Scales a picture into a w x h tile of the sheet at (x, y), BT.709 limited
+// range like the shaders
+static void  draw_tile(video_frame const& picture, rgb_image& sheet,
+                       uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+  std::vector<uint8_t> planes[3];
+  for (int i = 0; i < 3; ++i)
+  {
+    uint32_t pw = i == 0 ? picture.width : (picture.width + 1) / 2;
+    uint32_t ph = i == 0 ? picture.height : (picture.height + 1) / 2;
+    planes[i].resize((size_t)w * h);
+    box_resize(picture.planes[i], picture.strides[i], pw, ph, planes[i].data(), w, h);
+  }
+
+  for (uint32_t ty = 0; ty < h; ++ty)
+  {
+    uint8_t* dst = sheet.pixels.data() + ((size_t)(y + ty) * sheet.width + x) * 3;
+    for (uint32_t tx = 0; tx < w; ++tx, dst += 3)
+    {
+      int c = 298 * (planes[0][ty * w + tx] - 16);
+      int d = planes[1][ty * w + tx] - 128;
+      int e = planes[2][ty * w + tx] - 128;
+      dst[0] = clamp8((c + 459 * e + 128) >> 8);
+      dst[1] = clamp8((c - 55 * d - 136 * e + 128) >> 8);
+      dst[2] = clamp8((c + 541 * d + 128) >> 8);
+    }
+  }
+}
+
+static void  write_png(std::string const& path, rgb_image const& image)
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file)
+    throw std::runtime_error("[THUMBS] failed to create " + path);
+
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  png_infop info = png ? png_create_info_struct(png) : nullptr;
+  // libpng reports errors with longjmp, so nothing with a destructor may
+  // be created past this point
+  if (!info || setjmp(png_jmpbuf(png)))
+  {
+    png_destroy_write_struct(&png, &info);
+    fclose(file);
+    throw std::runtime_error("[THUMBS] failed to write " + path);
+  }
+
+  png_init_io(png, file);
+  png_set_IHDR(png, info, image.width, image.height, 8, PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  for (uint32_t y = 0; y < image.height; ++y)
+    png_write_row(png, (png_const_bytep)(image.pixels.data() + (size_t)y * image.width * 3));
+  png_write_end(png, nullptr);
+
+  png_destroy_write_struct(&png, &info);
+  fclose(file);
+}
+
+static std::string  output_path(options const& opts, std::string const& input)
+{
+  size_t slash = input.find_last_of('/');
+  std::string name = input.substr(slash == std::string::npos ? 0 : slash + 1);
+  size_t dot = name.find_last_of('.');
+  if (dot != std::string::npos && dot > 0)
+    name.resize(dot);
+  return opts.out_dir + "/" + name + ".png";
+}
+
+static void  process_file(options const& opts, std::string const& path, unsigned decoder_threads)
+{
+  demux::webm_reader reader(path.c_str());
+  decode::vpx_decoder decoder(reader.video_codec(), decoder_threads);
+
+  if (reader.width() == 0 || reader.height() == 0)
+    throw std::runtime_error("[THUMBS] " + path + ": zero-sized video");
+  std::vector<int64_t> keyframes = reader.keyframes();
+  if (keyframes.empty())
+    throw std::runtime_error("[THUMBS] " + path + ": no keyframes");
+
+  const uint64_t w = opts.width;
+  const uint64_t h = std::max<uint64_t>(1, w * reader.height() / reader.width());
+  if (w * opts.columns > max_sheet_side || h * opts.rows > max_sheet_side)
+    throw std::runtime_error("[THUMBS] " + path + ": sheet larger than " +
+                             std::to_string(max_sheet_side) + " pixels on a side");
+  const uint32_t count = opts.columns * opts.rows;
+
+  rgb_image sheet;
+  sheet.width = (uint32_t)(w * opts.columns);
+  sheet.height = (uint32_t)(h * opts.rows);
+  sheet.pixels.resize((size_t)sheet.width * sheet.height * 3);
+
+  demux::packet pkt;
+  video_frame picture;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    // evenly spaced over the keyframes, centered in each slot
+    size_t idx = (2 * i + 1) * keyframes.size() / (2 * count);
+    if (!reader.read_keyframe(keyframes[idx], pkt) || !decoder.decode(pkt, picture))
+      throw std::runtime_error("[THUMBS] " + path + ": keyframe at " +
+                               std::to_string(keyframes[idx] / 1000000) + " ms failed to decode");
+    draw_tile(picture, sheet, (i % opts.columns) * w, (i / opts.columns) * h, w, h);
+  }
+
+  write_png(output_path(opts, path), sheet);
+}
+
+unsigned  run(options const& opts, std::vector<std::string> const& files)
+{
+  // whole files go to the workers, so libvpx only gets the remaining cores
+  const unsigned decoderThreads = tasks::decoder_threads(files.size());
+
+  std::atomic<unsigned> failed {0};
+  tasks::group batch;
+  for (std::string const& path: files)
+  {
+    tasks::submit([&opts, &path, &failed, decoderThreads]
+      {
+        try {
+          process_file(opts, path, decoderThreads);
+          printf("[THUMBS] %s\n", output_path(opts, path).c_str());
+        }
+        catch (std::exception const& e)
+        {
+          printf("%s\n", e.what());
+          ++failed;
+        }
+      }, tasks::lane::background, &batch);
+  }
+  tasks::wait(batch);
+  return failed;
+}
+
+} // namespace thumbnails
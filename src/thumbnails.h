@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Headless preview extraction: decodes only the keyframes listed in the
+// WebM cues and writes one PNG per input file.
+namespace thumbnails
+{
+  struct options
+  {
+    std::string   out_dir = ".";
+    uint32_t      width = 320;    // of one thumbnail, the height keeps the aspect
+    uint32_t      columns = 1;    // more than 1x1 makes a contact sheet of
+    uint32_t      rows = 1;       // evenly spaced keyframes
+  };
+
+  // Files are processed in parallel on the task pool. Returns the number of
+  // files that failed.
+  unsigned  run(options const& opts, std::vector<std::string> const& files);
+}
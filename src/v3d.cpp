@@ -1,10 +1,26 @@
 #include "v3d.h"
 #include "vulkantools.h"
 #include "shaders.h"
+#include "tasks.h"
+#include "telemetry.h"
+#include "hostmem.h"
 
 #include  <vector>
+#include  <deque>
 #include  <unordered_map>
+#include  <chrono>
+#include  <atomic>
+#include  <mutex>
+#include  <shared_mutex>
+#include  <thread>
+#include  <algorithm>
+#include  <exception>
+#include  <functional>
+#include  <cmath>
+#include  <cstddef>
 #include  <stdio.h>
+#include  <stdlib.h>
+#include  <string.h>
 
 namespace v3d {
 
@@ -24,12 +40,163 @@ struct SwapchainBuffer
 {
   vk::Image          image;
   vk::ImageView      view;
-  vk::CommandBuffer  cmd;
   vk::Framebuffer    framebuffer;
 };
 
+struct Texture
+{
+  vk::Image          image;
+  vk::ImageView      view;
+  vk::DeviceMemory   memory;
+};
+
+// Secondary command buffers recorded by one thread. Command pools are
+// externally synchronized, so every recording thread owns its own.
+struct RecordContext
+{
+  vk::CommandPool                 command_pool;
+  std::vector<vk::CommandBuffer>  buffers;
+  uint32_t                        used = 0;
+};
+
+// Everything one frame in flight needs. The command pools are transient and
+// reset as a whole before the frame is recorded again.
+struct FrameResources
+{
+  vk::CommandPool    command_pool;
+  vk::CommandBuffer  upload_cmd;
+  vk::CommandBuffer  convert_cmd;
+  vk::CommandBuffer  cmd;
+  vk::Fence          fence;
+  uint64_t           serial = 0;    // last submission that used this frame
+  vk::Semaphore      image_acquired_semaphore;
+  vk::Semaphore      render_finished_semaphore;
+
+  // [0] is used by non-pool threads, [i + 1] by task worker i
+  std::vector<RecordContext>  recorders;
+
+  // host-visible copy of the video frame uploaded by this frame
+  vk::Buffer         staging;
+  vk::DeviceMemory   staging_memory;
+  uint8_t*           staging_data = nullptr;
+  // direct uploads write into the frame's own linear planes instead, which
+  // any later frame may sample until the next upload replaces them
+  Texture            linear_planes[3];
+  uint8_t*           plane_data[3] = {};
+  vk::DeviceSize     row_pitch[3] = {};
+  vk::DescriptorSet  planes_set;
+  bool               linear_ready = false;    // left the preinitialized layout
+  uint64_t           sampled_serial = 0;      // last submission that sampled them
+  // upload_pending and upload_buffer are guarded by host_import.lock, the
+  // hostmem release hook checks them from decode threads
+  bool               upload_pending = false;
+  // what the pending upload copies from: the staging buffer or an imported
+  // picture, with its plane offsets and row lengths (0 when packed)
+  vk::Buffer         upload_buffer;
+  vk::DeviceSize     upload_offsets[3] = {};
+  uint32_t           upload_row_length[3] = {};
+  std::chrono::steady_clock::time_point  arrival;   // when the upload was handed in
+  ColorFormat        color;
+};
+
+// Swapchain depth and frame pacing of a present_profile
+struct PresentProfile
+{
+  const char*         name;
+  vk::PresentModeKHR  modes[3];       // in order of preference, FIFO always works
+  uint32_t            images;
+  bool                just_in_time;   // wait for the previous frame before acquiring
+  bool                on_new_frame;   // present only when a new video frame arrived
+};
+
+static const PresentProfile  present_profiles[] = {
+  {"low-latency", {vk::PresentModeKHR::eMailbox, vk::PresentModeKHR::eImmediate,
+                   vk::PresentModeKHR::eFifo}, 2, true, false},
+  {"smooth",      {vk::PresentModeKHR::eFifo, vk::PresentModeKHR::eFifo,
+                   vk::PresentModeKHR::eFifo}, 3, false, false},
+  {"power-save",  {vk::PresentModeKHR::eFifo, vk::PresentModeKHR::eFifo,
+                   vk::PresentModeKHR::eFifo}, 2, false, true},
+};
+
+// power-save redraws a paused picture for a layout change after this long
+static const std::chrono::milliseconds  layout_defer_limit(250);
+
+// Matches the push constant block of the scaler shaders.
+struct ScalerParams
+{
+  float     src_width;
+  float     src_height;
+  float     scale;
+  int32_t   radius;
+};
+
+// The color conversion and the scaler kernel are specialization constants,
+// every combination in use is its own pipeline.
+enum class pipeline_kind : uint32_t
+{
+  bilinear,     // convert and sample straight into the tiles
+  scale_h,      // convert and filter horizontally into the intermediate image
+  scale_v       // filter the intermediate image vertically into the tiles
+};
+
+struct ColorFormat
+{
+  color_matrix  matrix = color_matrix::bt709;
+  bool          full_range = false;
+  uint8_t       bit_depth = 8;
+
+  bool  operator==(ColorFormat const& o) const
+  {
+    return matrix == o.matrix && full_range == o.full_range && bit_depth == o.bit_depth;
+  }
+  bool  operator!=(ColorFormat const& o) const { return !(*this == o); }
+};
+
+struct PipelineKey
+{
+  pipeline_kind  kind = pipeline_kind::bilinear;
+  ColorFormat    color;
+  scaler         filter = scaler::bilinear;
+
+  uint32_t  packed() const
+  {
+    return (uint32_t)kind | (uint32_t)color.matrix << 4 | (uint32_t)color.full_range << 8 |
+           (uint32_t)color.bit_depth << 12 | (uint32_t)filter << 20;
+  }
+};
+
+// Matches the constant_id layout of the shaders.
+struct SpecializationData
+{
+  int32_t   color_matrix;
+  VkBool32  full_range;
+  int32_t   bit_depth;
+  int32_t   filter;
+};
+
+enum pipeline_state : int
+{
+  pipeline_queued,
+  pipeline_compiling,
+  pipeline_ready,
+  pipeline_failed
+};
+
+// Whoever moves an entry from queued to compiling builds it, the background
+// task or a render that can't wait for it.
+struct CachedPipeline
+{
+  PipelineKey       key;
+  vk::Pipeline      pipeline;
+  std::atomic<int>  state {pipeline_queued};
+};
+
+static const uint32_t  frames_in_flight = 2;
+static uint32_t        api_version = VK_API_VERSION_1_0;
+
 static std::vector<vk::LayerProperties>      layers;
 static std::vector<vk::ExtensionProperties>  extensions;
+static std::vector<const char*>              instance_extensions;
 static std::unordered_map<std::string, decltype(extensions)>  layers_extensions;
 
 static vk::Instance   instance;
@@ -40,8 +207,126 @@ static vk::Extent2D       swapchain_extent;
 static vk::SurfaceFormatKHR  swapchain_format;
 
 static std::vector<SwapchainBuffer>  swapchain_buffers;
-static vk::Semaphore  image_acquired_semaphore;
-static vk::Semaphore  render_finished_semaphore;
+static FrameResources frames[frames_in_flight];
+static uint32_t       frame_index = 0;
+static uint32_t       frames_active = frames_in_flight;   // 1 under memory pressure
+
+static uint32_t       tile_columns = 1;
+static uint32_t       tile_rows = 1;
+
+static scaler         active_scaler = scaler::automatic;
+static present_profile  active_profile = present_profile::smooth;
+static const int32_t  max_filter_radius = 16;
+
+// How decoded planes reach the GPU. Staging copies them into optimally
+// tiled device-local images; direct writes them straight into linear images
+// in memory that is device-local and host-visible, as integrated GPUs have
+// it, and samples those without a copy.
+enum class upload_path
+{
+  staging,
+  direct
+};
+
+static struct
+{
+  bool  supported = false;
+  uint32_t  memory_type_bits = 0;   // device-local, host-visible and coherent
+} direct_upload;
+
+// YUV planes of the current video frame
+static struct
+{
+  uint32_t        width = 0;
+  uint32_t        height = 0;
+  upload_path     upload = upload_path::staging;
+  Texture         planes[3];        // staging uploads only
+  vk::DescriptorSet  set;           // planes_set or the sampled frame's
+  vk::DeviceSize  offsets[3] = {};
+  vk::DeviceSize  size = 0;
+  bool            ready = false;
+  ColorFormat     color;            // of the frame in the textures
+  ColorFormat     uploaded_color;   // of the newest upload_frame()
+} source;
+
+// output of the horizontal scaler pass: destination width, source image height
+static const vk::Format  intermediate_format = vk::Format::eR16G16B16A16Sfloat;
+static struct
+{
+  vk::Extent2D      extent;
+  Texture           texture;
+  vk::Framebuffer   framebuffer;
+} intermediate;
+
+// how the video is scaled this frame; written before recording starts and
+// only read by the recording threads
+static struct
+{
+  scaler        filter = scaler::bilinear;
+  ScalerParams  horizontal;
+  ScalerParams  vertical;
+  vk::Pipeline  horizontal_pipeline;
+  vk::Pipeline  tile_pipeline;
+  PipelineKey   horizontal_key;
+  PipelineKey   tile_key;
+} scale_plan;
+
+static struct
+{
+  std::chrono::nanoseconds  total {0};
+  std::chrono::nanoseconds  max {0};
+  uint32_t                  count = 0;
+} record_stats;
+
+// Why the window content is stale. render() does nothing while it's zero,
+// so paused or low frame rate video doesn't cost a frame per loop.
+enum damage_bits : uint32_t
+{
+  damage_frame    = 1,    // new video frame uploaded
+  damage_layout   = 2,    // tiles, scaler or overlay changed
+  damage_surface  = 4     // swapchain rebuilt or window exposed
+};
+
+static struct
+{
+  uint32_t  bits = damage_surface;
+  uint32_t  rendered = 0;
+  uint32_t  skipped = 0;
+  bool      deferred = false;   // layout damage waiting for a video frame
+  std::chrono::steady_clock::time_point  deferred_since;
+} damage;
+
+// Time from upload_frame() to the frame reaching the display. With
+// VK_GOOGLE_display_timing that is the reported actual present time,
+// otherwise only the point the GPU finished rendering it is known, which
+// is kept as a separate statistic.
+struct PendingPresent
+{
+  uint64_t                               serial;
+  std::chrono::steady_clock::time_point  arrival;
+};
+
+struct LatencyStats
+{
+  const char*               name;
+  std::chrono::nanoseconds  total {0};
+  std::chrono::nanoseconds  max {0};
+  uint32_t                  count = 0;
+};
+
+// presents without timing after this many frames are given up on
+static const uint64_t  latency_window = 8;
+
+static struct
+{
+  bool  display_timing = false;
+#ifdef VK_GOOGLE_display_timing
+  PFN_vkGetPastPresentationTimingGOOGLE  past_timing = nullptr;
+#endif
+  std::deque<PendingPresent>  pending;
+  LatencyStats                glass {"glass-to-glass"};
+  LatencyStats                render {"upload-to-render-done"};
+} latency;
 
 static struct 
 {
@@ -52,25 +337,140 @@ static struct
 
 static vk::PipelineCache  pipeline_cache;
 static vk::PipelineLayout pipeline_layout;
-static vk::Pipeline       pipeline;
+
+static struct
+{
+  std::mutex    lock;
+  std::unordered_map<uint32_t, std::unique_ptr<CachedPipeline>>  entries;
+  tasks::group      group;
+  vk::ShaderModule  vert;
+  vk::ShaderModule  frag[3];      // by pipeline_kind
+  bool              stale = false;  // a frame was drawn with the previous color format
+} pipelines;
 static vk::RenderPass     render_pass;
+static vk::RenderPass     intermediate_pass;
+
+static vk::Sampler              linear_sampler;
+static vk::DescriptorSetLayout  planes_set_layout;
+static vk::DescriptorSetLayout  intermediate_set_layout;
+static vk::DescriptorPool       descriptor_pool;
+// pools added when descriptor_pool ran out or fragmented, with the sets
+// allocated from them
+static std::vector<vk::DescriptorPool>  extra_pools;
+static std::unordered_map<VkDescriptorSet, vk::DescriptorPool>  extra_pool_sets;
+static vk::DescriptorSet        planes_set;
+static vk::DescriptorSet        intermediate_set;
+
+// Per-stage GPU progress counted in frame serials. With timeline semaphores
+// every stage signals its own semaphore; otherwise the frame fences are
+// polled, which only tells when the whole frame is done.
+static struct
+{
+  bool                    enabled = false;
+  vk::Semaphore           semaphores[3];
+  std::atomic<uint64_t>   submitted {0};
+  std::atomic<uint64_t>   completed {0};
+  std::mutex              fence_lock;
+} timeline;
+
+// Device and surface loss. Decode threads poll the timeline and free
+// imported pictures while the device may be rebuilt, so they hold the
+// device lock shared and on_device_lost() holds it exclusively.
+static struct
+{
+  std::shared_mutex   device_lock;
+  std::atomic<bool>   device_lost {false};  // seen by a wait on another thread
+  std::atomic<bool>   source_lost {false};
+  bool                surface_lost = false;
+  VkSurfaceKHR        surface = VK_NULL_HANDLE;
+  bool                fault_pending = false;
+  fault               injected = fault::device_lost;
+  uint32_t            fault_countdown = 0;
+} recovery;
+
+// VK_KHR_dynamic_rendering: no render pass or framebuffer objects, so a
+// swapchain rebuild only has to recreate the image views
+static struct
+{
+  bool  enabled = false;
+#ifdef VK_KHR_dynamic_rendering
+  PFN_vkCmdBeginRenderingKHR  begin = nullptr;
+  PFN_vkCmdEndRenderingKHR    end = nullptr;
+#endif
+} dynamic_rendering;
 
-static vk::CommandPool    command_pool;
-static std::vector<vk::CommandBuffer> command_buffers;
+// Single multi-planar source image sampled through an immutable
+// VK_KHR_sampler_ycbcr_conversion sampler instead of three R8 planes.
+static struct
+{
+  bool    enabled = false;
+#ifdef VK_KHR_sampler_ycbcr_conversion
+  vk::Filter                          filter = vk::Filter::eNearest;
+  vk::ChromaLocationKHR               chroma_location = vk::ChromaLocationKHR::eMidpoint;
+  vk::SamplerYcbcrConversionKHR       conversion;
+  vk::Sampler                         sampler;
+  PFN_vkCreateSamplerYcbcrConversionKHR   create = nullptr;
+  PFN_vkDestroySamplerYcbcrConversionKHR  destroy = nullptr;
+#endif
+} ycbcr;
+
+// Device-local memory budget of the process. VK_EXT_memory_budget counts
+// every process on the GPU; without it only our own allocations are
+// counted against the heap sizes. Under pressure the renderer keeps one
+// frame in flight and scales in a single bilinear pass, which releases the
+// second staging buffer and the intermediate image.
+static struct
+{
+  bool  enabled = false;
+#ifdef VK_EXT_memory_budget
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR  get_properties = nullptr;
+#endif
+  vk::DeviceSize  heap_used[VK_MAX_MEMORY_HEAPS] = {};   // our allocations
+  vk::DeviceSize  budget = 0;
+  vk::DeviceSize  usage = 0;
+  bool            pressure = false;
+  bool            exhausted = false;    // an allocation failed, shrink now
+  std::chrono::steady_clock::time_point  next_check;
+} memory_budget;
+
+// Decoded pictures imported with VK_EXT_external_memory_host, so uploads
+// copy from them on the GPU without a CPU copy into staging. Imports are
+// cached by address; pictures are recycled, so a few cover a whole stream.
+struct HostImport
+{
+  vk::Buffer        buffer;
+  vk::DeviceMemory  memory;
+  size_t            size = 0;
+  uint64_t          serial = 0;   // last frame that copies from it
+};
+
+static struct
+{
+  bool            enabled = false;
+  vk::DeviceSize  alignment = 0;    // minImportedHostPointerAlignment
+#ifdef VK_EXT_external_memory_host
+  PFN_vkGetMemoryHostPointerPropertiesEXT  get_properties = nullptr;
+#endif
+  std::mutex      lock;       // also held while a frame records its upload
+  std::unordered_map<const void*, HostImport>  imports;
+} host_import;
 
 static std::vector<GPUInfo> system_GPUs;
 static int active_GPU = -1;
 
-static int  present_mode_value(vk::PresentModeKHR pm)
+static PresentProfile const& get_profile()
 {
-  switch (pm)
+  return present_profiles[(int)active_profile];
+}
+
+static vk::PresentModeKHR  choose_present_mode(std::vector<vk::PresentModeKHR> const& modes)
+{
+  for (vk::PresentModeKHR pm: get_profile().modes)
   {
-    case vk::PresentModeKHR::eMailbox: return 5;
-    case vk::PresentModeKHR::eFifo: return 4;
-    case vk::PresentModeKHR::eFifoRelaxed: return 3;
-    case vk::PresentModeKHR::eImmediate: return 2;
-    default: return 0;
+    if (std::find(modes.begin(), modes.end(), pm) != modes.end())
+      return pm;
   }
+  return vk::PresentModeKHR::eFifo;
 }
 
 static GPUInfo const& get_gpu()
@@ -83,15 +483,39 @@ static void enum_layers_and_extensions()
   layers = vk::enumerateInstanceLayerProperties();
   extensions = vk::enumerateInstanceExtensionProperties();
  
-  for (vk::LayerProperties const& props: layers)
+  // every query loads the layer library, so they run side by side
+  std::vector<std::vector<vk::ExtensionProperties>> layerExtensions(layers.size());
+  tasks::group queries;
+  for (size_t i = 0; i < layers.size(); ++i)
+  {
+    tasks::submit([i, &layerExtensions]
+      {
+        layerExtensions[i] = vk::enumerateInstanceExtensionProperties(
+                                    std::string(layers[i].layerName));
+      }, tasks::lane::present, &queries);
+  }
+  tasks::wait(queries);
+
+  for (size_t i = 0; i < layers.size(); ++i)
   {
-    auto layerExtensions = vk::enumerateInstanceExtensionProperties(
-                                std::string(props.layerName));
-    if (!layerExtensions.empty())
-      layers_extensions[props.layerName] = std::move(layerExtensions);
+    if (!layerExtensions[i].empty())
+      layers_extensions[layers[i].layerName] = std::move(layerExtensions[i]);
   }
 }
 
+static uint32_t  choose_api_version()
+{
+#ifdef VK_VERSION_1_2
+  // vkEnumerateInstanceVersion is missing from 1.0 loaders
+  auto enumerateVersion = (PFN_vkEnumerateInstanceVersion)
+                            vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkEnumerateInstanceVersion");
+  uint32_t version = VK_API_VERSION_1_0;
+  if (enumerateVersion && enumerateVersion(&version) == VK_SUCCESS)
+    return std::min<uint32_t>(version, VK_API_VERSION_1_2);
+#endif
+  return VK_API_VERSION_1_0;
+}
+
 static bool  layer_supported(const char* layer_name)
 {
   for (VkLayerProperties const& props: layers)
@@ -115,7 +539,11 @@ static bool  extension_suported(const char* ext_name,
 
 static std::vector<const char*>  choose_extensions()
 {
-  const char* optional[] = {VK_EXT_DEBUG_REPORT_EXTENSION_NAME};
+  const char* optional[] = {VK_EXT_DEBUG_REPORT_EXTENSION_NAME,
+#if defined(VK_KHR_sampler_ycbcr_conversion) || defined(VK_EXT_memory_budget)
+                            VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
+#endif
+                           };
   const char* required[] = {VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_XCB_SURFACE_EXTENSION_NAME};
 
   std::vector<const char*>  result;
@@ -143,17 +571,38 @@ static std::vector<const char*>  choose_extensions()
   return result;
 }
 
-static std::vector<const char*> choose_device_extensions(GPUInfo const& gpu)
+static std::vector<const char*> choose_device_extensions(GPUInfo const& gpu, bool report = true)
 {
-  const char* optional[] = {};
-  const char* required[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_NV_GLSL_SHADER_EXTENSION_NAME};
+  const char* optional[] = {
+#ifdef VK_KHR_sampler_ycbcr_conversion
+                            VK_KHR_MAINTENANCE1_EXTENSION_NAME,
+                            VK_KHR_BIND_MEMORY_2_EXTENSION_NAME,
+                            VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME,
+                            VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME,
+#endif
+#ifdef VK_KHR_dynamic_rendering
+                            VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+#endif
+#ifdef VK_GOOGLE_display_timing
+                            VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME,
+#endif
+#ifdef VK_EXT_memory_budget
+                            VK_EXT_MEMORY_BUDGET_EXTENSION_NAME,
+#endif
+#ifdef VK_EXT_external_memory_host
+                            VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME,
+#endif
+                           };
+  // the shaders are SPIR-V, so CPU implementations without
+  // VK_NV_glsl_shader work as well
+  const char* required[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
   std::vector<const char*>  result;
 
   for (const char* ext_name: optional)
   {
     if (extension_suported(ext_name, gpu.extensions))
       result.push_back(ext_name);
-    else
+    else if (report)
       printf("[VULKAN] Optional device extension %s is not supported\n", ext_name);
   }
 
@@ -229,11 +678,100 @@ static uint32_t find_memory_type(uint32_t type_bits,
   throw vulkan_error("failed to find required memory properties");
 }
 
+struct Allocation
+{
+  vk::DeviceSize  size;
+  uint32_t        heap;
+};
+
+// live device allocations, to report the memory in use per heap
+static std::unordered_map<VkDeviceMemory, Allocation>  allocations;
+
+static vk::DeviceMemory  allocate_memory(vk::MemoryRequirements const& reqs,
+                                         vk::MemoryPropertyFlags flags)
+{
+  const uint32_t type = find_memory_type(reqs.memoryTypeBits, flags);
+  vk::DeviceMemory memory = device.allocateMemory(vk::MemoryAllocateInfo()
+                                                    .setAllocationSize(reqs.size)
+                                                    .setMemoryTypeIndex(type)
+                                                  );
+  const uint32_t heap = get_gpu().memoryProps.memoryTypes[type].heapIndex;
+  allocations[(VkDeviceMemory)memory] = {reqs.size, heap};
+  memory_budget.heap_used[heap] += reqs.size;
+  telemetry::add(telemetry::gauge::gpu_memory_bytes, (int64_t)reqs.size);
+  return memory;
+}
+
+static void  free_memory(vk::DeviceMemory& memory)
+{
+  auto it = allocations.find((VkDeviceMemory)memory);
+  if (it != allocations.end())
+  {
+    memory_budget.heap_used[it->second.heap] -= it->second.size;
+    telemetry::add(telemetry::gauge::gpu_memory_bytes, -(int64_t)it->second.size);
+    allocations.erase(it);
+  }
+  vktools::destroy_handle(memory, device);
+}
+
+// Refreshes the device-local budget and usage and the headroom gauge
+static void  update_memory_budget()
+{
+  GPUInfo const& gpuInfo = get_gpu();
+  vk::PhysicalDeviceMemoryProperties const& props = gpuInfo.memoryProps;
+  vk::DeviceSize heapBudget[VK_MAX_MEMORY_HEAPS] = {};
+  vk::DeviceSize heapUsage[VK_MAX_MEMORY_HEAPS] = {};
+  for (uint32_t i = 0; i < props.memoryHeapCount; ++i)
+  {
+    heapBudget[i] = props.memoryHeaps[i].size;
+    heapUsage[i] = memory_budget.heap_used[i];
+  }
+#ifdef VK_EXT_memory_budget
+  if (memory_budget.enabled)
+  {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProps = {};
+    budgetProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2KHR props2 = {};
+    props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+    props2.pNext = &budgetProps;
+    memory_budget.get_properties(static_cast<VkPhysicalDevice>(gpuInfo.device), &props2);
+    for (uint32_t i = 0; i < props.memoryHeapCount; ++i)
+    {
+      heapBudget[i] = budgetProps.heapBudget[i];
+      heapUsage[i] = budgetProps.heapUsage[i];
+    }
+  }
+#endif
+
+  memory_budget.budget = 0;
+  memory_budget.usage = 0;
+  for (uint32_t i = 0; i < props.memoryHeapCount; ++i)
+  {
+    if (!(props.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal))
+      continue;
+    memory_budget.budget += heapBudget[i];
+    memory_budget.usage += heapUsage[i];
+  }
+  telemetry::set(telemetry::gauge::gpu_memory_headroom_bytes,
+                 (int64_t)memory_budget.budget - (int64_t)memory_budget.usage);
+}
+
+static void  print_memory_budget(const char* what)
+{
+  const double mib = 1 << 20;
+  printf("[V3D] device memory %s: %.0f MiB used of %.0f MiB budget (%s), %u frame%s in flight\n",
+         what, memory_budget.usage / mib, memory_budget.budget / mib,
+         memory_budget.enabled ? "VK_EXT_memory_budget" : "own allocations",
+         frames_active, frames_active > 1 ? "s" : "");
+}
+
 void  init(const char* app_name, const char* engine_name)
 {
   enum_layers_and_extensions();
+  api_version = choose_api_version();
 
-  std::vector<const char*>  usedInstanceExtensions = choose_extensions();
+  instance_extensions = choose_extensions();
+  std::vector<const char*> const& usedInstanceExtensions = instance_extensions;
   std::vector<const char*>  usedLayers = choose_layers();
 
   if (!usedInstanceExtensions.empty())
@@ -257,7 +795,7 @@ void  init(const char* app_name, const char* engine_name)
                         .setApplicationVersion(0)
                         .setPEngineName(engine_name)
                         .setEngineVersion(0)
-                        .setApiVersion(VK_API_VERSION_1_0);
+                        .setApiVersion(api_version);
 
   instance = vk::createInstance(
               vk::InstanceCreateInfo()
@@ -271,47 +809,350 @@ void  init(const char* app_name, const char* engine_name)
   enum_GPUs();
 }
 
+// Objects frames in flight may still use are retired instead of destroyed,
+// and destroyed once the last frame submitted before has completed. So
+// resizes and source changes don't wait for the device to go idle.
+struct RetiredObject
+{
+  uint64_t               serial;
+  std::function<void()>  destroy;
+};
+
+static std::deque<RetiredObject>  retired;
+
+static void  defer_destroy(std::function<void()>&& destroy)
+{
+  retired.push_back({timeline.submitted, std::move(destroy)});
+}
+
+template<typename vkHandle>
+static void  retire(vkHandle& handle)
+{
+  if (!handle)
+    return;
+  defer_destroy([h = handle] () mutable { vktools::destroy_handle(h, device); });
+  handle = vkHandle();
+}
+
+static void  retire_memory(vk::DeviceMemory& memory)
+{
+  if (!memory)
+    return;
+  defer_destroy([m = memory] () mutable { free_memory(m); });
+  memory = vk::DeviceMemory();
+}
+
+static void  retire_set(vk::DescriptorSet& set)
+{
+  if (!set)
+    return;
+  vk::DescriptorPool pool = descriptor_pool;
+  auto it = extra_pool_sets.find(static_cast<VkDescriptorSet>(set));
+  if (it != extra_pool_sets.end())
+  {
+    pool = it->second;
+    extra_pool_sets.erase(it);
+  }
+  defer_destroy([s = set, pool] { device.freeDescriptorSets(pool, 1, &s); });
+  set = vk::DescriptorSet();
+}
+
+// UINT64_MAX destroys everything, the device has to be idle then
+static void  destroy_retired(uint64_t completed)
+{
+  while (!retired.empty() && retired.front().serial <= completed)
+  {
+    retired.front().destroy();
+    retired.pop_front();
+  }
+}
+
 void free_depth_buffer()
 {
-  vktools::destroy_handle(depth_buffer.view, device);
-  vktools::destroy_handle(depth_buffer.image, device);
-  vktools::destroy_handle(depth_buffer.memory, device);
+  retire(depth_buffer.view);
+  retire(depth_buffer.image);
+  retire_memory(depth_buffer.memory);
 }
 
 void free_swapchain_views()
 {
   for (SwapchainBuffer& buffer: swapchain_buffers)
   {
-    vktools::destroy_handle(buffer.view, device);
-    vktools::destroy_handle(buffer.framebuffer, device);
-    device.freeCommandBuffers(command_pool, 1, &buffer.cmd);
+    retire(buffer.view);
+    retire(buffer.framebuffer);
   }
   swapchain_buffers.clear();
 }
 
+void free_texture(Texture& texture)
+{
+  retire(texture.view);
+  retire(texture.image);
+  retire_memory(texture.memory);
+}
+
+static void  free_upload_target(FrameResources& frame)
+{
+  retire(frame.staging);
+  retire_memory(frame.staging_memory);
+  frame.staging_data = nullptr;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    free_texture(frame.linear_planes[i]);
+    frame.plane_data[i] = nullptr;
+  }
+  frame.linear_ready = false;
+  frame.sampled_serial = 0;
+  std::lock_guard<std::mutex> guard(host_import.lock);
+  frame.upload_pending = false;
+  frame.upload_buffer = vk::Buffer();
+}
+
+void free_source()
+{
+  for (Texture& plane: source.planes)
+    free_texture(plane);
+
+  for (FrameResources& frame: frames)
+    free_upload_target(frame);
+  source.set = vk::DescriptorSet();
+  source.width = source.height = 0;
+  source.ready = false;
+}
+
+void free_intermediate()
+{
+  retire(intermediate.framebuffer);
+  free_texture(intermediate.texture);
+  intermediate.extent = vk::Extent2D();
+}
+
+static void  free_ycbcr_sampler()
+{
+#ifdef VK_KHR_sampler_ycbcr_conversion
+  vktools::destroy_handle(ycbcr.sampler, device);
+  if (ycbcr.conversion)
+  {
+    ycbcr.destroy((VkDevice)device, (VkSamplerYcbcrConversionKHR)ycbcr.conversion, nullptr);
+    ycbcr.conversion = vk::SamplerYcbcrConversionKHR();
+  }
+#endif
+}
+
+void free_frames()
+{
+  for (FrameResources& frame: frames)
+  {
+    vktools::destroy_handle(frame.fence, device);
+    vktools::destroy_handle(frame.command_pool, device);
+    frame.upload_cmd = vk::CommandBuffer();
+    frame.convert_cmd = vk::CommandBuffer();
+    frame.cmd = vk::CommandBuffer();
+    frame.planes_set = vk::DescriptorSet();   // freed with the pool
+
+    for (RecordContext& ctx: frame.recorders)
+      vktools::destroy_handle(ctx.command_pool, device);
+    frame.recorders.clear();
+  }
+}
+
+// Fallback progress for devices without timeline semaphores. Frames finish
+// in submission order, so the newest signalled fence covers older frames.
+static uint64_t  fence_progress()
+{
+  std::lock_guard<std::mutex> guard(timeline.fence_lock);
+  uint64_t completed = timeline.completed;
+  for (FrameResources& frame: frames)
+  {
+    if (frame.serial > completed && frame.fence &&
+        device.getFenceStatus(frame.fence) == vk::Result::eSuccess)
+      completed = frame.serial;
+  }
+  timeline.completed = completed;
+  return completed;
+}
+
+// wait_gpu() for callers holding the device lock
+static void  wait_serial(stage s, uint64_t frame)
+{
+  try {
+#ifdef VK_VERSION_1_2
+    if (timeline.enabled)
+    {
+      auto const waitInfo = vk::SemaphoreWaitInfo()
+                              .setSemaphoreCount(1)
+                              .setPSemaphores(&timeline.semaphores[(int)s])
+                              .setPValues(&frame);
+      device.waitSemaphores(waitInfo, UINT64_MAX);
+      return;
+    }
+#endif
+    while (fence_progress() < frame)
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+  }
+  catch (vk::DeviceLostError const&)
+  {
+    recovery.device_lost = true;
+  }
+}
+
+// Imports the block unless it is already imported, or returns a null buffer when
+// the device can't import it. Called with the lock held.
+static vk::Buffer  import_host_block(const uint8_t* data, size_t size)
+{
+  auto it = host_import.imports.find(data);
+  if (it != host_import.imports.end())
+    return it->second.buffer;
+  if ((uintptr_t)data % host_import.alignment != 0 || size % host_import.alignment != 0)
+    return vk::Buffer();
+
+#ifdef VK_EXT_external_memory_host
+  const auto handleType = vk::ExternalMemoryHandleTypeFlagBits::eHostAllocationEXT;
+  VkMemoryHostPointerPropertiesEXT pointerProps = {};
+  pointerProps.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+  if (host_import.get_properties(static_cast<VkDevice>(device),
+                                 (VkExternalMemoryHandleTypeFlagBits)handleType,
+                                 data, &pointerProps) != VK_SUCCESS)
+    return vk::Buffer();
+
+  auto const externalInfo = vk::ExternalMemoryBufferCreateInfo().setHandleTypes(handleType);
+  HostImport entry;
+  entry.size = size;
+  entry.buffer = device.createBuffer(vk::BufferCreateInfo()
+                                       .setPNext(&externalInfo)
+                                       .setSize(size)
+                                       .setUsage(vk::BufferUsageFlagBits::eTransferSrc)
+                                       .setSharingMode(vk::SharingMode::eExclusive));
+
+  // host writes happen before the submission, coherent memory needs no flush
+  vk::MemoryRequirements memReqs = device.getBufferMemoryRequirements(entry.buffer);
+  const uint32_t typeBits = memReqs.memoryTypeBits & pointerProps.memoryTypeBits;
+  vk::PhysicalDeviceMemoryProperties const& props = get_gpu().memoryProps;
+  uint32_t type = 0;
+  while (type < props.memoryTypeCount &&
+         (!(typeBits & (1u << type)) ||
+          !(props.memoryTypes[type].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent)))
+    ++type;
+
+  try {
+    if (type == props.memoryTypeCount)
+      throw vulkan_error("no coherent memory type to import host memory into");
+    auto const importInfo = vk::ImportMemoryHostPointerInfoEXT()
+                              .setHandleType(handleType)
+                              .setPHostPointer(const_cast<uint8_t*>(data));
+    entry.memory = device.allocateMemory(vk::MemoryAllocateInfo()
+                                           .setPNext(&importInfo)
+                                           .setAllocationSize(size)
+                                           .setMemoryTypeIndex(type));
+    device.bindBufferMemory(entry.buffer, entry.memory, 0);
+  }
+  catch (std::exception const& e)
+  {
+    // leave the picture to the staging copy
+    printf("[V3D] host memory import failed: %s\n", e.what());
+    vktools::destroy_handle(entry.buffer, device);
+    vktools::destroy_handle(entry.memory, device);
+    return vk::Buffer();
+  }
+  host_import.imports[data] = entry;
+  return entry.buffer;
+#else
+  return vk::Buffer();
+#endif
+}
+
+// hostmem release hook: the block is about to be freed, so the GPU has to
+// be done copying from it. Runs on decode threads; holding the lock keeps
+// render_frame() from recording a copy from the buffer meanwhile.
+static void  release_host_import(const void* data)
+{
+  std::shared_lock<std::shared_mutex> device_guard(recovery.device_lock);
+  std::lock_guard<std::mutex> guard(host_import.lock);
+  auto it = host_import.imports.find(data);
+  if (it == host_import.imports.end())
+    return;
+  HostImport entry = it->second;
+  host_import.imports.erase(it);
+
+  // a pending upload from it is dropped, it was never submitted
+  for (FrameResources& frame: frames)
+    if (frame.upload_pending && frame.upload_buffer == entry.buffer)
+      frame.upload_pending = false;
+  if (entry.serial <= timeline.submitted)
+    wait_serial(stage::upload, entry.serial);
+  vktools::destroy_handle(entry.buffer, device);
+  vktools::destroy_handle(entry.memory, device);
+}
+
+static void  free_host_imports()
+{
+  std::lock_guard<std::mutex> guard(host_import.lock);
+  for (auto& it: host_import.imports)
+  {
+    vktools::destroy_handle(it.second.buffer, device);
+    vktools::destroy_handle(it.second.memory, device);
+  }
+  host_import.imports.clear();
+}
+
 void  free_resources()
 {
   printf("v3d::free_resources\n");
   free_swapchain_views();
   free_depth_buffer();
 
-  vktools::destroy_handle(pipeline, device);
+  free_source();
+  free_intermediate();
+  free_host_imports();
+  destroy_retired(UINT64_MAX);
+
+  // background compiles still use the shader modules
+  tasks::wait(pipelines.group);
+  for (auto& it: pipelines.entries)
+    vktools::destroy_handle(it.second->pipeline, device);
+  pipelines.entries.clear();
+  vktools::destroy_handle(pipelines.vert, device);
+  for (vk::ShaderModule& module: pipelines.frag)
+    vktools::destroy_handle(module, device);
+  scale_plan.horizontal_pipeline = vk::Pipeline();
+  scale_plan.tile_pipeline = vk::Pipeline();
   vktools::destroy_handle(pipeline_cache, device);
   vktools::destroy_handle(pipeline_layout, device);
+  vktools::destroy_handle(descriptor_pool, device);
+  for (vk::DescriptorPool& pool: extra_pools)
+    vktools::destroy_handle(pool, device);
+  extra_pools.clear();
+  extra_pool_sets.clear();
+  vktools::destroy_handle(planes_set_layout, device);
+  vktools::destroy_handle(intermediate_set_layout, device);
+  vktools::destroy_handle(linear_sampler, device);
+  free_ycbcr_sampler();
   vktools::destroy_handle(render_pass, device);
+  vktools::destroy_handle(intermediate_pass, device);
   vktools::destroy_handle(swapchain, device);
-  vktools::destroy_handle(command_pool, device);
+  free_frames();
+}
+
+static void  free_device()
+{
+  for (FrameResources& frame: frames)
+  {
+    vktools::destroy_handle(frame.render_finished_semaphore, device);
+    vktools::destroy_handle(frame.image_acquired_semaphore, device);
+  }
+  for (vk::Semaphore& semaphore: timeline.semaphores)
+    vktools::destroy_handle(semaphore, device);
+  vktools::destroy_handle(device);
 }
 
 void  shutdown()
 {
   printf("v3d::shutdown\n");
+  hostmem::set_release_hook(nullptr);
   active_GPU = -1;
   system_GPUs.clear();
 
-  vktools::destroy_handle(render_finished_semaphore, device);
-  vktools::destroy_handle(image_acquired_semaphore, device);
-  vktools::destroy_handle(device);
+  free_device();
   vktools::destroy_handle(instance);
 }
 
@@ -325,178 +1166,1947 @@ vk::Device&   get_device()
   return  device;
 }
 
-static void choose_GPU(VkSurfaceKHR surface)
+static bool  extension_enabled(const char* ext_name,
+                               std::vector<const char*> const& enabled)
 {
-  const vk::QueueFlags  requiredQueueFlags (vk::QueueFlagBits::eGraphics | 
-                                            vk::QueueFlagBits::eTransfer);
-  int integratedGPUidx = -1;
-  int discreteGPUidx = -1;
-
-  for (size_t i = 0; i < system_GPUs.size(); ++i)
+  for (const char* name: enabled)
   {
-    GPUInfo& gpuInfo = system_GPUs[i];
-    printf("Testing GPU %s...\n", gpuInfo.props.deviceName);
-    for (size_t qi = 0; qi < gpuInfo.queueFamilies.size(); ++qi)
-    {
-      vk::QueueFamilyProperties const& qfam = gpuInfo.queueFamilies[qi];
-      if ((qfam.queueFlags & requiredQueueFlags) == requiredQueueFlags)
-      {
-        if (gpuInfo.device.getSurfaceSupportKHR(qi, surface))
-        {
-          gpuInfo.renderQueueFamilyIdx = qi;
-          if (gpuInfo.props.deviceType == vk::PhysicalDeviceType::eDiscreteGpu)
-            discreteGPUidx = i;
-          else if (gpuInfo.props.deviceType == vk::PhysicalDeviceType::eIntegratedGpu)
-            integratedGPUidx = i;
-          break;
-        }
-      }
-    }
+    if (!strcmp(name, ext_name))
+      return true;
   }
+  return false;
+}
 
-  if (integratedGPUidx < 0 && discreteGPUidx < 0)
-    throw vulkan_error("failed to find suitable GPU");
- 
-  active_GPU = discreteGPUidx >= 0 ? discreteGPUidx : integratedGPUidx; 
-  GPUInfo const& gpuInfo = get_gpu();
-   
-  printf("Use GPU %s\n", gpuInfo.props.deviceName);
+// The multi-planar path needs the extension with its dependencies, the
+// feature bit and a 3-plane 4:2:0 format we can copy to and sample. Stores
+// the chroma location and filter to use on success.
+static bool  probe_ycbcr(GPUInfo const& gpu, std::vector<const char*> const& device_extensions,
+                         vk::ChromaLocationKHR& chroma_location, vk::Filter& filter)
+{
+#ifdef VK_KHR_sampler_ycbcr_conversion
+  const char* needed[] = {VK_KHR_MAINTENANCE1_EXTENSION_NAME,
+                          VK_KHR_BIND_MEMORY_2_EXTENSION_NAME,
+                          VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME,
+                          VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME};
+  for (const char* ext_name: needed)
+    if (!extension_enabled(ext_name, device_extensions))
+      return false;
+  if (!extension_enabled(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
+                         instance_extensions))
+    return false;
 
-  const float one = 1.0f;
-  vk::DeviceQueueCreateInfo queueCreateInfo;
-  queueCreateInfo.setQueueCount(1);
+  auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)
+                        instance.getProcAddr("vkGetPhysicalDeviceFeatures2KHR");
+  if (!getFeatures2)
+    return false;
+
+  VkPhysicalDeviceSamplerYcbcrConversionFeaturesKHR ycbcrFeatures = {};
+  ycbcrFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SAMPLER_YCBCR_CONVERSION_FEATURES_KHR;
+  VkPhysicalDeviceFeatures2KHR features = {};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+  features.pNext = &ycbcrFeatures;
+  getFeatures2(static_cast<VkPhysicalDevice>(gpu.device), &features);
+  if (!ycbcrFeatures.samplerYcbcrConversion)
+    return false;
+
+  vk::FormatFeatureFlags formatFeatures =
+      gpu.device.getFormatProperties(vk::Format::eG8B8R83Plane420UnormKHR).optimalTilingFeatures;
+  if (!(formatFeatures & vk::FormatFeatureFlagBits::eSampledImage) ||
+      !(formatFeatures & vk::FormatFeatureFlagBits::eTransferDstKHR))
+    return false;
+
+  if (formatFeatures & vk::FormatFeatureFlagBits::eMidpointChromaSamplesKHR)
+    chroma_location = vk::ChromaLocationKHR::eMidpoint;
+  else if (formatFeatures & vk::FormatFeatureFlagBits::eCositedChromaSamplesKHR)
+    chroma_location = vk::ChromaLocationKHR::eCositedEven;
+  else
+    return false;
+
+  filter = (formatFeatures & vk::FormatFeatureFlagBits::eSampledImageYcbcrConversionLinearFilterKHR)
+              ? vk::Filter::eLinear : vk::Filter::eNearest;
+  return true;
+#else
+  return false;
+#endif
+}
+
+static bool  probe_timeline(GPUInfo const& gpu)
+{
+#ifdef VK_VERSION_1_2
+  if (api_version < VK_API_VERSION_1_2 || gpu.props.apiVersion < VK_API_VERSION_1_2)
+    return false;
+
+  VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+  VkPhysicalDeviceFeatures2 features = {};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &timelineFeatures;
+  vkGetPhysicalDeviceFeatures2(static_cast<VkPhysicalDevice>(gpu.device), &features);
+  return timelineFeatures.timelineSemaphore == VK_TRUE;
+#else
+  return false;
+#endif
+}
+
+static bool  probe_dynamic_rendering(GPUInfo const& gpu,
+                                     std::vector<const char*> const& device_extensions)
+{
+#if defined(VK_KHR_dynamic_rendering) && defined(VK_VERSION_1_2)
+  // the extension's dependencies are core in 1.2
+  if (api_version < VK_API_VERSION_1_2 || gpu.props.apiVersion < VK_API_VERSION_1_2 ||
+      !extension_enabled(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME, device_extensions))
+    return false;
+
+  VkPhysicalDeviceDynamicRenderingFeaturesKHR renderingFeatures = {};
+  renderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+  VkPhysicalDeviceFeatures2 features = {};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &renderingFeatures;
+  vkGetPhysicalDeviceFeatures2(static_cast<VkPhysicalDevice>(gpu.device), &features);
+  return renderingFeatures.dynamicRendering == VK_TRUE;
+#else
+  return false;
+#endif
+}
+
+static bool  probe_memory_budget(std::vector<const char*> const& device_extensions)
+{
+#ifdef VK_EXT_memory_budget
+  if (!extension_enabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, device_extensions) ||
+      !extension_enabled(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
+                         instance_extensions))
+    return false;
+
+  memory_budget.get_properties = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)
+                        instance.getProcAddr("vkGetPhysicalDeviceMemoryProperties2KHR");
+  return memory_budget.get_properties != nullptr;
+#else
+  return false;
+#endif
+}
+
+static const vk::MemoryPropertyFlags  direct_memory_flags =
+    vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible |
+    vk::MemoryPropertyFlagBits::eHostCoherent;
+
+// Direct uploads need the source format to be sampled from linear tiling
+// the same way as from optimal tiling, and a memory type that is both
+// device-local and host-visible. Whether linear images can be bound to it
+// is only known with an image, see choose_upload_path().
+static bool  probe_direct_upload(GPUInfo const& gpu)
+{
+  vk::Format format = vk::Format::eR8Unorm;
+  vk::FormatFeatureFlags needed = vk::FormatFeatureFlagBits::eSampledImage |
+                                  vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+  if (ycbcr.enabled)
+  {
+#ifdef VK_KHR_sampler_ycbcr_conversion
+    format = vk::Format::eG8B8R83Plane420UnormKHR;
+    needed = vk::FormatFeatureFlagBits::eSampledImage;
+    needed |= ycbcr.chroma_location == vk::ChromaLocationKHR::eMidpoint
+                ? vk::FormatFeatureFlagBits::eMidpointChromaSamplesKHR
+                : vk::FormatFeatureFlagBits::eCositedChromaSamplesKHR;
+    if (ycbcr.filter == vk::Filter::eLinear)
+      needed |= vk::FormatFeatureFlagBits::eSampledImageYcbcrConversionLinearFilterKHR;
+#endif
+  }
+  vk::FormatFeatureFlags features = gpu.device.getFormatProperties(format).linearTilingFeatures;
+  if ((features & needed) != needed)
+    return false;
+
+  direct_upload.memory_type_bits = 0;
+  for (uint32_t i = 0; i < gpu.memoryProps.memoryTypeCount; ++i)
+  {
+    vk::MemoryPropertyFlags flags = gpu.memoryProps.memoryTypes[i].propertyFlags;
+    if ((flags & direct_memory_flags) == direct_memory_flags)
+      direct_upload.memory_type_bits |= 1u << i;
+  }
+  return direct_upload.memory_type_bits != 0;
+}
+
+static bool  probe_host_import(GPUInfo const& gpu,
+                               std::vector<const char*> const& device_extensions)
+{
+#if defined(VK_EXT_external_memory_host) && defined(VK_VERSION_1_1)
+  // VK_KHR_external_memory is core in 1.1
+  if (api_version < VK_API_VERSION_1_1 || gpu.props.apiVersion < VK_API_VERSION_1_1 ||
+      !extension_enabled(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME, device_extensions))
+    return false;
+
+  VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProps = {};
+  hostProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+  VkPhysicalDeviceProperties2 props = {};
+  props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  props.pNext = &hostProps;
+  vkGetPhysicalDeviceProperties2(static_cast<VkPhysicalDevice>(gpu.device), &props);
+  host_import.alignment = hostProps.minImportedHostPointerAlignment;
+  return host_import.alignment > 0;
+#else
+  return false;
+#endif
+}
+
+static void  load_dynamic_rendering()
+{
+#ifdef VK_KHR_dynamic_rendering
+  dynamic_rendering.begin = (PFN_vkCmdBeginRenderingKHR)
+                              device.getProcAddr("vkCmdBeginRenderingKHR");
+  dynamic_rendering.end = (PFN_vkCmdEndRenderingKHR)
+                              device.getProcAddr("vkCmdEndRenderingKHR");
+  if (!dynamic_rendering.begin || !dynamic_rendering.end)
+    throw vulkan_error("failed to load VK_KHR_dynamic_rendering entry points");
+#endif
+}
+
+// GPU selection: an index or name from set_gpu_override() wins, otherwise
+// the best score. Benchmark results are cached by pipelineCacheUUID, which
+// changes with the device and driver version.
+static struct
+{
+  std::string  override_name;
+  std::string  benchmark_cache;   // empty: no benchmark
+} gpu_selection;
+
+static std::string  uuid_string(vk::PhysicalDeviceProperties const& props)
+{
+  std::string result;
+  char hex[3];
+  for (uint32_t i = 0; i < VK_UUID_SIZE; ++i)
+  {
+    snprintf(hex, sizeof(hex), "%02x", props.pipelineCacheUUID[i]);
+    result += hex;
+  }
+  return result;
+}
+
+static std::unordered_map<std::string, double>  load_benchmarks(std::string const& path)
+{
+  std::unordered_map<std::string, double>  result;
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file)
+    return result;
+  char uuid[2 * VK_UUID_SIZE + 1];
+  double ms;
+  while (fscanf(file, "%32s %lf", uuid, &ms) == 2)
+    result[uuid] = ms;
+  fclose(file);
+  return result;
+}
+
+static void  save_benchmarks(std::string const& path,
+                             std::unordered_map<std::string, double> const& results)
+{
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file)
+  {
+    printf("[V3D] can't write the GPU benchmark cache %s\n", path.c_str());
+    return;
+  }
+  for (auto const& it: results)
+    fprintf(file, "%s %.3f\n", it.first.c_str(), it.second);
+  fclose(file);
+}
+
+// Times the per-frame GPU work on a device of its own: a 1080p frame copied
+// from a staging buffer into its planes, then a filtered blit of the luma
+// plane to 1440p standing in for the conversion pass. Median milliseconds
+// of a few runs, 0 when the device can't run it.
+static double  benchmark_GPU(GPUInfo const& gpu, uint32_t queue_family)
+{
+  const uint32_t width = 1920;
+  const uint32_t height = 1080;
+  const vk::Extent2D extents[4] = {{width, height}, {width / 2, height / 2},
+                                   {width / 2, height / 2}, {2560, 1440}};
+  const vk::DeviceSize planeOffsets[3] = {0, width * height, width * height * 5 / 4};
+  const vk::DeviceSize size = width * height * 3 / 2;
+  const vk::Format format = vk::Format::eR8Unorm;
+  const vk::FormatFeatureFlags blitFeatures = vk::FormatFeatureFlagBits::eBlitSrc |
+                                              vk::FormatFeatureFlagBits::eBlitDst |
+                                              vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+
+  auto memoryType = [&gpu] (uint32_t bits, vk::MemoryPropertyFlags flags)
+    {
+      for (uint32_t i = 0; i < gpu.memoryProps.memoryTypeCount; ++i)
+        if ((bits & (1u << i)) && (gpu.memoryProps.memoryTypes[i].propertyFlags & flags) == flags)
+          return i;
+      throw vulkan_error("no memory type for the benchmark");
+    };
+
+  vk::Device        dev;
+  vk::Buffer        staging;
+  vk::Image         images[4];
+  vk::DeviceMemory  memory[5];
+  vk::CommandPool   pool;
+  vk::Fence         fence;
+  double            result = 0;
+  try {
+    const float one = 1.0f;
+    auto const queueInfo = vk::DeviceQueueCreateInfo()
+                             .setQueueFamilyIndex(queue_family)
+                             .setQueueCount(1)
+                             .setPQueuePriorities(&one);
+    dev = gpu.device.createDevice(vk::DeviceCreateInfo()
+                                    .setQueueCreateInfoCount(1)
+                                    .setPQueueCreateInfos(&queueInfo));
+
+    staging = dev.createBuffer(vk::BufferCreateInfo()
+                                 .setSize(size)
+                                 .setUsage(vk::BufferUsageFlagBits::eTransferSrc)
+                                 .setSharingMode(vk::SharingMode::eExclusive));
+    vk::MemoryRequirements reqs = dev.getBufferMemoryRequirements(staging);
+    memory[4] = dev.allocateMemory(vk::MemoryAllocateInfo()
+                                     .setAllocationSize(reqs.size)
+                                     .setMemoryTypeIndex(memoryType(reqs.memoryTypeBits,
+                                        vk::MemoryPropertyFlagBits::eHostVisible |
+                                        vk::MemoryPropertyFlagBits::eHostCoherent)));
+    dev.bindBufferMemory(staging, memory[4], 0);
+    memset(dev.mapMemory(memory[4], 0, size), 0x80, size);
+
+    const bool blit = (gpu.device.getFormatProperties(format).optimalTilingFeatures & blitFeatures) ==
+                      blitFeatures;
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+      images[i] = dev.createImage(vk::ImageCreateInfo()
+                                    .setImageType(vk::ImageType::e2D)
+                                    .setFormat(format)
+                                    .setExtent(vk::Extent3D(extents[i].width, extents[i].height, 1))
+                                    .setMipLevels(1)
+                                    .setArrayLayers(1)
+                                    .setSamples(vk::SampleCountFlagBits::e1)
+                                    .setTiling(vk::ImageTiling::eOptimal)
+                                    .setUsage(vk::ImageUsageFlagBits::eTransferDst |
+                                              vk::ImageUsageFlagBits::eTransferSrc)
+                                    .setSharingMode(vk::SharingMode::eExclusive)
+                                    .setInitialLayout(vk::ImageLayout::eUndefined));
+      reqs = dev.getImageMemoryRequirements(images[i]);
+      memory[i] = dev.allocateMemory(vk::MemoryAllocateInfo()
+                                       .setAllocationSize(reqs.size)
+                                       .setMemoryTypeIndex(memoryType(reqs.memoryTypeBits,
+                                          vk::MemoryPropertyFlagBits::eDeviceLocal)));
+      dev.bindImageMemory(images[i], memory[i], 0);
+    }
+
+    pool = dev.createCommandPool(vk::CommandPoolCreateInfo().setQueueFamilyIndex(queue_family));
+    vk::CommandBuffer cmd = dev.allocateCommandBuffers(vk::CommandBufferAllocateInfo()
+                              .setCommandPool(pool)
+                              .setLevel(vk::CommandBufferLevel::ePrimary)
+                              .setCommandBufferCount(1))[0];
+
+    auto const range = vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+    auto const layers = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+    vk::ImageMemoryBarrier barriers[4];
+    for (uint32_t i = 0; i < 4; ++i)
+      barriers[i] = vk::ImageMemoryBarrier()
+                      .setDstAccessMask(vk::AccessFlagBits::eTransferWrite)
+                      .setOldLayout(vk::ImageLayout::eUndefined)
+                      .setNewLayout(vk::ImageLayout::eTransferDstOptimal)
+                      .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                      .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                      .setImage(images[i])
+                      .setSubresourceRange(range);
+
+    cmd.begin(vk::CommandBufferBeginInfo());
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer,
+                        vk::DependencyFlags(), 0, nullptr, 0, nullptr, 4, barriers);
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+      auto const region = vk::BufferImageCopy()
+                            .setBufferOffset(planeOffsets[i])
+                            .setImageSubresource(layers)
+                            .setImageExtent(vk::Extent3D(extents[i].width, extents[i].height, 1));
+      cmd.copyBufferToImage(staging, images[i], vk::ImageLayout::eTransferDstOptimal, 1, &region);
+    }
+    if (blit)
+    {
+      barriers[0].setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                 .setDstAccessMask(vk::AccessFlagBits::eTransferRead)
+                 .setOldLayout(vk::ImageLayout::eTransferDstOptimal)
+                 .setNewLayout(vk::ImageLayout::eTransferSrcOptimal);
+      cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer,
+                          vk::DependencyFlags(), 0, nullptr, 0, nullptr, 1, barriers);
+      vk::ImageBlit region;
+      region.setSrcSubresource(layers).setDstSubresource(layers);
+      region.srcOffsets[1] = vk::Offset3D(width, height, 1);
+      region.dstOffsets[1] = vk::Offset3D(extents[3].width, extents[3].height, 1);
+      cmd.blitImage(images[0], vk::ImageLayout::eTransferSrcOptimal,
+                    images[3], vk::ImageLayout::eTransferDstOptimal, 1, &region, vk::Filter::eLinear);
+    }
+    cmd.end();
+
+    // the first run warms up the driver
+    fence = dev.createFence(vk::FenceCreateInfo());
+    vk::Queue queue = dev.getQueue(queue_family, 0);
+    std::vector<double> runs;
+    for (int run = 0; run < 6; ++run)
+    {
+      auto const start = std::chrono::steady_clock::now();
+      queue.submit(vk::SubmitInfo().setCommandBufferCount(1).setPCommandBuffers(&cmd), fence);
+      dev.waitForFences(1, &fence, VK_TRUE, UINT64_MAX);
+      dev.resetFences(1, &fence);
+      if (run > 0)
+        runs.push_back(std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(runs.begin(), runs.end());
+    result = runs[runs.size() / 2];
+  }
+  catch (std::exception const& e)
+  {
+    printf("[V3D] benchmark on %s failed: %s\n", gpu.props.deviceName, e.what());
+    result = 0;
+  }
+
+  if (dev)
+  {
+    try {
+      dev.waitIdle();
+    }
+    catch (vk::SystemError const&)
+    {
+    }
+    vktools::destroy_handle(fence, dev);
+    vktools::destroy_handle(pool, dev);
+    for (vk::Image& image: images)
+      vktools::destroy_handle(image, dev);
+    vktools::destroy_handle(staging, dev);
+    for (vk::DeviceMemory& mem: memory)
+      vktools::destroy_handle(mem, dev);
+    vktools::destroy_handle(dev);
+  }
+  return result;
+}
+
+// The device type counts most and the capabilities playback benefits from
+// break ties within a type. Benchmarked, measured speed relative to the
+// fastest device replaces the type, and any measured device ranks above
+// the unmeasured ones. -1 when the device can't be used.
+static int64_t  score_GPU(GPUInfo const& gpu, double speed)
+{
+  int64_t score = 0;
+  if (speed > 0)
+    score += 10000 + (int64_t)(4000 * speed);
+  else if (gpu.props.deviceType == vk::PhysicalDeviceType::eDiscreteGpu)
+    score += 4000;
+  else if (gpu.props.deviceType == vk::PhysicalDeviceType::eIntegratedGpu)
+    score += 3000;
+  else if (gpu.props.deviceType == vk::PhysicalDeviceType::eVirtualGpu)
+    score += 2000;
+  else if (gpu.props.deviceType == vk::PhysicalDeviceType::eCpu)
+    score += 1000;
+
+  std::vector<const char*> deviceExtensions;
+  try {
+    deviceExtensions = choose_device_extensions(gpu, false);
+  }
+  catch (vulkan_error const&)
+  {
+    return -1;
+  }
+  vk::ChromaLocationKHR chromaLocation;
+  vk::Filter chromaFilter;
+  if (probe_ycbcr(gpu, deviceExtensions, chromaLocation, chromaFilter))
+    score += 300;
+
+  // uploads can overlap rendering on a dedicated transfer queue
+  for (vk::QueueFamilyProperties const& qfam: gpu.queueFamilies)
+    if ((qfam.queueFlags & vk::QueueFlagBits::eTransfer) &&
+        !(qfam.queueFlags & vk::QueueFlagBits::eGraphics))
+    {
+      score += 150;
+      break;
+    }
+
+  const vk::MemoryPropertyFlags localMapped = vk::MemoryPropertyFlagBits::eDeviceLocal |
+                                              vk::MemoryPropertyFlagBits::eHostVisible;
+  for (uint32_t i = 0; i < gpu.memoryProps.memoryTypeCount; ++i)
+    if ((gpu.memoryProps.memoryTypes[i].propertyFlags & localMapped) == localMapped)
+    {
+      score += 150;
+      break;
+    }
+
+  vk::DeviceSize vram = 0;
+  for (uint32_t i = 0; i < gpu.memoryProps.memoryHeapCount; ++i)
+    if (gpu.memoryProps.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal)
+      vram += gpu.memoryProps.memoryHeaps[i].size;
+  score += 25 * std::min<int64_t>(vram >> 30, 12);
+  return score;
+}
+
+static int  pick_GPU(std::vector<int> const& candidates)
+{
+  std::string const& name = gpu_selection.override_name;
+  if (!name.empty())
+  {
+    // a number is an index, anything else part of the device name
+    const bool numeric = strspn(name.c_str(), "0123456789") == name.size();
+    const long index = numeric ? strtol(name.c_str(), nullptr, 10) : -1;
+    for (int i: candidates)
+      if (numeric ? index == i : strstr(system_GPUs[i].props.deviceName, name.c_str()) != nullptr)
+        return i;
+    throw vulkan_error("no usable GPU matches " + name);
+  }
+
+  std::vector<double> times(system_GPUs.size(), 0.0);
+  double fastest = 0;
+  if (!gpu_selection.benchmark_cache.empty())
+  {
+    auto cache = load_benchmarks(gpu_selection.benchmark_cache);
+    bool changed = false;
+    for (int i: candidates)
+    {
+      GPUInfo const& gpu = system_GPUs[i];
+      const std::string uuid = uuid_string(gpu.props);
+      auto it = cache.find(uuid);
+      // caches from before failures were left out may hold a 0
+      if (it != cache.end() && it->second > 0)
+        times[i] = it->second;
+      else
+      {
+        printf("Benchmarking GPU %s...\n", gpu.props.deviceName);
+        times[i] = benchmark_GPU(gpu, gpu.renderQueueFamilyIdx);
+        // a failed run is tried again next time
+        if (times[i] > 0)
+        {
+          cache[uuid] = times[i];
+          changed = true;
+        }
+      }
+      if (times[i] > 0 && (fastest == 0 || times[i] < fastest))
+        fastest = times[i];
+    }
+    if (changed)
+      save_benchmarks(gpu_selection.benchmark_cache, cache);
+  }
+
+  int best = -1;
+  int64_t bestScore = -1;
+  for (int i: candidates)
+  {
+    const double speed = times[i] > 0 ? fastest / times[i] : 0;
+    const int64_t score = score_GPU(system_GPUs[i], speed);
+    if (times[i] > 0)
+      printf("GPU %s: score %lld, %.2f ms per frame\n", system_GPUs[i].props.deviceName,
+             (long long)score, times[i]);
+    else
+      printf("GPU %s: score %lld\n", system_GPUs[i].props.deviceName, (long long)score);
+    if (score > bestScore)
+    {
+      best = i;
+      bestScore = score;
+    }
+  }
+  if (best < 0)
+    throw vulkan_error("failed to find suitable GPU");
+  return best;
+}
+
+void  set_gpu_override(const char* name)
+{
+  gpu_selection.override_name = name ? name : "";
+}
+
+void  set_gpu_benchmark(const char* cache_path)
+{
+  gpu_selection.benchmark_cache = cache_path ? cache_path : "";
+}
+
+static void choose_GPU(VkSurfaceKHR surface)
+{
+  const vk::QueueFlags  requiredQueueFlags (vk::QueueFlagBits::eGraphics | 
+                                            vk::QueueFlagBits::eTransfer);
+  std::vector<int> candidates;
+
+  for (size_t i = 0; i < system_GPUs.size(); ++i)
+  {
+    GPUInfo& gpuInfo = system_GPUs[i];
+    printf("Testing GPU %s...\n", gpuInfo.props.deviceName);
+    for (size_t qi = 0; qi < gpuInfo.queueFamilies.size(); ++qi)
+    {
+      vk::QueueFamilyProperties const& qfam = gpuInfo.queueFamilies[qi];
+      if ((qfam.queueFlags & requiredQueueFlags) == requiredQueueFlags)
+      {
+        if (gpuInfo.device.getSurfaceSupportKHR(qi, surface))
+        {
+          gpuInfo.renderQueueFamilyIdx = qi;
+          candidates.push_back(i);
+          break;
+        }
+      }
+    }
+  }
+
+  if (candidates.empty())
+    throw vulkan_error("failed to find suitable GPU");
+ 
+  active_GPU = pick_GPU(candidates);
+  GPUInfo const& gpuInfo = get_gpu();
+   
+  printf("Use GPU %s\n", gpuInfo.props.deviceName);
+
+  const float one = 1.0f;
+  vk::DeviceQueueCreateInfo queueCreateInfo;
+  queueCreateInfo.setQueueCount(1);
   queueCreateInfo.setQueueFamilyIndex(gpuInfo.renderQueueFamilyIdx);
   queueCreateInfo.setPQueuePriorities(&one);
 
-  auto deviceExtensions = choose_device_extensions(gpuInfo);
-  device = gpuInfo.device.createDevice(
-              vk::DeviceCreateInfo()
-                .setEnabledExtensionCount(deviceExtensions.size())
-                .setPpEnabledExtensionNames(deviceExtensions.data())
-                .setQueueCreateInfoCount(1)
-                .setPQueueCreateInfos(&queueCreateInfo)
-           );
+  auto deviceExtensions = choose_device_extensions(gpuInfo);
+  ycbcr.enabled = probe_ycbcr(gpuInfo, deviceExtensions, ycbcr.chroma_location, ycbcr.filter);
+  printf("Y'CbCr conversion sampling %s\n", ycbcr.enabled ? "enabled" : "disabled");
+  direct_upload.supported = probe_direct_upload(gpuInfo);
+  printf("Direct linear uploads %s\n", direct_upload.supported ? "supported" : "not supported");
+
+  timeline.enabled = probe_timeline(gpuInfo);
+  printf("Timeline semaphores %s\n", timeline.enabled ? "enabled" : "disabled");
+  dynamic_rendering.enabled = probe_dynamic_rendering(gpuInfo, deviceExtensions);
+  printf("Dynamic rendering %s\n", dynamic_rendering.enabled ? "enabled" : "disabled");
+  memory_budget.enabled = probe_memory_budget(deviceExtensions);
+  printf("Memory budget queries %s\n", memory_budget.enabled ? "enabled" : "disabled");
+  host_import.enabled = probe_host_import(gpuInfo, deviceExtensions);
+#ifdef VK_GOOGLE_display_timing
+  latency.display_timing = extension_enabled(VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME,
+                                             deviceExtensions);
+#endif
+
+  void* featuresChain = nullptr;
+#ifdef VK_KHR_sampler_ycbcr_conversion
+  auto ycbcrFeatures = vk::PhysicalDeviceSamplerYcbcrConversionFeaturesKHR()
+                                .setSamplerYcbcrConversion(VK_TRUE);
+  if (ycbcr.enabled)
+  {
+    ycbcrFeatures.setPNext(featuresChain);
+    featuresChain = &ycbcrFeatures;
+  }
+#endif
+#ifdef VK_VERSION_1_2
+  auto timelineFeatures = vk::PhysicalDeviceTimelineSemaphoreFeatures()
+                                .setTimelineSemaphore(VK_TRUE);
+  if (timeline.enabled)
+  {
+    timelineFeatures.setPNext(featuresChain);
+    featuresChain = &timelineFeatures;
+  }
+#endif
+#ifdef VK_KHR_dynamic_rendering
+  auto renderingFeatures = vk::PhysicalDeviceDynamicRenderingFeaturesKHR()
+                                .setDynamicRendering(VK_TRUE);
+  if (dynamic_rendering.enabled)
+  {
+    renderingFeatures.setPNext(featuresChain);
+    featuresChain = &renderingFeatures;
+  }
+#endif
+
+  device = gpuInfo.device.createDevice(
+              vk::DeviceCreateInfo()
+                .setPNext(featuresChain)
+                .setEnabledExtensionCount(deviceExtensions.size())
+                .setPpEnabledExtensionNames(deviceExtensions.data())
+                .setQueueCreateInfoCount(1)
+                .setPQueueCreateInfos(&queueCreateInfo)
+           );
+
+  graphics_queue = device.getQueue(gpuInfo.renderQueueFamilyIdx, 0);
+  if (dynamic_rendering.enabled)
+    load_dynamic_rendering();
+#ifdef VK_GOOGLE_display_timing
+  if (latency.display_timing)
+    latency.past_timing = (PFN_vkGetPastPresentationTimingGOOGLE)
+                            device.getProcAddr("vkGetPastPresentationTimingGOOGLE");
+  latency.display_timing = latency.past_timing != nullptr;
+#endif
+#ifdef VK_EXT_external_memory_host
+  if (host_import.enabled)
+    host_import.get_properties = (PFN_vkGetMemoryHostPointerPropertiesEXT)
+                                   device.getProcAddr("vkGetMemoryHostPointerPropertiesEXT");
+  host_import.enabled = host_import.get_properties != nullptr;
+#endif
+  if (host_import.enabled)
+  {
+    // pictures allocated from now on can be imported
+    hostmem::set_alignment(host_import.alignment);
+    hostmem::set_release_hook(release_host_import);
+    printf("Host memory import enabled, %llu byte alignment\n",
+           (unsigned long long)host_import.alignment);
+  }
+  else
+    printf("Host memory import disabled\n");
+  update_memory_budget();
+  print_memory_budget("available");
+}
+
+static void  prepare_ycbcr_sampler()
+{
+#ifdef VK_KHR_sampler_ycbcr_conversion
+  ycbcr.create = (PFN_vkCreateSamplerYcbcrConversionKHR)
+                    device.getProcAddr("vkCreateSamplerYcbcrConversionKHR");
+  ycbcr.destroy = (PFN_vkDestroySamplerYcbcrConversionKHR)
+                    device.getProcAddr("vkDestroySamplerYcbcrConversionKHR");
+  if (!ycbcr.create || !ycbcr.destroy)
+    throw vulkan_error("failed to load VK_KHR_sampler_ycbcr_conversion entry points");
+
+  // The sampler is immutable, so it only reconstructs chroma; the shaders
+  // convert to RGB with the matrix and range of the frame (identity model
+  // ignores the range).
+  auto const conversionInfo = vk::SamplerYcbcrConversionCreateInfoKHR()
+                                .setFormat(vk::Format::eG8B8R83Plane420UnormKHR)
+                                .setYcbcrModel(vk::SamplerYcbcrModelConversionKHR::eRgbIdentity)
+                                .setYcbcrRange(vk::SamplerYcbcrRangeKHR::eItuNarrow)
+                                .setXChromaOffset(ycbcr.chroma_location)
+                                .setYChromaOffset(ycbcr.chroma_location)
+                                .setChromaFilter(ycbcr.filter);
+
+  VkSamplerYcbcrConversionKHR conversion = VK_NULL_HANDLE;
+  vktools::checked_call(ycbcr.create, "failed to create ycbcr conversion",
+        (VkDevice)device,
+        reinterpret_cast<const VkSamplerYcbcrConversionCreateInfoKHR*>(&conversionInfo),
+        nullptr, &conversion);
+  ycbcr.conversion = vk::SamplerYcbcrConversionKHR(conversion);
+
+  auto const samplerConversion = vk::SamplerYcbcrConversionInfoKHR()
+                                  .setConversion(ycbcr.conversion);
+  ycbcr.sampler = device.createSampler(vk::SamplerCreateInfo()
+                            .setPNext(&samplerConversion)
+                            .setMagFilter(ycbcr.filter)
+                            .setMinFilter(ycbcr.filter)
+                            .setMipmapMode(vk::SamplerMipmapMode::eNearest)
+                            .setAddressModeU(vk::SamplerAddressMode::eClampToEdge)
+                            .setAddressModeV(vk::SamplerAddressMode::eClampToEdge)
+                            .setAddressModeW(vk::SamplerAddressMode::eClampToEdge)
+                            .setMaxLod(0.0f));
+#endif
+}
+
+static void  prepare_renderpass()
+{
+  const vk::AttachmentDescription attachments[] = {
+    vk::AttachmentDescription()
+               .setFormat(swapchain_format.format)
+               .setSamples(vk::SampleCountFlagBits::e1)
+               .setLoadOp(vk::AttachmentLoadOp::eClear)
+               .setStoreOp(vk::AttachmentStoreOp::eStore)
+               .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
+               .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare)
+               .setInitialLayout(vk::ImageLayout::eUndefined)
+               .setFinalLayout(vk::ImageLayout::ePresentSrcKHR)
+               ,
+    vk::AttachmentDescription()
+               .setFormat(vk::Format::eD16Unorm)
+               .setSamples(vk::SampleCountFlagBits::e1)
+               .setLoadOp(vk::AttachmentLoadOp::eClear)
+               .setStoreOp(vk::AttachmentStoreOp::eStore)
+               .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
+               .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare)
+               .setInitialLayout(vk::ImageLayout::eUndefined)
+               .setFinalLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal)
+    };
+
+  auto const colorRef = vk::AttachmentReference()
+                        .setAttachment(0)
+                        .setLayout(vk::ImageLayout::eColorAttachmentOptimal);
+
+  auto const depthRef = vk::AttachmentReference()
+                        .setAttachment(1)
+                        .setLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal);
+  auto const subpass = vk::SubpassDescription()
+                        .setPipelineBindPoint(vk::PipelineBindPoint::eGraphics)
+                        .setInputAttachmentCount(0)
+                        .setPInputAttachments(nullptr)
+                        .setColorAttachmentCount(1)
+                        .setPColorAttachments(&colorRef)
+                        .setPResolveAttachments(nullptr)
+                        .setPDepthStencilAttachment(&depthRef)
+                        .setPreserveAttachmentCount(0)
+                        .setPPreserveAttachments(nullptr);
+  auto const dependency = vk::SubpassDependency()
+                            .setSrcSubpass(VK_SUBPASS_EXTERNAL)
+                            .setDstSubpass(0)
+                            .setSrcStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
+                            .setDstStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
+                            .setDstAccessMask(vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite);
+ 
+  render_pass = device.createRenderPass(vk::RenderPassCreateInfo()
+                                          .setAttachmentCount(2)
+                                          .setPAttachments(attachments)
+                                          .setSubpassCount(1)
+                                          .setPSubpasses(&subpass)
+                                          .setDependencyCount(1)
+                                          .setPDependencies(&dependency));
+}
+
+static void  prepare_intermediate_renderpass()
+{
+  auto const attachment = vk::AttachmentDescription()
+               .setFormat(intermediate_format)
+               .setSamples(vk::SampleCountFlagBits::e1)
+               .setLoadOp(vk::AttachmentLoadOp::eDontCare)
+               .setStoreOp(vk::AttachmentStoreOp::eStore)
+               .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
+               .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare)
+               .setInitialLayout(vk::ImageLayout::eUndefined)
+               .setFinalLayout(vk::ImageLayout::eShaderReadOnlyOptimal);
+
+  auto const colorRef = vk::AttachmentReference()
+                        .setAttachment(0)
+                        .setLayout(vk::ImageLayout::eColorAttachmentOptimal);
+
+  auto const subpass = vk::SubpassDescription()
+                        .setPipelineBindPoint(vk::PipelineBindPoint::eGraphics)
+                        .setColorAttachmentCount(1)
+                        .setPColorAttachments(&colorRef);
+
+  // previous frame's vertical pass reads the image we are about to overwrite,
+  // and the vertical pass of this frame reads what we write
+  vk::SubpassDependency const dependencies[2] = {
+    vk::SubpassDependency()
+        .setSrcSubpass(VK_SUBPASS_EXTERNAL)
+        .setDstSubpass(0)
+        .setSrcStageMask(vk::PipelineStageFlagBits::eFragmentShader)
+        .setDstStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
+        .setDstAccessMask(vk::AccessFlagBits::eColorAttachmentWrite),
+    vk::SubpassDependency()
+        .setSrcSubpass(0)
+        .setDstSubpass(VK_SUBPASS_EXTERNAL)
+        .setSrcStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
+        .setDstStageMask(vk::PipelineStageFlagBits::eFragmentShader)
+        .setSrcAccessMask(vk::AccessFlagBits::eColorAttachmentWrite)
+        .setDstAccessMask(vk::AccessFlagBits::eShaderRead)
+    };
+
+  intermediate_pass = device.createRenderPass(vk::RenderPassCreateInfo()
+                                          .setAttachmentCount(1)
+                                          .setPAttachments(&attachment)
+                                          .setSubpassCount(1)
+                                          .setPSubpasses(&subpass)
+                                          .setDependencyCount(2)
+                                          .setPDependencies(dependencies));
+}
+
+// A multi-planar descriptor may take up to one descriptor per plane;
+// every frame has a planes set of its own for direct uploads, and sets
+// replaced by a resize wait in the pool until their frames complete.
+static vk::DescriptorPool  create_descriptor_pool()
+{
+  const uint32_t setsNum = 2 * (2 + frames_in_flight);
+  auto const poolSize = vk::DescriptorPoolSize()
+                          .setType(vk::DescriptorType::eCombinedImageSampler)
+                          .setDescriptorCount(3 * setsNum);
+  return device.createDescriptorPool(vk::DescriptorPoolCreateInfo()
+                                       .setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet)
+                                       .setMaxSets(setsNum)
+                                       .setPoolSizeCount(1)
+                                       .setPPoolSizes(&poolSize));
+}
+
+static void  prepare_descriptor_layout()
+{
+  linear_sampler = device.createSampler(vk::SamplerCreateInfo()
+                            .setMagFilter(vk::Filter::eLinear)
+                            .setMinFilter(vk::Filter::eLinear)
+                            .setMipmapMode(vk::SamplerMipmapMode::eNearest)
+                            .setAddressModeU(vk::SamplerAddressMode::eClampToEdge)
+                            .setAddressModeV(vk::SamplerAddressMode::eClampToEdge)
+                            .setAddressModeW(vk::SamplerAddressMode::eClampToEdge)
+                            .setMaxLod(0.0f));
+
+  vk::DescriptorSetLayoutBinding planeBindings[3];
+  for (uint32_t i = 0; i < 3; ++i)
+    planeBindings[i] = vk::DescriptorSetLayoutBinding()
+                          .setBinding(i)
+                          .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+                          .setDescriptorCount(1)
+                          .setStageFlags(vk::ShaderStageFlagBits::eFragment);
+
+  uint32_t planeBindingsNum = 3;
+  if (ycbcr.enabled)
+  {
+#ifdef VK_KHR_sampler_ycbcr_conversion
+    // a conversion sampler can only be used as an immutable sampler
+    prepare_ycbcr_sampler();
+    planeBindings[0].setPImmutableSamplers(&ycbcr.sampler);
+    planeBindingsNum = 1;
+#endif
+  }
+
+  planes_set_layout = device.createDescriptorSetLayout(
+                        vk::DescriptorSetLayoutCreateInfo()
+                          .setBindingCount(planeBindingsNum)
+                          .setPBindings(planeBindings));
+  planeBindings[0].setPImmutableSamplers(nullptr);
+  intermediate_set_layout = device.createDescriptorSetLayout(
+                        vk::DescriptorSetLayoutCreateInfo()
+                          .setBindingCount(1)
+                          .setPBindings(planeBindings));
+
+  descriptor_pool = create_descriptor_pool();
+
+  vk::DescriptorSetLayout const setLayouts[2] = {planes_set_layout,
+                                                 intermediate_set_layout};
+  auto sets = device.allocateDescriptorSets(vk::DescriptorSetAllocateInfo()
+                                              .setDescriptorPool(descriptor_pool)
+                                              .setDescriptorSetCount(2)
+                                              .setPSetLayouts(setLayouts));
+  planes_set = sets[0];
+  intermediate_set = sets[1];
+
+  std::vector<vk::DescriptorSetLayout> frameLayouts(frames_in_flight, planes_set_layout);
+  auto frameSets = device.allocateDescriptorSets(vk::DescriptorSetAllocateInfo()
+                                              .setDescriptorPool(descriptor_pool)
+                                              .setDescriptorSetCount(frames_in_flight)
+                                              .setPSetLayouts(frameLayouts.data()));
+  for (uint32_t i = 0; i < frames_in_flight; ++i)
+    frames[i].planes_set = frameSets[i];
+
+  auto const pushRange = vk::PushConstantRange()
+                          .setStageFlags(vk::ShaderStageFlagBits::eFragment)
+                          .setOffset(0)
+                          .setSize(sizeof(ScalerParams));
+
+  pipeline_layout = device.createPipelineLayout(
+                      vk::PipelineLayoutCreateInfo()
+                        .setSetLayoutCount(2)
+                        .setPSetLayouts(setLayouts)
+                        .setPushConstantRangeCount(1)
+                        .setPPushConstantRanges(&pushRange)
+                    );
+}
+
+// linear images start preinitialized, so host writes made before the first
+// transition are kept
+static vk::ImageCreateInfo  texture_info(vk::Format format, vk::Extent2D extent,
+                                         vk::ImageUsageFlags usage, vk::ImageTiling tiling)
+{
+  return vk::ImageCreateInfo()
+          .setImageType(vk::ImageType::e2D)
+          .setFormat(format)
+          .setExtent(vk::Extent3D(extent.width, extent.height, 1))
+          .setMipLevels(1)
+          .setArrayLayers(1)
+          .setSamples(vk::SampleCountFlagBits::e1)
+          .setTiling(tiling)
+          .setUsage(usage)
+          .setSharingMode(vk::SharingMode::eExclusive)
+          .setInitialLayout(tiling == vk::ImageTiling::eLinear ? vk::ImageLayout::ePreinitialized
+                                                               : vk::ImageLayout::eUndefined);
+}
+
+static Texture  create_texture(vk::Format format, vk::Extent2D extent,
+                               vk::ImageUsageFlags usage,
+                               const void* view_next = nullptr,
+                               vk::ImageTiling tiling = vk::ImageTiling::eOptimal,
+                               vk::MemoryPropertyFlags memory = vk::MemoryPropertyFlagBits::eDeviceLocal)
+{
+  Texture texture;
+  texture.image = device.createImage(texture_info(format, extent, usage, tiling));
+
+  vk::MemoryRequirements memReqs = device.getImageMemoryRequirements(texture.image);
+  try {
+    texture.memory = allocate_memory(memReqs, memory);
+  }
+  catch (...)
+  {
+    vktools::destroy_handle(texture.image, device);
+    throw;
+  }
+  device.bindImageMemory(texture.image, texture.memory, 0);
+
+  texture.view = device.createImageView(
+           vk::ImageViewCreateInfo()
+            .setPNext(view_next)
+            .setImage(texture.image)
+            .setViewType(vk::ImageViewType::e2D)
+            .setFormat(format)
+            .setSubresourceRange(vk::ImageSubresourceRange()
+                                    .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                                    .setBaseMipLevel(0)
+                                    .setLevelCount(1)
+                                    .setBaseArrayLayer(0)
+                                    .setLayerCount(1)
+                          )
+        );
+  return texture;
+}
+
+// false when the pool is out of sets or too fragmented for this one
+static bool  allocate_set(vk::DescriptorPool pool, vk::DescriptorSetLayout layout,
+                          vk::DescriptorSet& set)
+{
+  try {
+    set = device.allocateDescriptorSets(vk::DescriptorSetAllocateInfo()
+                                          .setDescriptorPool(pool)
+                                          .setDescriptorSetCount(1)
+                                          .setPSetLayouts(&layout))[0];
+    return true;
+  }
+  catch (vk::OutOfPoolMemoryError const&)
+  {
+    return false;
+  }
+  catch (vk::FragmentedPoolError const&)
+  {
+    return false;
+  }
+}
+
+// Frames in flight may still read the set, so it is retired and a new one
+// allocated. A pool full of retired sets waits for their frames; when it
+// still has no room, the set comes from an extra pool.
+static void  replace_set(vk::DescriptorSet& set, vk::DescriptorSetLayout layout)
+{
+  retire_set(set);
+  if (allocate_set(descriptor_pool, layout, set))
+    return;
+
+  wait_gpu(stage::present, timeline.submitted);
+  destroy_retired(timeline.submitted);
+  if (allocate_set(descriptor_pool, layout, set))
+    return;
+
+  for (vk::DescriptorPool pool: extra_pools)
+    if (allocate_set(pool, layout, set))
+    {
+      extra_pool_sets[static_cast<VkDescriptorSet>(set)] = pool;
+      return;
+    }
+  printf("[V3D] descriptor pool exhausted, adding one\n");
+  extra_pools.push_back(create_descriptor_pool());
+  if (!allocate_set(extra_pools.back(), layout, set))
+    throw vulkan_error("failed to allocate a descriptor set");
+  extra_pool_sets[static_cast<VkDescriptorSet>(set)] = extra_pools.back();
+}
+
+// 4:2:0 multi-planar images need even extents. An odd sized source is
+// padded by repeating its last column and row, and cropped when drawn.
+static vk::Extent2D  image_extent()
+{
+  if (ycbcr.enabled)
+    return vk::Extent2D((source.width + 1) & ~1u, (source.height + 1) & ~1u);
+  return vk::Extent2D(source.width, source.height);
+}
+
+static vk::Extent2D  plane_extent(uint32_t plane)
+{
+  const vk::Extent2D extent = image_extent();
+  if (plane == 0)
+    return extent;
+  return vk::Extent2D((extent.width + 1) / 2, (extent.height + 1) / 2);
+}
+
+static vk::Format  source_format()
+{
+#ifdef VK_KHR_sampler_ycbcr_conversion
+  if (ycbcr.enabled)
+    return vk::Format::eG8B8R83Plane420UnormKHR;
+#endif
+  return vk::Format::eR8Unorm;
+}
+
+// with Y'CbCr conversion the planes are aspects of a single image
+static vk::ImageAspectFlags  plane_aspect(uint32_t plane)
+{
+#ifdef VK_KHR_sampler_ycbcr_conversion
+  const vk::ImageAspectFlagBits planeAspects[3] = {vk::ImageAspectFlagBits::ePlane0KHR,
+                                                   vk::ImageAspectFlagBits::ePlane1KHR,
+                                                   vk::ImageAspectFlagBits::ePlane2KHR};
+  if (ycbcr.enabled)
+    return planeAspects[plane];
+#endif
+  return vk::ImageAspectFlagBits::eColor;
+}
+
+// Direct when the device supports it and a linear image of this size can
+// be bound to device-local, host-visible memory
+static upload_path  choose_upload_path(vk::Extent2D extent)
+{
+  if (!direct_upload.supported)
+    return upload_path::staging;
+
+  vk::ImageFormatProperties props;
+  try {
+    props = get_gpu().device.getImageFormatProperties(source_format(), vk::ImageType::e2D,
+                                                      vk::ImageTiling::eLinear,
+                                                      vk::ImageUsageFlagBits::eSampled,
+                                                      vk::ImageCreateFlags());
+  }
+  catch (vk::FormatNotSupportedError const&)
+  {
+    return upload_path::staging;
+  }
+  if (props.maxExtent.width < extent.width || props.maxExtent.height < extent.height)
+    return upload_path::staging;
+
+  vk::Image image = device.createImage(texture_info(source_format(), extent,
+                                                    vk::ImageUsageFlagBits::eSampled,
+                                                    vk::ImageTiling::eLinear));
+  const uint32_t typeBits = device.getImageMemoryRequirements(image).memoryTypeBits;
+  device.destroyImage(image);
+  return (typeBits & direct_upload.memory_type_bits) ? upload_path::direct
+                                                     : upload_path::staging;
+}
+
+// Creates the source plane images and points the descriptor set at them.
+// Optimal planes are written by transfers, linear ones by the host and
+// stay in the general layout.
+static void  create_planes(Texture (&planes)[3], vk::DescriptorSet set,
+                           vk::ImageTiling tiling, vk::MemoryPropertyFlags memory)
+{
+  const bool linear = tiling == vk::ImageTiling::eLinear;
+  const vk::ImageUsageFlags usage = linear ? vk::ImageUsageFlagBits::eSampled
+                                           : vk::ImageUsageFlagBits::eTransferDst |
+                                             vk::ImageUsageFlagBits::eSampled;
+  const vk::ImageLayout layout = linear ? vk::ImageLayout::eGeneral
+                                        : vk::ImageLayout::eShaderReadOnlyOptimal;
+  vk::DescriptorImageInfo imageInfos[3];
+  uint32_t descriptorsNum = 3;
+  if (ycbcr.enabled)
+  {
+#ifdef VK_KHR_sampler_ycbcr_conversion
+    auto const viewConversion = vk::SamplerYcbcrConversionInfoKHR()
+                                  .setConversion(ycbcr.conversion);
+    planes[0] = create_texture(source_format(), plane_extent(0), usage, &viewConversion,
+                               tiling, memory);
+    imageInfos[0] = vk::DescriptorImageInfo()
+                      .setSampler(ycbcr.sampler)
+                      .setImageView(planes[0].view)
+                      .setImageLayout(layout);
+    descriptorsNum = 1;
+#endif
+  }
+  else
+  {
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+      planes[i] = create_texture(vk::Format::eR8Unorm, plane_extent(i), usage, nullptr,
+                                 tiling, memory);
+      imageInfos[i] = vk::DescriptorImageInfo()
+                        .setSampler(linear_sampler)
+                        .setImageView(planes[i].view)
+                        .setImageLayout(layout);
+    }
+  }
+
+  device.updateDescriptorSets(vk::WriteDescriptorSet()
+                                .setDstSet(set)
+                                .setDstBinding(0)
+                                .setDescriptorCount(descriptorsNum)
+                                .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+                                .setPImageInfo(imageInfos), nullptr);
+}
+
+static void  create_source(uint32_t width, uint32_t height)
+{
+  free_source();
+
+  vk::DeviceSize offset = 0;
+  source.width = width;
+  source.height = height;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    vk::Extent2D extent = plane_extent(i);
+    source.offsets[i] = offset;
+    offset += ((vk::DeviceSize)extent.width * extent.height + 15) & ~15;
+  }
+  source.size = offset;
+
+  // direct uploads sample the planes of the frame that was uploaded last
+  source.upload = choose_upload_path(plane_extent(0));
+  if (source.upload == upload_path::staging)
+  {
+    replace_set(planes_set, planes_set_layout);
+    create_planes(source.planes, planes_set, vk::ImageTiling::eOptimal,
+                  vk::MemoryPropertyFlagBits::eDeviceLocal);
+    source.set = planes_set;
+  }
+
+  printf("[V3D] video source %ux%u%s, %s upload\n", width, height,
+         ycbcr.enabled ? ", multi-planar" : "",
+         source.upload == upload_path::direct ? "direct linear" : "staging");
+}
+
+static void  create_staging(FrameResources& frame)
+{
+  frame.staging = device.createBuffer(vk::BufferCreateInfo()
+                                        .setSize(source.size)
+                                        .setUsage(vk::BufferUsageFlagBits::eTransferSrc)
+                                        .setSharingMode(vk::SharingMode::eExclusive));
+
+  vk::MemoryRequirements memReqs = device.getBufferMemoryRequirements(frame.staging);
+  frame.staging_memory = allocate_memory(memReqs, vk::MemoryPropertyFlagBits::eHostVisible |
+                                                  vk::MemoryPropertyFlagBits::eHostCoherent);
+  device.bindBufferMemory(frame.staging, frame.staging_memory, 0);
+  frame.staging_data = (uint8_t*)device.mapMemory(frame.staging_memory, 0, source.size);
+}
+
+static void  create_linear_planes(FrameResources& frame)
+{
+  replace_set(frame.planes_set, planes_set_layout);
+  create_planes(frame.linear_planes, frame.planes_set, vk::ImageTiling::eLinear,
+                direct_memory_flags);
+
+  uint8_t* mapped = nullptr;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    Texture const& texture = frame.linear_planes[ycbcr.enabled ? 0 : i];
+    if (i == 0 || !ycbcr.enabled)
+      mapped = (uint8_t*)device.mapMemory(texture.memory, 0, VK_WHOLE_SIZE);
+    vk::SubresourceLayout layout = device.getImageSubresourceLayout(texture.image,
+                                      vk::ImageSubresource().setAspectMask(plane_aspect(i)));
+    frame.plane_data[i] = mapped + layout.offset;
+    frame.row_pitch[i] = layout.rowPitch;
+  }
+  frame.linear_ready = false;
+}
+
+// Upload targets are created by the first upload into the frame, so the
+// frames a shrunk pool doesn't rotate through never get one.
+static void  create_upload_target(FrameResources& frame)
+{
+  try {
+    if (source.upload == upload_path::direct)
+      create_linear_planes(frame);
+    else
+      create_staging(frame);
+  }
+  catch (...)
+  {
+    free_upload_target(frame);
+    throw;
+  }
+}
+
+static bool  has_upload_target(FrameResources const& frame)
+{
+  return frame.staging || frame.linear_planes[0].image;
+}
+
+static void  create_intermediate(vk::Extent2D extent)
+{
+  free_intermediate();
+  replace_set(intermediate_set, intermediate_set_layout);
+
+  intermediate.texture = create_texture(intermediate_format, extent,
+                                        vk::ImageUsageFlagBits::eColorAttachment |
+                                        vk::ImageUsageFlagBits::eSampled);
+  intermediate.extent = extent;
+  if (!dynamic_rendering.enabled)
+    intermediate.framebuffer = device.createFramebuffer(vk::FramebufferCreateInfo()
+                                  .setRenderPass(intermediate_pass)
+                                  .setAttachmentCount(1)
+                                  .setPAttachments(&intermediate.texture.view)
+                                  .setWidth(extent.width)
+                                  .setHeight(extent.height)
+                                  .setLayers(1));
+
+  auto const imageInfo = vk::DescriptorImageInfo()
+                           .setSampler(linear_sampler)
+                           .setImageView(intermediate.texture.view)
+                           .setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal);
+  device.updateDescriptorSets(vk::WriteDescriptorSet()
+                                .setDstSet(intermediate_set)
+                                .setDstBinding(0)
+                                .setDescriptorCount(1)
+                                .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+                                .setPImageInfo(&imageInfo), nullptr);
+}
+
+// headroom thresholds as fractions of the budget, apart so the pools don't
+// flap between the two sizes
+static const double  pressure_enter = 0.10;
+static const double  pressure_leave = 0.25;
+
+static void  swap_upload_targets(FrameResources& a, FrameResources& b)
+{
+  std::swap(a.staging, b.staging);
+  std::swap(a.staging_memory, b.staging_memory);
+  std::swap(a.staging_data, b.staging_data);
+  std::swap(a.linear_planes, b.linear_planes);
+  std::swap(a.plane_data, b.plane_data);
+  std::swap(a.row_pitch, b.row_pitch);
+  std::swap(a.planes_set, b.planes_set);
+  std::swap(a.linear_ready, b.linear_ready);
+  std::swap(a.sampled_serial, b.sampled_serial);
+  std::swap(a.upload_pending, b.upload_pending);
+  std::swap(a.upload_buffer, b.upload_buffer);
+  std::swap(a.upload_offsets, b.upload_offsets);
+  std::swap(a.upload_row_length, b.upload_row_length);
+  std::swap(a.arrival, b.arrival);
+  std::swap(a.color, b.color);
+}
+
+// Keeps one frame in flight and drops the intermediate image. The upload
+// target that stays is the one with a frame not rendered yet, or with
+// direct uploads the one the source is sampled from.
+static void  shrink_pools(const char* reason)
+{
+  device.waitIdle();
+  memory_budget.pressure = true;
+  memory_budget.exhausted = false;
+
+  {
+    std::lock_guard<std::mutex> guard(host_import.lock);
+    uint32_t keep = 0;
+    if (frames[frame_index].upload_pending || !has_upload_target(frames[0]))
+      keep = frame_index;
+    else if (source.upload == upload_path::direct)
+    {
+      for (uint32_t i = 0; i < frames_in_flight; ++i)
+        if (source.set && frames[i].planes_set == source.set)
+          keep = i;
+    }
+    if (keep != 0)
+      swap_upload_targets(frames[0], frames[keep]);
+  }
+  for (uint32_t i = 1; i < frames_in_flight; ++i)
+    free_upload_target(frames[i]);
+  free_intermediate();
+  // the memory is needed now, and the device is idle anyway
+  destroy_retired(UINT64_MAX);
+  frame_index = 0;
+  frames_active = 1;
+  damage.bits |= damage_layout;
+
+  update_memory_budget();
+  print_memory_budget(reason);
+}
+
+static void  grow_pools()
+{
+  memory_budget.pressure = false;
+  frames_active = frames_in_flight;
+  damage.bits |= damage_layout;
+  print_memory_budget("recovered");
+}
+
+// what growing back would allocate: a staging buffer and an intermediate
+// image at most as wide as the window
+static vk::DeviceSize  regrow_size()
+{
+  return source.size + (vk::DeviceSize)swapchain_extent.width * source.height * 8;
+}
+
+// Called between frames, resizes the pools at most once a second
+static void  check_memory_budget()
+{
+  const auto now = std::chrono::steady_clock::now();
+  if (now < memory_budget.next_check && !memory_budget.exhausted)
+    return;
+  memory_budget.next_check = now + std::chrono::seconds(1);
+
+  update_memory_budget();
+  if (memory_budget.budget == 0)
+    return;
+  const double budget = (double)memory_budget.budget;
+  const double headroom = (budget - (double)memory_budget.usage) / budget;
+  if (memory_budget.exhausted)
+    shrink_pools("exhausted");
+  else if (!memory_budget.pressure && headroom < pressure_enter)
+    shrink_pools("low");
+  else if (memory_budget.pressure && headroom - regrow_size() / budget > pressure_leave)
+    grow_pools();
+}
+
+static void  prepare_command_pool()
+{
+  for (FrameResources& frame: frames)
+  {
+    frame.command_pool = device.createCommandPool(vk::CommandPoolCreateInfo()
+                                .setFlags(vk::CommandPoolCreateFlagBits::eTransient)
+                                .setQueueFamilyIndex(get_gpu().renderQueueFamilyIdx));
+
+    auto cmds = device.allocateCommandBuffers(vk::CommandBufferAllocateInfo()
+                                .setCommandPool(frame.command_pool)
+                                .setLevel(vk::CommandBufferLevel::ePrimary)
+                                .setCommandBufferCount(3));
+    frame.upload_cmd = cmds[0];
+    frame.convert_cmd = cmds[1];
+    frame.cmd = cmds[2];
+
+    frame.fence = device.createFence(vk::FenceCreateInfo()
+                                .setFlags(vk::FenceCreateFlagBits::eSignaled));
+
+    frame.recorders.resize(tasks::workers_count() + 1);
+    for (RecordContext& ctx: frame.recorders)
+      ctx.command_pool = device.createCommandPool(vk::CommandPoolCreateInfo()
+                                .setFlags(vk::CommandPoolCreateFlagBits::eTransient)
+                                .setQueueFamilyIndex(get_gpu().renderQueueFamilyIdx));
+  }
+}
+
+static void   reset_frame_pools(FrameResources& frame)
+{
+  device.resetCommandPool(frame.command_pool, vk::CommandPoolResetFlags());
+  for (RecordContext& ctx: frame.recorders)
+  {
+    if (ctx.used == 0)
+      continue;
+    device.resetCommandPool(ctx.command_pool, vk::CommandPoolResetFlags());
+    ctx.used = 0;
+  }
+}
 
-  graphics_queue = device.getQueue(gpuInfo.renderQueueFamilyIdx, 0);
+static vk::CommandBuffer  acquire_secondary(RecordContext& ctx)
+{
+  if (ctx.used == ctx.buffers.size())
+    ctx.buffers.push_back(device.allocateCommandBuffers(vk::CommandBufferAllocateInfo()
+                                .setCommandPool(ctx.command_pool)
+                                .setLevel(vk::CommandBufferLevel::eSecondary)
+                                .setCommandBufferCount(1)).front());
+  return ctx.buffers[ctx.used++];
 }
 
-static void  prepare_renderpass()
+static vk::Rect2D  tile_rect(uint32_t tile)
 {
-  const vk::AttachmentDescription attachments[] = {
-    vk::AttachmentDescription()
-               .setFormat(swapchain_format.format)
-               .setSamples(vk::SampleCountFlagBits::e1)
-               .setLoadOp(vk::AttachmentLoadOp::eClear)
-               .setStoreOp(vk::AttachmentStoreOp::eStore)
-               .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
-               .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare)
-               .setInitialLayout(vk::ImageLayout::eUndefined)
-               .setFinalLayout(vk::ImageLayout::ePresentSrcKHR)
-               ,
-    vk::AttachmentDescription()
-               .setFormat(vk::Format::eD16Unorm)
-               .setSamples(vk::SampleCountFlagBits::e1)
-               .setLoadOp(vk::AttachmentLoadOp::eClear)
-               .setStoreOp(vk::AttachmentStoreOp::eStore)
-               .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
-               .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare)
-               .setInitialLayout(vk::ImageLayout::eUndefined)
-               .setFinalLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal)
-    };
+  uint32_t col = tile % tile_columns;
+  uint32_t row = tile / tile_columns;
+  uint32_t x0 = swapchain_extent.width * col / tile_columns;
+  uint32_t x1 = swapchain_extent.width * (col + 1) / tile_columns;
+  uint32_t y0 = swapchain_extent.height * row / tile_rows;
+  uint32_t y1 = swapchain_extent.height * (row + 1) / tile_rows;
+  return vk::Rect2D(vk::Offset2D(x0, y0), vk::Extent2D(x1 - x0, y1 - y0));
+}
 
-  auto const colorRef = vk::AttachmentReference()
-                        .setAttachment(0)
-                        .setLayout(vk::ImageLayout::eColorAttachmentOptimal);
+// letterbox or pillarbox a width x height picture into the area
+static vk::Rect2D  fit_rect(vk::Rect2D const& area, uint32_t width, uint32_t height)
+{
+  uint64_t w = area.extent.width;
+  uint64_t h = area.extent.height;
+  if (w * height > h * width)
+    w = std::max<uint64_t>(1, h * width / height);
+  else
+    h = std::max<uint64_t>(1, w * height / width);
 
-  auto const depthRef = vk::AttachmentReference()
-                        .setAttachment(1)
-                        .setLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal);
-  auto const subpass = vk::SubpassDescription()
-                        .setPipelineBindPoint(vk::PipelineBindPoint::eGraphics)
-                        .setInputAttachmentCount(0)
-                        .setPInputAttachments(nullptr)
-                        .setColorAttachmentCount(1)
-                        .setPColorAttachments(&colorRef)
-                        .setPResolveAttachments(nullptr)
-                        .setPDepthStencilAttachment(&depthRef)
-                        .setPreserveAttachmentCount(0)
-                        .setPPreserveAttachments(nullptr);
-  auto const dependency = vk::SubpassDependency()
-                            .setSrcSubpass(VK_SUBPASS_EXTERNAL)
-                            .setDstSubpass(0)
-                            .setSrcStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
-                            .setDstStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput)
-                            .setDstAccessMask(vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite);
- 
-  render_pass = device.createRenderPass(vk::RenderPassCreateInfo()
-                                          .setAttachmentCount(2)
-                                          .setPAttachments(attachments)
-                                          .setSubpassCount(1)
-                                          .setPSubpasses(&subpass)
-                                          .setDependencyCount(1)
-                                          .setPDependencies(&dependency));
+  return vk::Rect2D(vk::Offset2D(area.offset.x + (area.extent.width - w) / 2,
+                                 area.offset.y + (area.extent.height - h) / 2),
+                    vk::Extent2D(w, h));
 }
 
-static void  prepare_descriptor_layout()
+static scaler  choose_scaler(float scale)
 {
-  pipeline_layout = device.createPipelineLayout(
-                      vk::PipelineLayoutCreateInfo()
-                    );
+  if (active_scaler != scaler::automatic)
+    return active_scaler;
+  if (scale < 1.0f)
+    return scaler::lanczos;
+  if (scale > 1.0f)
+    return scaler::bicubic;
+  return scaler::bilinear;
 }
 
-static void  prepare_command_pool()
+static ScalerParams  scaler_params(scaler filter, float scale)
 {
-  command_pool = device.createCommandPool(vk::CommandPoolCreateInfo()
-                              .setQueueFamilyIndex(get_gpu().renderQueueFamilyIdx));
+  const float support = filter == scaler::lanczos ? 3.0f : 2.0f;
+  // the kernel is widened by the downscale factor; past max_filter_radius
+  // taps it is clamped so the per-pixel cost stays bounded
+  int32_t radius = std::min(max_filter_radius,
+                            (int32_t)std::ceil(support * std::max(1.0f, 1.0f / scale)));
 
-  auto const cmdInfo = vk::CommandBufferAllocateInfo()
-                        .setCommandPool(command_pool)
-                        .setLevel(vk::CommandBufferLevel::ePrimary)
-                        .setCommandBufferCount(1);
+  ScalerParams params;
+  params.src_width = (float)image_extent().width;
+  params.src_height = (float)image_extent().height;
+  params.scale = std::max(scale, support / radius);
+  params.radius = radius;
+  return params;
+}
 
-  for (SwapchainBuffer& buffer: swapchain_buffers)
-    buffer.cmd = device.allocateCommandBuffers(cmdInfo).front();
+// Picks the filter for this frame and makes sure the intermediate image
+// matches the destination. All tiles are treated as the size of the first.
+static void  prepare_scaler()
+{
+  if (!source.ready)
+    return;
+
+  vk::Rect2D content = fit_rect(tile_rect(0), source.width, source.height);
+  float scaleX = content.extent.width / (float)source.width;
+  float scaleY = content.extent.height / (float)source.height;
+
+  scale_plan.filter = choose_scaler(std::min(scaleX, scaleY));
+  // the two-pass filters need the intermediate image
+  if (memory_budget.pressure || scale_plan.filter == scaler::bilinear)
+  {
+    scale_plan.filter = scaler::bilinear;
+    return;
+  }
+
+  scale_plan.horizontal = scaler_params(scale_plan.filter, scaleX);
+  scale_plan.vertical = scaler_params(scale_plan.filter, scaleY);
+
+  vk::Extent2D extent(content.extent.width, image_extent().height);
+  if (extent == intermediate.extent)
+    return;
+  try {
+    create_intermediate(extent);
+  }
+  catch (vk::OutOfDeviceMemoryError const&)
+  {
+    // the frame is already being recorded, the pools shrink before the next
+    memory_budget.exhausted = true;
+    scale_plan.filter = scaler::bilinear;
+  }
 }
 
-static void   write_command_buffers()
+// Host writes to the linear planes are visible to the submission, only the
+// first use has to take them out of the preinitialized layout.
+static void   write_linear_upload(vk::CommandBuffer cmd, FrameResources& frame)
 {
-  vk::ClearValue const clearValues[2] = {
-      vk::ClearColorValue(std::array<float, 4>({{0.5f, 0.2f, 0.2f, 0.2f}})),
-      vk::ClearDepthStencilValue(1.0f, 0u)};
+  frame.upload_pending = false;
+  if (frame.linear_ready)
+    return;
+
+  const uint32_t imagesNum = ycbcr.enabled ? 1 : 3;
+  vk::ImageMemoryBarrier barriers[3];
+  for (uint32_t i = 0; i < imagesNum; ++i)
+    barriers[i] = vk::ImageMemoryBarrier()
+                    .setSrcAccessMask(vk::AccessFlagBits::eHostWrite)
+                    .setDstAccessMask(vk::AccessFlagBits::eShaderRead)
+                    .setOldLayout(vk::ImageLayout::ePreinitialized)
+                    .setNewLayout(vk::ImageLayout::eGeneral)
+                    .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setImage(frame.linear_planes[i].image)
+                    .setSubresourceRange(vk::ImageSubresourceRange()
+                                          .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                                          .setLevelCount(1)
+                                          .setLayerCount(1));
+  cmd.pipelineBarrier(vk::PipelineStageFlagBits::eHost,
+                      vk::PipelineStageFlagBits::eFragmentShader,
+                      vk::DependencyFlags(), 0, nullptr, 0, nullptr, imagesNum, barriers);
+  frame.linear_ready = true;
+}
+
+static void   write_upload(vk::CommandBuffer cmd, FrameResources& frame)
+{
+  auto const range = vk::ImageSubresourceRange()
+                        .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                        .setBaseMipLevel(0)
+                        .setLevelCount(1)
+                        .setBaseArrayLayer(0)
+                        .setLayerCount(1);
+
+  // with Y'CbCr conversion the planes are aspects of a single image
+  const uint32_t imagesNum = ycbcr.enabled ? 1 : 3;
+
+  // planes are overwritten completely, previous contents can be discarded
+  vk::ImageMemoryBarrier barriers[3];
+  for (uint32_t i = 0; i < imagesNum; ++i)
+    barriers[i] = vk::ImageMemoryBarrier()
+                    .setDstAccessMask(vk::AccessFlagBits::eTransferWrite)
+                    .setOldLayout(vk::ImageLayout::eUndefined)
+                    .setNewLayout(vk::ImageLayout::eTransferDstOptimal)
+                    .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setImage(source.planes[i].image)
+                    .setSubresourceRange(range);
+  cmd.pipelineBarrier(vk::PipelineStageFlagBits::eFragmentShader,
+                      vk::PipelineStageFlagBits::eTransfer,
+                      vk::DependencyFlags(), 0, nullptr, 0, nullptr, imagesNum, barriers);
 
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    vk::Extent2D extent = plane_extent(i);
+    vk::Image image = source.planes[ycbcr.enabled ? 0 : i].image;
+    auto const region = vk::BufferImageCopy()
+                          .setBufferOffset(frame.upload_offsets[i])
+                          .setBufferRowLength(frame.upload_row_length[i])
+                          .setImageSubresource(vk::ImageSubresourceLayers()
+                                                .setAspectMask(plane_aspect(i))
+                                                .setLayerCount(1))
+                          .setImageExtent(vk::Extent3D(extent.width, extent.height, 1));
+    cmd.copyBufferToImage(frame.upload_buffer, image,
+                          vk::ImageLayout::eTransferDstOptimal, 1, &region);
+  }
+
+  for (vk::ImageMemoryBarrier& barrier: barriers)
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+           .setDstAccessMask(vk::AccessFlagBits::eShaderRead)
+           .setOldLayout(vk::ImageLayout::eTransferDstOptimal)
+           .setNewLayout(vk::ImageLayout::eShaderReadOnlyOptimal);
+  cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                      vk::PipelineStageFlagBits::eFragmentShader,
+                      vk::DependencyFlags(), 0, nullptr, 0, nullptr, imagesNum, barriers);
+
+  frame.upload_pending = false;
+}
+
+static void  image_barrier(vk::CommandBuffer cmd, vk::Image image,
+                           vk::ImageLayout old_layout, vk::ImageLayout new_layout,
+                           vk::PipelineStageFlags src_stage, vk::AccessFlags src_access,
+                           vk::PipelineStageFlags dst_stage, vk::AccessFlags dst_access)
+{
+  auto const barrier = vk::ImageMemoryBarrier()
+                        .setSrcAccessMask(src_access)
+                        .setDstAccessMask(dst_access)
+                        .setOldLayout(old_layout)
+                        .setNewLayout(new_layout)
+                        .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                        .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                        .setImage(image)
+                        .setSubresourceRange(vk::ImageSubresourceRange()
+                                                .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                                                .setLevelCount(1)
+                                                .setLayerCount(1));
+  cmd.pipelineBarrier(src_stage, dst_stage, vk::DependencyFlags(),
+                      0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+// Dynamic rendering counterpart of beginRenderPass for a single color
+// attachment in eColorAttachmentOptimal layout.
+static void  begin_rendering(vk::CommandBuffer cmd, vk::ImageView view, vk::Extent2D extent,
+                             vk::AttachmentLoadOp load_op, bool secondaries)
+{
+#ifdef VK_KHR_dynamic_rendering
+  auto const colorAttachment = vk::RenderingAttachmentInfoKHR()
+                                .setImageView(view)
+                                .setImageLayout(vk::ImageLayout::eColorAttachmentOptimal)
+                                .setLoadOp(load_op)
+                                .setStoreOp(vk::AttachmentStoreOp::eStore)
+                                .setClearValue(vk::ClearColorValue(
+                                    std::array<float, 4>({{0.0f, 0.0f, 0.0f, 1.0f}})));
+  auto const renderingInfo = vk::RenderingInfoKHR()
+                                .setFlags(secondaries ? vk::RenderingFlagBitsKHR::eContentsSecondaryCommandBuffers
+                                                      : vk::RenderingFlagsKHR())
+                                .setRenderArea(vk::Rect2D(vk::Offset2D(0, 0), extent))
+                                .setLayerCount(1)
+                                .setColorAttachmentCount(1)
+                                .setPColorAttachments(&colorAttachment);
+  dynamic_rendering.begin(static_cast<VkCommandBuffer>(cmd),
+                          reinterpret_cast<const VkRenderingInfoKHR*>(&renderingInfo));
+#endif
+}
+
+static void  end_rendering(vk::CommandBuffer cmd)
+{
+#ifdef VK_KHR_dynamic_rendering
+  dynamic_rendering.end(static_cast<VkCommandBuffer>(cmd));
+#endif
+}
+
+// bilinear scaling converts in the render pass, the others in a separate one
+static bool   convert_pass_needed()
+{
+  return source.ready && scale_plan.filter != scaler::bilinear;
+}
 
+static void   write_horizontal_pass(vk::CommandBuffer cmd)
+{
+  vk::Rect2D const area(vk::Offset2D(0, 0), intermediate.extent);
+  // the padding column of an odd sized source lands right of the area
   auto const viewport = vk::Viewport()
-                            .setWidth((float)swapchain_extent.width)
-                            .setHeight((float)swapchain_extent.height)
+                            .setWidth((float)intermediate.extent.width *
+                                      image_extent().width / source.width)
+                            .setHeight((float)intermediate.extent.height)
                             .setMinDepth((float)0.0f)
                             .setMaxDepth((float)1.0f);
 
-  vk::Rect2D const scissor(vk::Offset2D(0, 0),
-                           swapchain_extent);
-
-  for (SwapchainBuffer& buffer: swapchain_buffers)
+  if (dynamic_rendering.enabled)
   {
-    vk::CommandBuffer& cmd = buffer.cmd;
-    cmd.begin(vk::CommandBufferBeginInfo()
-                   .setFlags(vk::CommandBufferUsageFlagBits::eSimultaneousUse));
-
+    // the render pass dependencies of the intermediate pass, by hand
+    image_barrier(cmd, intermediate.texture.image,
+                  vk::ImageLayout::eUndefined, vk::ImageLayout::eColorAttachmentOptimal,
+                  vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlags(),
+                  vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                  vk::AccessFlagBits::eColorAttachmentWrite);
+    begin_rendering(cmd, intermediate.texture.view, intermediate.extent,
+                    vk::AttachmentLoadOp::eDontCare, false);
+  }
+  else
     cmd.beginRenderPass(vk::RenderPassBeginInfo()
-                              .setFramebuffer(buffer.framebuffer)
-                              .setRenderPass(render_pass)
-                              .setClearValueCount(2)
-                              .setPClearValues(clearValues)
-                              .setRenderArea(
-                                  vk::Rect2D(vk::Offset2D(0, 0),
-                                  swapchain_extent
-                                ))
+                              .setFramebuffer(intermediate.framebuffer)
+                              .setRenderPass(intermediate_pass)
+                              .setRenderArea(area)
                              ,vk::SubpassContents::eInline);
-    cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
+  cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, scale_plan.horizontal_pipeline);
+  cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline_layout,
+                         0, 1, &source.set, 0, nullptr);
+  cmd.pushConstants(pipeline_layout, vk::ShaderStageFlagBits::eFragment,
+                    0, sizeof(ScalerParams), &scale_plan.horizontal);
+  cmd.setViewport(0, 1, &viewport);
+  cmd.setScissor(0, 1, &area);
+  cmd.draw(3, 1, 0, 0);
+
+  if (dynamic_rendering.enabled)
+  {
+    end_rendering(cmd);
+    image_barrier(cmd, intermediate.texture.image,
+                  vk::ImageLayout::eColorAttachmentOptimal, vk::ImageLayout::eShaderReadOnlyOptimal,
+                  vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                  vk::AccessFlagBits::eColorAttachmentWrite,
+                  vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead);
+  }
+  else
+    cmd.endRenderPass();
+}
+
+static void   write_tiles(vk::CommandBuffer cmd, uint32_t first, uint32_t last)
+{
+  if (!source.ready)
+    return;
+
+  if (scale_plan.filter == scaler::bilinear)
+  {
+    cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, scale_plan.tile_pipeline);
+    cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline_layout,
+                           0, 1, &source.set, 0, nullptr);
+  }
+  else
+  {
+    cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, scale_plan.tile_pipeline);
+    cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline_layout,
+                           1, 1, &intermediate_set, 0, nullptr);
+    cmd.pushConstants(pipeline_layout, vk::ShaderStageFlagBits::eFragment,
+                      0, sizeof(ScalerParams), &scale_plan.vertical);
+  }
+
+  // the padding of an odd sized source lands outside the scissor, the
+  // intermediate image has no padding column
+  const vk::Extent2D image = image_extent();
+  const float cropX = scale_plan.filter == scaler::bilinear ? (float)image.width / source.width
+                                                            : 1.0f;
+  const float cropY = (float)image.height / source.height;
+  for (uint32_t tile = first; tile < last; ++tile)
+  {
+    vk::Rect2D const scissor = fit_rect(tile_rect(tile), source.width, source.height);
+    auto const viewport = vk::Viewport()
+                              .setX((float)scissor.offset.x)
+                              .setY((float)scissor.offset.y)
+                              .setWidth(scissor.extent.width * cropX)
+                              .setHeight(scissor.extent.height * cropY)
+                              .setMinDepth((float)0.0f)
+                              .setMaxDepth((float)1.0f);
+
     cmd.setViewport(0, 1, &viewport);
     cmd.setScissor(0, 1, &scissor);
     cmd.draw(3, 1, 0, 0);
+  }
+}
+
+// Splits the tiles between task workers, each recording a secondary
+// command buffer from its own pool. Returned buffers are in tile order.
+static std::vector<vk::CommandBuffer>  write_secondary_buffers(FrameResources& frame,
+                                                  SwapchainBuffer const& buffer)
+{
+  const uint32_t tilesNum = tile_columns * tile_rows;
+  const uint32_t chunksNum = std::min<uint32_t>(tilesNum, frame.recorders.size());
+  std::vector<vk::CommandBuffer> secondaries(chunksNum);
+
+  auto inheritance = vk::CommandBufferInheritanceInfo()
+                              .setRenderPass(render_pass)
+                              .setSubpass(0)
+                              .setFramebuffer(buffer.framebuffer);
+#ifdef VK_KHR_dynamic_rendering
+  auto const renderingInheritance = vk::CommandBufferInheritanceRenderingInfoKHR()
+                              .setColorAttachmentCount(1)
+                              .setPColorAttachmentFormats(&swapchain_format.format)
+                              .setRasterizationSamples(vk::SampleCountFlagBits::e1);
+  if (dynamic_rendering.enabled)
+    inheritance.setPNext(&renderingInheritance);
+#endif
+
+  tasks::group recorded;
+  for (uint32_t chunk = 0; chunk < chunksNum; ++chunk)
+  {
+    tasks::submit([&frame, &secondaries, &inheritance, chunk, chunksNum, tilesNum] ()
+      {
+        RecordContext& ctx = frame.recorders[tasks::current_worker() + 1];
+        vk::CommandBuffer cmd = acquire_secondary(ctx);
+        cmd.begin(vk::CommandBufferBeginInfo()
+                       .setFlags(vk::CommandBufferUsageFlagBits::eRenderPassContinue |
+                                 vk::CommandBufferUsageFlagBits::eOneTimeSubmit)
+                       .setPInheritanceInfo(&inheritance));
+        write_tiles(cmd, tilesNum * chunk / chunksNum, tilesNum * (chunk + 1) / chunksNum);
+        cmd.end();
+        secondaries[chunk] = cmd;
+      }, tasks::lane::present, &recorded);
+  }
+  tasks::wait(recorded);
+
+  for (vk::CommandBuffer cmd: secondaries)
+    if (!cmd)
+      throw vulkan_error("failed to record secondary command buffer");
+  return secondaries;
+}
+
+// Records the frame as three command buffers, one per pipeline stage, so
+// every stage can signal its own progress.
+static void   write_command_buffers(FrameResources& frame, SwapchainBuffer const& buffer)
+{
+  vk::ClearValue const clearValues[2] = {
+      vk::ClearColorValue(std::array<float, 4>({{0.0f, 0.0f, 0.0f, 1.0f}})),
+      vk::ClearDepthStencilValue(1.0f, 0u)};
+
+
+  // a single tile is cheaper to record inline
+  const bool useSecondaries = tile_columns * tile_rows > 1;
+  std::vector<vk::CommandBuffer> secondaries;
+  if (useSecondaries)
+    secondaries = write_secondary_buffers(frame, buffer);
+
+  auto const beginInfo = vk::CommandBufferBeginInfo()
+                          .setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+
+  frame.upload_cmd.begin(beginInfo);
+  if (frame.upload_pending && source.upload == upload_path::direct)
+    write_linear_upload(frame.upload_cmd, frame);
+  else if (frame.upload_pending)
+    write_upload(frame.upload_cmd, frame);
+  frame.upload_cmd.end();
+
+  frame.convert_cmd.begin(beginInfo);
+  if (convert_pass_needed())
+    write_horizontal_pass(frame.convert_cmd);
+  frame.convert_cmd.end();
+
+  vk::CommandBuffer cmd = frame.cmd;
+  cmd.begin(beginInfo);
+
+  if (dynamic_rendering.enabled)
+  {
+    // waits for the acquire semaphore at the same stage
+    image_barrier(cmd, buffer.image,
+                  vk::ImageLayout::eUndefined, vk::ImageLayout::eColorAttachmentOptimal,
+                  vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::AccessFlags(),
+                  vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                  vk::AccessFlagBits::eColorAttachmentWrite);
+    begin_rendering(cmd, buffer.view, swapchain_extent,
+                    vk::AttachmentLoadOp::eClear, useSecondaries);
+  }
+  else
+    cmd.beginRenderPass(vk::RenderPassBeginInfo()
+                            .setFramebuffer(buffer.framebuffer)
+                            .setRenderPass(render_pass)
+                            .setClearValueCount(2)
+                            .setPClearValues(clearValues)
+                            .setRenderArea(
+                                vk::Rect2D(vk::Offset2D(0, 0),
+                                swapchain_extent
+                              ))
+                           ,useSecondaries ? vk::SubpassContents::eSecondaryCommandBuffers
+                                           : vk::SubpassContents::eInline);
+  if (useSecondaries)
+    cmd.executeCommands(secondaries.size(), secondaries.data());
+  else
+    write_tiles(cmd, 0, 1);
+
+  if (dynamic_rendering.enabled)
+  {
+    end_rendering(cmd);
+    image_barrier(cmd, buffer.image,
+                  vk::ImageLayout::eColorAttachmentOptimal, vk::ImageLayout::ePresentSrcKHR,
+                  vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                  vk::AccessFlagBits::eColorAttachmentWrite,
+                  vk::PipelineStageFlagBits::eBottomOfPipe, vk::AccessFlags());
+  }
+  else
     cmd.endRenderPass();
-    cmd.end();
+  cmd.end();
+}
+
+// Waits until the GPU is done with the frame's command buffers and staging.
+static void   wait_frame_idle(FrameResources& frame)
+{
+  if (timeline.enabled)
+  {
+    wait_gpu(stage::present, frame.serial);
+    return;
+  }
+  device.waitForFences(1, &frame.fence, VK_TRUE, UINT64_MAX);
+}
+
+static void   submit_frame(FrameResources& frame)
+{
+  vk::PipelineStageFlags const stageFlags =
+      vk::PipelineStageFlagBits::eColorAttachmentOutput;
+
+  if (!timeline.enabled)
+  {
+    const vk::CommandBuffer cmds[3] = {frame.upload_cmd, frame.convert_cmd, frame.cmd};
+    auto const submitInfo =
+        vk::SubmitInfo()
+            .setPWaitDstStageMask(&stageFlags)
+            .setWaitSemaphoreCount(1)
+            .setPWaitSemaphores(&frame.image_acquired_semaphore)
+            .setCommandBufferCount(3)
+            .setPCommandBuffers(cmds)
+            .setSignalSemaphoreCount(1)
+            .setPSignalSemaphores(&frame.render_finished_semaphore);
+
+    std::lock_guard<std::mutex> guard(timeline.fence_lock);
+    device.resetFences(1, &frame.fence);
+    frame.serial = timeline.submitted + 1;
+    graphics_queue.submit(1, &submitInfo, frame.fence);
+    timeline.submitted = frame.serial;
+    return;
   }
+
+#ifdef VK_VERSION_1_2
+  // one batch per stage, each signalling its timeline with the frame serial;
+  // without a separate conversion pass the render batch signals it
+  frame.serial = timeline.submitted + 1;
+  const uint64_t serial = frame.serial;
+  const uint64_t binaryValue = 0;
+  const bool convertPass = convert_pass_needed();
+  const uint64_t renderSignalValues[3] = {binaryValue, serial, serial};
+  const vk::Semaphore renderSignals[3] = {frame.render_finished_semaphore,
+                                          timeline.semaphores[(int)stage::present],
+                                          timeline.semaphores[(int)stage::convert]};
+
+  vk::TimelineSemaphoreSubmitInfo const timelineInfos[3] = {
+      vk::TimelineSemaphoreSubmitInfo()
+          .setSignalSemaphoreValueCount(1)
+          .setPSignalSemaphoreValues(&serial),
+      vk::TimelineSemaphoreSubmitInfo()
+          .setSignalSemaphoreValueCount(convertPass ? 1 : 0)
+          .setPSignalSemaphoreValues(&serial),
+      vk::TimelineSemaphoreSubmitInfo()
+          .setWaitSemaphoreValueCount(1)
+          .setPWaitSemaphoreValues(&binaryValue)
+          .setSignalSemaphoreValueCount(convertPass ? 2 : 3)
+          .setPSignalSemaphoreValues(renderSignalValues)
+    };
+
+  vk::SubmitInfo const submitInfos[3] = {
+      vk::SubmitInfo()
+          .setPNext(&timelineInfos[0])
+          .setCommandBufferCount(1)
+          .setPCommandBuffers(&frame.upload_cmd)
+          .setSignalSemaphoreCount(1)
+          .setPSignalSemaphores(&timeline.semaphores[(int)stage::upload]),
+      vk::SubmitInfo()
+          .setPNext(&timelineInfos[1])
+          .setCommandBufferCount(1)
+          .setPCommandBuffers(&frame.convert_cmd)
+          .setSignalSemaphoreCount(convertPass ? 1 : 0)
+          .setPSignalSemaphores(&timeline.semaphores[(int)stage::convert]),
+      vk::SubmitInfo()
+          .setPNext(&timelineInfos[2])
+          .setPWaitDstStageMask(&stageFlags)
+          .setWaitSemaphoreCount(1)
+          .setPWaitSemaphores(&frame.image_acquired_semaphore)
+          .setCommandBufferCount(1)
+          .setPCommandBuffers(&frame.cmd)
+          .setSignalSemaphoreCount(convertPass ? 2 : 3)
+          .setPSignalSemaphores(renderSignals)
+    };
+  graphics_queue.submit(3, submitInfos, vk::Fence());
+  timeline.submitted = serial;
+#endif
+}
+
+static void   update_record_stats(std::chrono::nanoseconds elapsed)
+{
+  using us = std::chrono::duration<double, std::micro>;
+
+  telemetry::observe(telemetry::histogram::record, elapsed);
+
+  record_stats.total += elapsed;
+  record_stats.max = std::max(record_stats.max, elapsed);
+  if (++record_stats.count < 600)
+    return;
+
+  printf("[V3D] command recording: avg %.1fus, max %.1fus\n",
+         us(record_stats.total).count() / record_stats.count,
+         us(record_stats.max).count());
+  record_stats.total = std::chrono::nanoseconds(0);
+  record_stats.max = std::chrono::nanoseconds(0);
+  record_stats.count = 0;
 }
 
 static void  prepare_framebuffers()
@@ -519,9 +3129,13 @@ static void  prepare_framebuffers()
   }
 }
 
-static void  prepare_pipeline()
+// A null pass builds the pipeline for dynamic rendering into color_format
+static vk::Pipeline  create_pipeline(vk::ShaderModule vertShaderModule,
+                                     vk::ShaderModule fragShaderModule,
+                                     vk::RenderPass pass,
+                                     vk::Format color_format,
+                                     vk::SpecializationInfo const* specialization)
 {
-  pipeline_cache = device.createPipelineCache(vk::PipelineCacheCreateInfo());
   vk::PipelineVertexInputStateCreateInfo const vertexInputInfo;
 
   auto const inputAssemblyInfo =
@@ -577,9 +3191,6 @@ static void  prepare_pipeline()
                                     .setPDynamicStates(dynamicStates)
                                     .setDynamicStateCount(2);
 
-  auto vertShaderModule = load_shader_from_file("vert.spv");
-  auto fragShaderModule = load_shader_from_file("frag.spv");
-
   vk::PipelineShaderStageCreateInfo const shaderStageInfo[2] = {
       vk::PipelineShaderStageCreateInfo()
           .setStage(vk::ShaderStageFlagBits::eVertex)
@@ -588,9 +3199,10 @@ static void  prepare_pipeline()
       vk::PipelineShaderStageCreateInfo()
           .setStage(vk::ShaderStageFlagBits::eFragment)
           .setModule(fragShaderModule)
-          .setPName("main")};
+          .setPName("main")
+          .setPSpecializationInfo(specialization)};
 
-  auto const pipelineInfo = vk::GraphicsPipelineCreateInfo()
+  auto pipelineInfo = vk::GraphicsPipelineCreateInfo()
                             .setStageCount(2)
                             .setPStages(shaderStageInfo)
                             .setPVertexInputState(&vertexInputInfo)
@@ -602,19 +3214,253 @@ static void  prepare_pipeline()
                             .setPColorBlendState(&colorBlendInfo)
                             .setPDynamicState(&dynamicStateInfo)
                             .setLayout(pipeline_layout)
-                            .setRenderPass(render_pass);
+                            .setRenderPass(pass);
+
+#ifdef VK_KHR_dynamic_rendering
+  auto const renderingInfo = vk::PipelineRenderingCreateInfoKHR()
+                            .setColorAttachmentCount(1)
+                            .setPColorAttachmentFormats(&color_format);
+  if (!pass)
+    pipelineInfo.setPNext(&renderingInfo);
+#endif
+
+  return device.createGraphicsPipeline(pipeline_cache, pipelineInfo);
+}
+
+static void  compile_pipeline(CachedPipeline& entry)
+{
+  PipelineKey const& key = entry.key;
+  SpecializationData const data = {
+    (int32_t)key.color.matrix,
+    key.color.full_range ? VK_TRUE : VK_FALSE,
+    key.color.bit_depth,
+    key.filter == scaler::lanczos ? 2 : 1
+  };
+  vk::SpecializationMapEntry const entries[] = {
+    {0, offsetof(SpecializationData, color_matrix), sizeof(int32_t)},
+    {1, offsetof(SpecializationData, full_range), sizeof(VkBool32)},
+    {2, offsetof(SpecializationData, bit_depth), sizeof(int32_t)},
+    {3, offsetof(SpecializationData, filter), sizeof(int32_t)}
+  };
+  auto const specialization = vk::SpecializationInfo()
+                                .setMapEntryCount(4)
+                                .setPMapEntries(entries)
+                                .setDataSize(sizeof(data))
+                                .setPData(&data);
+
+  // render passes stay null on the dynamic rendering path
+  const bool intermediateTarget = key.kind == pipeline_kind::scale_h;
+  try {
+    entry.pipeline = create_pipeline(pipelines.vert, pipelines.frag[(int)key.kind],
+                                     intermediateTarget ? intermediate_pass : render_pass,
+                                     intermediateTarget ? intermediate_format
+                                                        : swapchain_format.format,
+                                     &specialization);
+    entry.state = pipeline_ready;
+  }
+  catch (std::exception const& e)
+  {
+    printf("[V3D] pipeline permutation %08x failed: %s\n", key.packed(), e.what());
+    entry.state = pipeline_failed;
+  }
+}
+
+static bool  claim_pipeline(CachedPipeline& entry)
+{
+  int expected = pipeline_queued;
+  return entry.state.compare_exchange_strong(expected, pipeline_compiling);
+}
+
+// Only the inputs a kind actually reads are part of its key, so the same
+// pipeline isn't built twice.
+static PipelineKey  normalized(PipelineKey key)
+{
+  if (key.kind == pipeline_kind::bilinear)
+    key.filter = scaler::bilinear;
+  if (key.kind == pipeline_kind::scale_v)
+    key.color = ColorFormat();
+  return key;
+}
+
+// Queues a background compile unless the permutation is known already.
+static CachedPipeline&  request_pipeline(PipelineKey key)
+{
+  key = normalized(key);
+  std::lock_guard<std::mutex> guard(pipelines.lock);
+  std::unique_ptr<CachedPipeline>& slot = pipelines.entries[key.packed()];
+  if (!slot)
+  {
+    slot.reset(new CachedPipeline);
+    slot->key = key;
+    CachedPipeline* entry = slot.get();
+    tasks::submit([entry]
+      {
+        if (claim_pipeline(*entry))
+          compile_pipeline(*entry);
+      }, tasks::lane::background, &pipelines.group);
+  }
+  return *slot;
+}
+
+// The permutation, built on the calling thread when its compile hasn't
+// started yet and waited for when it has.
+static vk::Pipeline  get_pipeline(PipelineKey key)
+{
+  CachedPipeline& entry = request_pipeline(key);
+  if (entry.state == pipeline_ready)
+    return entry.pipeline;
+
+  auto waitStart = std::chrono::steady_clock::now();
+  if (claim_pipeline(entry))
+    compile_pipeline(entry);
+  while (entry.state == pipeline_compiling)
+    std::this_thread::yield();
+  if (entry.state == pipeline_failed)
+    throw vulkan_error("failed to create pipeline");
 
-  pipeline = device.createGraphicsPipeline(pipeline_cache, pipelineInfo);
+  std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - waitStart;
+  printf("[V3D] waited %.1fms for pipeline permutation %08x\n", waited.count(), entry.key.packed());
+  return entry.pipeline;
+}
+
+// Everything a video of this color format may need: the window or the
+// tiles changing switches between the scalers at any time.
+static void  prewarm_pipelines(ColorFormat const& color)
+{
+  const scaler filters[] = {scaler::bicubic, scaler::lanczos};
+  request_pipeline({pipeline_kind::bilinear, color, scaler::bilinear});
+  for (scaler filter: filters)
+  {
+    request_pipeline({pipeline_kind::scale_h, color, filter});
+    request_pipeline({pipeline_kind::scale_v, color, filter});
+  }
+}
+
+static void  start_pipelines()
+{
+  pipeline_cache = device.createPipelineCache(vk::PipelineCacheCreateInfo());
+
+  pipelines.vert = load_shader_from_file("fullscreen.vert.spv");
+  pipelines.frag[(int)pipeline_kind::bilinear] =
+      load_shader_from_file(ycbcr.enabled ? "ycbcr_bilinear.frag.spv" : "yuv_bilinear.frag.spv");
+  pipelines.frag[(int)pipeline_kind::scale_h] =
+      load_shader_from_file(ycbcr.enabled ? "scale_h_ycbcr.frag.spv" : "scale_h.frag.spv");
+  pipelines.frag[(int)pipeline_kind::scale_v] = load_shader_from_file("scale_v.frag.spv");
+
+  // most video is BT.709 limited range; anything else is compiled when
+  // its first frame is uploaded
+  prewarm_pipelines(ColorFormat());
+}
+
+// A permutation still compiling after a mid-stream color format change is
+// not waited for: the frame is drawn with the previous one and redrawn once
+// the new one is built. Only a missing filter or the very first frame waits,
+// and a permutation that failed to build throws like get_pipeline().
+static vk::Pipeline  resolve_pipeline(PipelineKey key, PipelineKey& last_key, vk::Pipeline last)
+{
+  key = normalized(key);
+  CachedPipeline& entry = request_pipeline(key);
+  const int state = entry.state;
+  if (state != pipeline_ready && state != pipeline_failed &&
+      last && last_key.kind == key.kind && last_key.filter == key.filter)
+  {
+    pipelines.stale = true;
+    return last;
+  }
+  vk::Pipeline pipeline = state == pipeline_ready ? entry.pipeline : get_pipeline(key);
+  last_key = key;
+  return pipeline;
+}
+
+static void  prepare_pipelines()
+{
+  pipelines.stale = false;
+  if (!source.ready)
+    return;
+
+  if (scale_plan.filter == scaler::bilinear)
+  {
+    scale_plan.tile_pipeline = resolve_pipeline({pipeline_kind::bilinear, source.color, scaler::bilinear},
+                                                scale_plan.tile_key, scale_plan.tile_pipeline);
+    return;
+  }
+  scale_plan.horizontal_pipeline = resolve_pipeline({pipeline_kind::scale_h, source.color, scale_plan.filter},
+                                                    scale_plan.horizontal_key,
+                                                    scale_plan.horizontal_pipeline);
+  scale_plan.tile_pipeline = resolve_pipeline({pipeline_kind::scale_v, source.color, scale_plan.filter},
+                                              scale_plan.tile_key, scale_plan.tile_pipeline);
+}
+
+static void create_present_semaphores()
+{
+  vk::SemaphoreCreateInfo  semCreateInfo;
+  for (FrameResources& frame: frames)
+  {
+    frame.image_acquired_semaphore = device.createSemaphore(semCreateInfo);
+    frame.render_finished_semaphore = device.createSemaphore(semCreateInfo);
+  }
+}
+
+static void create_semaphores()
+{
+  create_present_semaphores();
 
-  vktools::destroy_handle(vertShaderModule, device);
-  vktools::destroy_handle(fragShaderModule, device);
+#ifdef VK_VERSION_1_2
+  if (timeline.enabled)
+  {
+    // serials continue where a lost device stopped, so the waits of
+    // pictures still queued are already satisfied
+    auto const timelineInfo = vk::SemaphoreTypeCreateInfo()
+                                .setSemaphoreType(vk::SemaphoreType::eTimeline)
+                                .setInitialValue(timeline.submitted);
+    for (vk::Semaphore& semaphore: timeline.semaphores)
+      semaphore = device.createSemaphore(vk::SemaphoreCreateInfo().setPNext(&timelineInfo));
+  }
+#endif
 }
 
-static void create_semaphores()
+static void create_depth_buffer(vk::Extent2D extent)
 {
-  vk::SemaphoreCreateInfo  semCreateInfo;
-  image_acquired_semaphore = device.createSemaphore(semCreateInfo); 
-  render_finished_semaphore = device.createSemaphore(semCreateInfo);
+  depth_buffer.image = device.createImage(
+        vk::ImageCreateInfo()
+          .setImageType(vk::ImageType::e2D)
+          .setFormat(vk::Format::eD16Unorm)
+          .setExtent(vk::Extent3D()
+                      .setWidth(extent.width)
+                      .setHeight(extent.height)
+                      .setDepth(1))
+          .setMipLevels(1)
+          .setArrayLayers(1)
+          .setSamples(vk::SampleCountFlagBits::e1)
+          .setTiling(vk::ImageTiling::eOptimal)
+          .setUsage(vk::ImageUsageFlagBits::eDepthStencilAttachment)
+          .setSharingMode(vk::SharingMode::eExclusive)
+          .setInitialLayout(vk::ImageLayout::eUndefined)
+      );
+
+  vk::MemoryRequirements memReqs = device.getImageMemoryRequirements(depth_buffer.image);
+  depth_buffer.memory = allocate_memory(memReqs, vk::MemoryPropertyFlags());
+  device.bindImageMemory(depth_buffer.image, depth_buffer.memory, 0);
+
+  depth_buffer.view = device.createImageView(
+           vk::ImageViewCreateInfo()
+            .setImage(depth_buffer.image)
+            .setViewType(vk::ImageViewType::e2D)
+            .setFormat(vk::Format::eD16Unorm)
+            .setComponents(vk::ComponentMapping()
+                              .setR(vk::ComponentSwizzle::eIdentity)
+                              .setG(vk::ComponentSwizzle::eIdentity)
+                              .setB(vk::ComponentSwizzle::eIdentity)
+                              .setA(vk::ComponentSwizzle::eIdentity)
+                          )
+            .setSubresourceRange(vk::ImageSubresourceRange()
+                                    .setAspectMask(vk::ImageAspectFlagBits::eDepth)
+                                    .setBaseMipLevel(0)
+                                    .setLevelCount(1)
+                                    .setBaseArrayLayer(0)
+                                    .setLayerCount(1)
+                          )
+        );
 }
 
 static void create_swap_chain(VkSurfaceKHR surface)
@@ -649,15 +3495,14 @@ static void create_swap_chain(VkSurfaceKHR surface)
   swapchain_format = surfFormats[surfFormatIdx];
   vk::SurfaceFormatKHR const& surfFormat = swapchain_format;
 
-  auto presentModes = dev.getSurfacePresentModesKHR(surface);
-  std::sort(presentModes.begin(), presentModes.end(),
-      [] (vk::PresentModeKHR p1, vk::PresentModeKHR p2)
-      {
-        return present_mode_value(p1) > present_mode_value(p2);
-      });
-  vk::PresentModeKHR bestPm = presentModes.front();
+  PresentProfile const& profile = get_profile();
+  vk::PresentModeKHR bestPm = choose_present_mode(dev.getSurfacePresentModesKHR(surface));
+  uint32_t imagesNum = std::max(profile.images, surfCaps.minImageCount);
+  if (surfCaps.maxImageCount > 0)
+    imagesNum = std::min(imagesNum, surfCaps.maxImageCount);
 
-  printf("Present mode %s choosen\n", vk::to_string(bestPm).c_str());
+  printf("Present profile %s: mode %s, %u images\n", profile.name,
+         vk::to_string(bestPm).c_str(), imagesNum);
   vk::SwapchainKHR oldSwapchain = swapchain;
   swapchain = device.createSwapchainKHR(
                 vk::SwapchainCreateInfoKHR()
@@ -672,11 +3517,14 @@ static void create_swap_chain(VkSurfaceKHR surface)
                   .setPreTransform(surfCaps.currentTransform)
                   .setCompositeAlpha(vk::CompositeAlphaFlagBitsKHR::eOpaque)
                   .setClipped(VK_TRUE)
-                  .setMinImageCount(surfCaps.minImageCount + 1)
+                  .setMinImageCount(imagesNum)
                   .setOldSwapchain(oldSwapchain)
               );
 
-  vktools::destroy_handle(oldSwapchain, device);
+  retire(oldSwapchain);
+  // present ids are per swapchain
+  latency.pending.clear();
+  damage.bits |= damage_surface;
 
   std::vector<vk::Image> swpImages = device.getSwapchainImagesKHR(swapchain);
 
@@ -706,110 +3554,543 @@ static void create_swap_chain(VkSurfaceKHR surface)
   }
 
   free_depth_buffer();
-  depth_buffer.image = device.createImage(
-        vk::ImageCreateInfo()
-          .setImageType(vk::ImageType::e2D)
-          .setFormat(vk::Format::eD16Unorm)
-          .setExtent(vk::Extent3D()
-                      .setWidth(surfCaps.currentExtent.width)
-                      .setHeight(surfCaps.currentExtent.height)
-                      .setDepth(1))
-          .setMipLevels(1)
-          .setArrayLayers(1)
-          .setSamples(vk::SampleCountFlagBits::e1)
-          .setTiling(vk::ImageTiling::eOptimal)
-          .setUsage(vk::ImageUsageFlagBits::eDepthStencilAttachment)
-          .setSharingMode(vk::SharingMode::eExclusive)
-          .setInitialLayout(vk::ImageLayout::eUndefined)
-      );
-
-  vk::MemoryRequirements memReqs = device.getImageMemoryRequirements(depth_buffer.image);
-  depth_buffer.memory = device.allocateMemory(vk::MemoryAllocateInfo()
-                                            .setAllocationSize (memReqs.size)
-                                            .setMemoryTypeIndex (find_memory_type(
-                                                          memReqs.memoryTypeBits, 
-                                                          vk::MemoryPropertyFlags()))
-                                          );
-  device.bindImageMemory(depth_buffer.image, depth_buffer.memory, 0);
+  if (!dynamic_rendering.enabled)
+    create_depth_buffer(swapchain_extent);
+}
 
-  depth_buffer.view = device.createImageView(
-           vk::ImageViewCreateInfo()
-            .setImage(depth_buffer.image)
-            .setViewType(vk::ImageViewType::e2D)
-            .setFormat(vk::Format::eD16Unorm)
-            .setComponents(vk::ComponentMapping()
-                              .setR(vk::ComponentSwizzle::eIdentity)
-                              .setG(vk::ComponentSwizzle::eIdentity)
-                              .setB(vk::ComponentSwizzle::eIdentity)
-                              .setA(vk::ComponentSwizzle::eIdentity)
-                          )
-            .setSubresourceRange(vk::ImageSubresourceRange()
-                                    .setAspectMask(vk::ImageAspectFlagBits::eDepth)
-                                    .setBaseMipLevel(0)
-                                    .setLevelCount(1)
-                                    .setBaseArrayLayer(0)
-                                    .setLayerCount(1)
-                          )
-        );
+// everything created on the device once it is chosen
+static void  prepare_device_objects(VkSurfaceKHR surface)
+{
+  create_swap_chain(surface);
+  prepare_descriptor_layout();
+  if (!dynamic_rendering.enabled)
+  {
+    prepare_renderpass();
+    prepare_intermediate_renderpass();
+  }
+  start_pipelines();
+  create_semaphores();
+  if (!dynamic_rendering.enabled)
+    prepare_framebuffers();
+  prepare_command_pool();
 }
 
 void  on_window_create(VkSurfaceKHR surface)
 {
   choose_GPU(surface);
   on_window_resize(surface);
-  create_swap_chain(surface);
-  create_semaphores();
-  prepare_descriptor_layout();
-  prepare_renderpass();
-  prepare_pipeline();
-  prepare_framebuffers();
-  prepare_command_pool();
-  write_command_buffers();
+  prepare_device_objects(surface);
 }
 
 void  on_window_resize(VkSurfaceKHR surface)
 {
   printf("on_window_resize\n");
+  recovery.surface = surface;
 
   GPUInfo const& gpuInfo = get_gpu();
   if (!gpuInfo.device.getSurfaceSupportKHR(gpuInfo.renderQueueFamilyIdx, surface))
     throw vulkan_error("window surface does not support present via active gpu");
 
-  //create_swap_chain(surface);
+  if (!swapchain)
+    return;
+
+  create_swap_chain(surface);
+  // with dynamic rendering the new image views are all there is to rebuild
+  if (!dynamic_rendering.enabled)
+    prepare_framebuffers();
+}
+
+// A present that failed leaves its wait semaphore signalled, so the
+// semaphores are replaced along with the swapchain. The device is idle.
+static void  reset_present_semaphores()
+{
+  for (FrameResources& frame: frames)
+  {
+    vktools::destroy_handle(frame.render_finished_semaphore, device);
+    vktools::destroy_handle(frame.image_acquired_semaphore, device);
+  }
+  create_present_semaphores();
+}
+
+static void  rebuild_swap_chain()
+{
+  device.waitIdle();
+  reset_present_semaphores();
+  create_swap_chain(recovery.surface);
+  if (!dynamic_rendering.enabled)
+    prepare_framebuffers();
+}
+
+static void  drop_swap_chain()
+{
+  device.waitIdle();
+  reset_present_semaphores();
+  free_swapchain_views();
+  vktools::destroy_handle(swapchain, device);
+  // nothing may be left of the swapchain once the surface goes
+  destroy_retired(UINT64_MAX);
+  recovery.surface_lost = true;
 }
 
 void  on_device_lost()
 {
+  printf("[V3D] device lost, rebuilding GPU state\n");
+  const auto start = std::chrono::steady_clock::now();
+  {
+    std::unique_lock<std::shared_mutex> guard(recovery.device_lock);
+    // returns right away once the device is lost
+    try {
+      device.waitIdle();
+    }
+    catch (vk::SystemError const&)
+    {
+    }
+    free_resources();
+    free_device();
+    // whatever the lost device had submitted is as done as it gets
+    timeline.completed = timeline.submitted.load();
+    frame_index = 0;
+    recovery.device_lost = false;
+
+    choose_GPU(recovery.surface);
+    prepare_device_objects(recovery.surface);
+  }
+  recovery.source_lost = true;
+  telemetry::add(telemetry::counter::gpu_recoveries);
+  printf("[V3D] recovered from device loss in %.1f ms\n",
+         std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+bool  surface_lost()
+{
+  return recovery.surface_lost;
+}
+
+void  on_surface_recreate(VkSurfaceKHR surface)
+{
+  printf("on_surface_recreate\n");
+  GPUInfo const& gpuInfo = get_gpu();
+  if (!gpuInfo.device.getSurfaceSupportKHR(gpuInfo.renderQueueFamilyIdx, surface))
+    throw vulkan_error("window surface does not support present via active gpu");
+
+  recovery.surface = surface;
+  recovery.surface_lost = false;
+  create_swap_chain(surface);
+  if (!dynamic_rendering.enabled)
+    prepare_framebuffers();
+  telemetry::add(telemetry::counter::gpu_recoveries);
+}
+
+bool  source_lost()
+{
+  return recovery.source_lost;
+}
+
+void  inject_fault(fault f, uint32_t after_renders)
+{
+  recovery.injected = f;
+  recovery.fault_countdown = after_renders;
+  recovery.fault_pending = true;
 }
 
-void render()
+static void  throw_fault(fault f)
 {
+  switch (f)
+  {
+  case fault::device_lost:
+    throw vk::DeviceLostError("injected fault");
+  case fault::surface_lost:
+    throw vk::SurfaceLostKHRError("injected fault");
+  case fault::out_of_date:
+    throw vk::OutOfDateKHRError("injected fault");
+  }
+}
+
+void  set_tiles(uint32_t columns, uint32_t rows)
+{
+  tile_columns = std::max(1u, columns);
+  tile_rows = std::max(1u, rows);
+  damage.bits |= damage_layout;
+}
+
+void  set_scaler(scaler s)
+{
+  active_scaler = s;
+  damage.bits |= damage_layout;
+}
+
+void  set_present_profile(present_profile p)
+{
+  active_profile = p;
+}
+
+void  invalidate()
+{
+  damage.bits |= damage_layout;
+}
+
+void  on_window_expose()
+{
+  damage.bits |= damage_surface;
+}
+
+// Copies a width x height plane into extent, repeating the last column and
+// row into the padding of an odd sized source.
+static void  copy_plane(uint8_t* dst, vk::DeviceSize pitch, vk::Extent2D extent,
+                        const uint8_t* src, uint32_t stride, uint32_t width, uint32_t height)
+{
+  for (uint32_t y = 0; y < extent.height; ++y)
+  {
+    uint8_t* row = dst + y * pitch;
+    memcpy(row, src + std::min(y, height - 1) * stride, width);
+    if (extent.width > width)
+      memset(row + width, row[width - 1], extent.width - width);
+  }
+}
+
+static uint64_t  finish_upload(FrameResources& frame, video_frame const& video)
+{
+  recovery.source_lost = false;
+  frame.upload_pending = true;
+  frame.arrival = std::chrono::steady_clock::now();
+  frame.color.matrix = video.matrix;
+  frame.color.full_range = video.full_range;
+  frame.color.bit_depth = video.bit_depth;
+  // start building the new permutations before the frame is rendered
+  if (frame.color != source.uploaded_color)
+  {
+    source.uploaded_color = frame.color;
+    prewarm_pipelines(frame.color);
+  }
+  damage.bits |= damage_frame;
+  return timeline.submitted + 1;
+}
+
+uint64_t  upload_frame(video_frame const& video)
+{
+  if (video.width != source.width || video.height != source.height)
+    create_source(video.width, video.height);
+
+  if (!has_upload_target(frames[frame_index]))
+  {
+    try {
+      create_upload_target(frames[frame_index]);
+    }
+    catch (vk::OutOfDeviceMemoryError const&)
+    {
+      if (frames_active == 1)
+        throw;
+      shrink_pools("exhausted");
+      if (!has_upload_target(frames[frame_index]))
+        create_upload_target(frames[frame_index]);
+    }
+  }
+
+  FrameResources& frame = frames[frame_index];
+  const bool direct = source.upload == upload_path::direct;
+  // the staging buffer is reused once the frame that last used it is done,
+  // linear planes once the last frame that sampled them is
+  if (direct)
+    wait_gpu(stage::convert, frame.sampled_serial);
+  else
+    wait_frame_idle(frame);
+
+  telemetry::timer timer(telemetry::histogram::upload);
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    vk::Extent2D extent = plane_extent(i);
+    uint8_t* dst = direct ? frame.plane_data[i] : frame.staging_data + source.offsets[i];
+    const vk::DeviceSize pitch = direct ? frame.row_pitch[i] : extent.width;
+    const uint32_t width = i == 0 ? video.width : (video.width + 1) / 2;
+    const uint32_t height = i == 0 ? video.height : (video.height + 1) / 2;
+    copy_plane(dst, pitch, extent, video.planes[i], video.strides[i], width, height);
+    frame.upload_offsets[i] = source.offsets[i];
+    frame.upload_row_length[i] = 0;
+  }
+  std::lock_guard<std::mutex> guard(host_import.lock);
+  frame.upload_buffer = frame.staging;
+  return finish_upload(frame, video);
+}
+
+uint64_t  upload_host_frame(video_frame const& video)
+{
+  if (video.width != source.width || video.height != source.height)
+    create_source(video.width, video.height);
+
+  // the copy regions have to start at multiples of 4, and a padded source
+  // can't be copied from the picture as it is
+  const vk::Extent2D image = image_extent();
+  bool importable = host_import.enabled && video.host_block &&
+                    source.upload == upload_path::staging &&
+                    image.width == video.width && image.height == video.height;
+  for (uint32_t i = 0; i < 3 && importable; ++i)
+    importable = video.planes[i] >= video.host_block &&
+                 (video.planes[i] - video.host_block) % 4 == 0;
+  if (!importable)
+  {
+    upload_frame(video);
+    return 0;
+  }
+
+  std::unique_lock<std::mutex> guard(host_import.lock);
+  vk::Buffer buffer = import_host_block(video.host_block, video.host_block_size);
+  if (!buffer)
+  {
+    guard.unlock();
+    upload_frame(video);
+    return 0;
+  }
+  const uint64_t serial = timeline.submitted + 1;
+  host_import.imports[video.host_block].serial = serial;
+
+  FrameResources& frame = frames[frame_index];
+  frame.upload_buffer = buffer;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    frame.upload_offsets[i] = video.planes[i] - video.host_block;
+    frame.upload_row_length[i] = video.strides[i];
+  }
+  return finish_upload(frame, video);
+}
+
+
+static void  update_damage_stats()
+{
+  if (++damage.rendered < 600)
+    return;
+
+  printf("[V3D] %u frames rendered, %u idle renders skipped\n",
+         damage.rendered, damage.skipped);
+  damage.rendered = 0;
+  damage.skipped = 0;
+}
+
+static void  add_latency_sample(LatencyStats& stats, std::chrono::nanoseconds elapsed)
+{
+  using ms = std::chrono::duration<double, std::milli>;
+
+  stats.total += elapsed;
+  stats.max = std::max(stats.max, elapsed);
+  if (++stats.count < 600)
+    return;
+
+  printf("[V3D] %s latency (%s): avg %.2fms, max %.2fms\n", stats.name, get_profile().name,
+         ms(stats.total).count() / stats.count, ms(stats.max).count());
+  stats.total = std::chrono::nanoseconds(0);
+  stats.max = std::chrono::nanoseconds(0);
+  stats.count = 0;
+}
+
+// Retires pending presents the display (or at least the GPU) is done with
+static void  collect_latency()
+{
+  // the display may never report some presents
+  while (!latency.pending.empty() &&
+         latency.pending.front().serial + latency_window < timeline.submitted)
+    latency.pending.pop_front();
+  if (latency.pending.empty())
+    return;
+
+#ifdef VK_GOOGLE_display_timing
+  if (latency.display_timing)
+  {
+    uint32_t count = 0;
+    latency.past_timing(device, swapchain, &count, nullptr);
+    std::vector<VkPastPresentationTimingGOOGLE> timings(count);
+    if (count == 0 ||
+        latency.past_timing(device, swapchain, &count, timings.data()) < 0)
+      return;
+
+    // actualPresentTime is CLOCK_MONOTONIC, the clock behind steady_clock
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      // presents that were never displayed are dropped
+      while (!latency.pending.empty() &&
+             (uint32_t)latency.pending.front().serial < timings[i].presentID)
+        latency.pending.pop_front();
+      if (latency.pending.empty() ||
+          (uint32_t)latency.pending.front().serial != timings[i].presentID)
+        continue;
+
+      auto presented = std::chrono::nanoseconds(timings[i].actualPresentTime);
+      add_latency_sample(latency.glass,
+                         presented - latency.pending.front().arrival.time_since_epoch());
+      latency.pending.pop_front();
+    }
+    return;
+  }
+#endif
+
+  const uint64_t completed = completed_frame(stage::present);
+  const auto now = std::chrono::steady_clock::now();
+  while (!latency.pending.empty() && latency.pending.front().serial <= completed)
+  {
+    add_latency_sample(latency.render, now - latency.pending.front().arrival);
+    latency.pending.pop_front();
+  }
+}
+
+// Power-save folds layout changes into the next video frame. Surface
+// damage can't wait, the window would show garbage meanwhile.
+static bool  defer_to_next_frame(PresentProfile const& profile)
+{
+  if (!profile.on_new_frame || !source.ready ||
+      (damage.bits & (damage_frame | damage_surface)))
+    return false;
+
+  const auto now = std::chrono::steady_clock::now();
+  if (!damage.deferred)
+  {
+    damage.deferred = true;
+    damage.deferred_since = now;
+  }
+  return now - damage.deferred_since < layout_defer_limit;
+}
+
+static bool  render_frame()
+{
+  PresentProfile const& profile = get_profile();
+  if (!retired.empty())
+    destroy_retired(completed_frame(stage::present));
+  collect_latency();
+  check_memory_budget();
+  if (!damage.bits || defer_to_next_frame(profile))
+  {
+    ++damage.skipped;
+    return false;
+  }
+
+  FrameResources& frame = frames[frame_index];
+  wait_frame_idle(frame);
+  // keep a single frame queued so the next one is built from the newest data
+  if (profile.just_in_time)
+    wait_frame_idle(frames[(frame_index + frames_active - 1) % frames_active]);
+
+  if (recovery.fault_pending && recovery.fault_countdown-- == 0)
+  {
+    recovery.fault_pending = false;
+    throw_fault(recovery.injected);
+  }
   uint32_t curBuffer = device.acquireNextImageKHR(swapchain, 
-                                            UINT64_MAX, image_acquired_semaphore,
+                                            UINT64_MAX, frame.image_acquired_semaphore,
                                             VK_NULL_HANDLE).value;
 
-  vk::PipelineStageFlags const stageFlags =
-      vk::PipelineStageFlagBits::eColorAttachmentOutput;
+  std::unique_lock<std::mutex> import_guard(host_import.lock);
+  const bool newFrame = frame.upload_pending;
+  if (frame.upload_pending)
+  {
+    source.ready = true;
+    source.color = frame.color;
+    if (source.upload == upload_path::direct)
+      source.set = frame.planes_set;
+  }
+  prepare_scaler();
+  prepare_pipelines();
 
-  auto const submitInfo =
-      vk::SubmitInfo()
-          .setPWaitDstStageMask(&stageFlags)
-          .setWaitSemaphoreCount(1)
-          .setPWaitSemaphores(&image_acquired_semaphore)
-          .setCommandBufferCount(1)
-          .setPCommandBuffers(&swapchain_buffers[curBuffer].cmd)
-          .setSignalSemaphoreCount(1)
-          .setPSignalSemaphores(&render_finished_semaphore);
-  graphics_queue.submit(1, &submitInfo, vk::Fence());
+  auto recordStart = std::chrono::steady_clock::now();
+  reset_frame_pools(frame);
+  write_command_buffers(frame, swapchain_buffers[curBuffer]);
+  update_record_stats(std::chrono::steady_clock::now() - recordStart);
+
+  submit_frame(frame);
+  import_guard.unlock();
+  if (source.upload == upload_path::direct)
+  {
+    for (FrameResources& f: frames)
+      if (source.set && f.planes_set == source.set)
+        f.sampled_serial = frame.serial;
+  }
+  if (newFrame)
+    latency.pending.push_back({frame.serial, frame.arrival});
 
-  auto const presentInfo = 
+  auto presentInfo = 
      vk::PresentInfoKHR()
       .setWaitSemaphoreCount(1)
-      .setPWaitSemaphores(&render_finished_semaphore)
+      .setPWaitSemaphores(&frame.render_finished_semaphore)
       .setSwapchainCount(1)
       .setPSwapchains(&swapchain)
       .setPImageIndices(&curBuffer);
+#ifdef VK_GOOGLE_display_timing
+  auto const presentTime = vk::PresentTimeGOOGLE()
+                            .setPresentID((uint32_t)frame.serial);
+  auto const presentTimes = vk::PresentTimesInfoGOOGLE()
+                            .setSwapchainCount(1)
+                            .setPTimes(&presentTime);
+  if (latency.display_timing)
+    presentInfo.setPNext(&presentTimes);
+#endif
   graphics_queue.presentKHR(presentInfo);
+
+  damage.bits = 0;
+  damage.deferred = false;
+  // drawn with the previous color format, draw again once the right
+  // permutation is built
+  if (pipelines.stale)
+    damage.bits |= damage_layout;
+  update_damage_stats();
+  telemetry::add(telemetry::counter::frames_rendered);
+  telemetry::set(telemetry::gauge::frames_in_flight,
+                 timeline.submitted - completed_frame(stage::present));
+  frame_index = (frame_index + 1) % frames_active;
+  return true;
+}
+
+bool  render()
+{
+  if (recovery.device_lost)
+    on_device_lost();
+  if (recovery.surface_lost)
+    return false;
+
+  try {
+    try {
+      return render_frame();
+    }
+    catch (vk::OutOfDateKHRError const&)
+    {
+      printf("[V3D] swapchain out of date, recreating\n");
+      rebuild_swap_chain();
+    }
+    catch (vk::SurfaceLostKHRError const&)
+    {
+      printf("[V3D] surface lost\n");
+      drop_swap_chain();
+    }
+  }
+  catch (vk::DeviceLostError const&)
+  {
+    on_device_lost();
+  }
+  return false;
+}
+
+uint64_t  submitted_frame()
+{
+  return timeline.submitted;
+}
+
+uint64_t  completed_frame(stage s)
+{
+  std::shared_lock<std::shared_mutex> guard(recovery.device_lock);
+  try {
+#ifdef VK_VERSION_1_2
+    if (timeline.enabled)
+      return device.getSemaphoreCounterValue(timeline.semaphores[(int)s]);
+#endif
+    return fence_progress();
+  }
+  catch (vk::DeviceLostError const&)
+  {
+    // nothing runs on a lost device any more, render() rebuilds it
+    recovery.device_lost = true;
+    return timeline.submitted;
+  }
+}
+
+void  wait_gpu(stage s, uint64_t frame)
+{
+  std::shared_lock<std::shared_mutex> guard(recovery.device_lock);
+  wait_serial(s, frame);
 }
 
 } // namespace v3d
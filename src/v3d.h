@@ -1,19 +1,100 @@
 #pragma once
 
 #include "vulkan_api.h"
+#include "frame.h"
 
 namespace v3d 
 {
   void  init(const char* app_name, const char* engine_name);
+
+  // GPU selection, applied by on_window_create(). Without an override the
+  // device with the best capability score is used; with a benchmark cache
+  // every device's upload and conversion speed is measured once and cached
+  // in that file, and counts for more than the device type.
+  void  set_gpu_override(const char* index_or_name);
+  void  set_gpu_benchmark(const char* cache_path);
   void  shutdown();
   void  free_resources();
 
   // events handlers
   void  on_window_create(VkSurfaceKHR surface);
   void  on_window_resize(VkSurfaceKHR surface);
+  void  on_window_expose();
+
+  // Losses are recovered in place, demux and decode keep running. render()
+  // recreates an out of date swapchain, and on VK_ERROR_DEVICE_LOST calls
+  // on_device_lost(), which rebuilds the device and everything on it. A
+  // lost surface belongs to the window owner: once surface_lost() is true,
+  // it destroys the surface and hands a new one to on_surface_recreate().
   void  on_device_lost();
-  
-  void  render();
+  bool  surface_lost();
+  void  on_surface_recreate(VkSurfaceKHR surface);
+  // true after on_device_lost() until the next upload: the caller uploads
+  // the picture on screen again
+  bool  source_lost();
+
+  // makes render() fail as if acquiring the image returned the error, after
+  // the given number of renders; for testing the recovery paths
+  enum class fault
+  {
+    device_lost,
+    surface_lost,
+    out_of_date
+  };
+  void  inject_fault(fault f, uint32_t after_renders = 0);
+
+  // Presents only when something changed since the last present: a new
+  // frame, a layout change, invalidate() or a window event. Returns false
+  // when there was nothing to do.
+  bool  render();
+  // redraw on the next render(), e.g. after an overlay change
+  void  invalidate();
+
+  // split the window into a grid of video tiles
+  void  set_tiles(uint32_t columns, uint32_t rows);
+
+  // automatic: lanczos when downscaling, bicubic when upscaling
+  enum class scaler
+  {
+    automatic,
+    bilinear,
+    bicubic,
+    lanczos
+  };
+  void  set_scaler(scaler s);
+
+  // Swapchain depth and frame pacing, applied when the swapchain is created.
+  // Each profile reports the measured latency from upload_frame() to the
+  // display (or to render completion without VK_GOOGLE_display_timing).
+  enum class present_profile
+  {
+    low_latency,  // mailbox or immediate, 2 images, one frame queued
+    smooth,       // fifo, 3 images, frames queued ahead
+    power_save    // fifo, 2 images, least memory, layout changes wait for a new frame
+  };
+  void  set_present_profile(present_profile p);
+
+  // copies the frame into a staging buffer, it is shown by the next render();
+  // returns the serial of the frame that will carry it
+  uint64_t  upload_frame(video_frame const& frame);
+  // like upload_frame(), but when the planes lie in a hostmem block the
+  // device can import, the GPU copies straight from it. Returns the serial
+  // until which the planes have to stay untouched (completed_frame(
+  // stage::upload)), or 0 when they were copied already.
+  uint64_t  upload_host_frame(video_frame const& frame);
+
+  // GPU progress counted in frame serials. Safe to call from any thread, so
+  // decode threads can wait for the GPU to consume a frame before reusing
+  // its buffers.
+  enum class stage
+  {
+    upload,     // staging copied into the source textures
+    convert,    // source sampled by the conversion/horizontal scaler pass
+    present     // frame rendered and handed to presentation
+  };
+  uint64_t  submitted_frame();
+  uint64_t  completed_frame(stage s);
+  void      wait_gpu(stage s, uint64_t frame);
 
   vk::Instance&   get_vk();
   vk::Device&     get_device();
@@ -1,13 +1,30 @@
 #include  "vulkan_api.h"
 #include  "vulkantools.h"
 #include  "v3d.h"
+#include  "tasks.h"
+#include  "hostmem.h"
+#include  "telemetry.h"
+#include  "thumbnails.h"
+#include  "rawdump.h"
+#include  "player.h"
+#include  "live.h"
+#include  "audio.h"
 
+#include  <algorithm>
+#include  <chrono>
+#include  <exception>
+#include  <functional>
 #include  <stdexcept>
 #include  <memory>
+#include  <string>
+#include  <vector>
 #include  <X11/Xutil.h>
 #include  <xcb/xcb.h>
 
+#include  <math.h>
 #include  <stdlib.h>
+#include  <string.h>
+#include  <unistd.h>
 
 // window system
 Display* display;
@@ -26,6 +43,75 @@ int win_height = 600;
 static bool quit = false;
 bool  need_resize = false;
 
+// synthetic source to check presentation without a decoder, at most
+// max_pattern_size on each side
+static const uint32_t  max_pattern_size = 8192;
+static struct
+{
+  uint32_t              width = 0;
+  uint32_t              height = 0;
+  uint32_t              frame = 0;
+  std::vector<uint8_t>  planes[3];
+} pattern;
+
+static std::vector<std::string>  inputs;
+static std::unique_ptr<playback::player>  video;
+static double                            start_speed = 1.0;
+static std::unique_ptr<playback::live_player>  live;
+static const char*                             live_path = nullptr;
+static uint32_t                                live_latency_ms = 100;
+static bool                      thumbnails_mode = false;
+static thumbnails::options       thumbnails_opts;
+static bool                      dump_mode = false;
+static rawdump::options          dump_opts;
+static const char*               metrics_path = nullptr;
+static uint32_t                  metrics_interval_ms = 1000;
+static tasks::pinning            worker_pinning = tasks::pinning::none;
+
+// Startup work that runs on the task pool next to the Vulkan setup. A
+// failure is rethrown by join().
+struct startup_task
+{
+  tasks::group        group;
+  std::exception_ptr  error;
+
+  void  start(std::function<void()>&& fn)
+  {
+    tasks::submit([this, fn] {
+        try {
+          fn();
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
+      }, tasks::lane::present, &group);
+  }
+
+  void  join()
+  {
+    tasks::wait(group);
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+static startup_task  window_setup;
+static startup_task  input_setup;
+static std::chrono::steady_clock::time_point  startup_time;
+static bool                                   first_frame_shown = false;
+
+static double  since_startup_ms()
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                   startup_time).count();
+}
+
+static void  startup_phase(const char* name)
+{
+  printf("[STARTUP] %s at %.1f ms\n", name, since_startup_ms());
+}
+
 void create_window()
 {
   int scr;
@@ -69,12 +155,25 @@ void create_window()
                       &(*atom_wm_delete_window).atom);
   free(reply);
   xcb_map_window(connection, window);
+}
 
+void create_surface()
+{
   xcb_surface = v3d::get_vk().createXcbSurfaceKHR(vk::XcbSurfaceCreateInfoKHR()
                                                     .setWindow(window)
                                                     .setConnection(connection));
 }
 
+// 1x, 2x, 4x ... in the given direction, through 1x in the other one
+static double next_speed(double speed, int direction)
+{
+  if (speed == 0)
+    return direction;
+  if ((speed > 0) == (direction > 0))
+    return std::min(speed * 2, playback::player::max_speed);
+  return std::fabs(speed) > 1 ? speed / 2 : -speed;
+}
+
 static void handle_window_event(const xcb_generic_event_t* event)
 {
   uint8_t event_code = event->response_type & 0x7f;
@@ -93,8 +192,31 @@ static void handle_window_event(const xcb_generic_event_t* event)
       case 0x9: // Escape
           quit = true;
           break;
+      case 0x41: // Space
+          if (video)
+            video->set_speed(video->speed() != 0 ? 0 : 1);
+          break;
+      case 0x72: // Right: faster forward or slower backwards
+          if (video)
+            video->set_speed(next_speed(video->speed(), 1));
+          break;
+      case 0x71: // Left: faster backwards or slower forward
+          if (video)
+            video->set_speed(next_speed(video->speed(), -1));
+          break;
+      case 0x3c: // Period: next frame
+          if (video)
+            video->step(1);
+          break;
+      case 0x3b: // Comma: previous frame
+          if (video)
+            video->step(-1);
+          break;
       }
   } break;
+  case XCB_EXPOSE:
+      v3d::on_window_expose();
+      break;
   case XCB_CONFIGURE_NOTIFY: {
       printf("configure\n");
       const xcb_configure_notify_event_t *cfg =
@@ -111,12 +233,65 @@ static void handle_window_event(const xcb_generic_event_t* event)
   }
 }
 
+// luma ramp with a moving bar over four chroma quadrants
+static void upload_pattern()
+{
+  const uint32_t cw = (pattern.width + 1) / 2;
+  const uint32_t ch = (pattern.height + 1) / 2;
+  for (int i = 0; i < 3; ++i)
+    pattern.planes[i].resize(i == 0 ? pattern.width * pattern.height : cw * ch);
+
+  const uint32_t bar = (pattern.frame * 4) % pattern.width;
+  for (uint32_t y = 0; y < pattern.height; ++y)
+    for (uint32_t x = 0; x < pattern.width; ++x)
+      pattern.planes[0][y * pattern.width + x] =
+          (x >= bar && x < bar + 16) ? 235 : 16 + 219 * x / pattern.width;
+
+  for (uint32_t y = 0; y < ch; ++y)
+    for (uint32_t x = 0; x < cw; ++x)
+    {
+      pattern.planes[1][y * cw + x] = x < cw / 2 ? 64 : 192;
+      pattern.planes[2][y * cw + x] = y < ch / 2 ? 64 : 192;
+    }
+
+  video_frame frame;
+  frame.width = pattern.width;
+  frame.height = pattern.height;
+  for (int i = 0; i < 3; ++i)
+  {
+    frame.planes[i] = pattern.planes[i].data();
+    frame.strides[i] = i == 0 ? pattern.width : cw;
+  }
+  v3d::upload_frame(frame);
+  ++pattern.frame;
+}
+
 static void do_resize()
 {
   need_resize = false;
   v3d::on_window_resize(xcb_surface);
 }
 
+// the renderer dropped its swapchain, the window itself is still there
+static void recreate_surface()
+{
+  v3d::get_vk().destroySurfaceKHR(xcb_surface);
+  xcb_surface = VK_NULL_HANDLE;
+  create_surface();
+  v3d::on_surface_recreate(xcb_surface);
+}
+
+static bool source_presented()
+{
+  if (pattern.width)
+    return pattern.frame > 0;
+  if (video)
+    return video->stats().presented > 0;
+  if (live)
+    return live->stats().presented > 0;
+  return false;
+}
+
 static void mainloop()
 {
   xcb_flush(connection);
@@ -133,19 +308,237 @@ static void mainloop()
       event = xcb_poll_for_event(connection);
     }
 
+    if (v3d::surface_lost())
+      recreate_surface();
     if (need_resize)
       do_resize();
 
-    v3d::render();
+    if (pattern.width)
+      upload_pattern();
+    if (video && !video->update())
+      break;
+    if (live && !live->update())
+      break;
+    if (v3d::render())
+    {
+      if (!first_frame_shown && source_presented())
+      {
+        first_frame_shown = true;
+        const double ttff = since_startup_ms();
+        printf("[STARTUP] time to first frame %.1f ms\n", ttff);
+        telemetry::set(telemetry::gauge::time_to_first_frame_us, (int64_t)(ttff * 1000));
+      }
+      continue;
+    }
+
+    // nothing changed: without a source only window events can change that
+    if (!pattern.width && !video && !live)
+    {
+      event = xcb_wait_for_event(connection);
+      if (!event)
+        break;
+      handle_window_event(event);
+      free(event);
+    }
+    else
+      usleep(1000);
+  }
+}
+
+static void parse_args(int argc, char** argv)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    unsigned columns, rows;
+    if (!strcmp(argv[i], "--tiles") && i + 1 < argc &&
+        sscanf(argv[++i], "%ux%u", &columns, &rows) == 2)
+      v3d::set_tiles(columns, rows);
+    else if (!strcmp(argv[i], "--pattern") && i + 1 < argc)
+    {
+      if (sscanf(argv[++i], "%ux%u", &pattern.width, &pattern.height) != 2 ||
+          pattern.width == 0 || pattern.height == 0 ||
+          pattern.width > max_pattern_size || pattern.height > max_pattern_size)
+        throw std::runtime_error(std::string("bad pattern size ") + argv[i]);
+    }
+    else if (!strcmp(argv[i], "--scaler") && i + 1 < argc)
+    {
+      const char* name = argv[++i];
+      if (!strcmp(name, "auto"))
+        v3d::set_scaler(v3d::scaler::automatic);
+      else if (!strcmp(name, "bilinear"))
+        v3d::set_scaler(v3d::scaler::bilinear);
+      else if (!strcmp(name, "bicubic"))
+        v3d::set_scaler(v3d::scaler::bicubic);
+      else if (!strcmp(name, "lanczos"))
+        v3d::set_scaler(v3d::scaler::lanczos);
+      else
+        throw std::runtime_error(std::string("unknown scaler ") + name);
+    }
+    else if (!strcmp(argv[i], "--present") && i + 1 < argc)
+    {
+      const char* name = argv[++i];
+      if (!strcmp(name, "low-latency"))
+        v3d::set_present_profile(v3d::present_profile::low_latency);
+      else if (!strcmp(name, "smooth"))
+        v3d::set_present_profile(v3d::present_profile::smooth);
+      else if (!strcmp(name, "power-save"))
+        v3d::set_present_profile(v3d::present_profile::power_save);
+      else
+        throw std::runtime_error(std::string("unknown present profile ") + name);
+    }
+    else if (!strcmp(argv[i], "--hugepages") && i + 1 < argc)
+    {
+      const char* name = argv[++i];
+      if (!strcmp(name, "off"))
+        hostmem::set_page_mode(hostmem::page_mode::normal);
+      else if (!strcmp(name, "transparent"))
+        hostmem::set_page_mode(hostmem::page_mode::transparent_huge);
+      else if (!strcmp(name, "explicit"))
+        hostmem::set_page_mode(hostmem::page_mode::explicit_huge);
+      else
+        throw std::runtime_error(std::string("unknown hugepages mode ") + name);
+    }
+    else if (!strcmp(argv[i], "--numa-local"))
+      hostmem::set_numa_local(true);
+    else if (!strcmp(argv[i], "--pin-workers") && i + 1 < argc)
+    {
+      const char* name = argv[++i];
+      if (!strcmp(name, "cores"))
+        worker_pinning = tasks::pinning::cores;
+      else if (!strcmp(name, "nodes"))
+        worker_pinning = tasks::pinning::nodes;
+      else
+        throw std::runtime_error(std::string("unknown worker pinning ") + name);
+    }
+    else if (!strcmp(argv[i], "--gpu") && i + 1 < argc)
+      v3d::set_gpu_override(argv[++i]);
+    else if (!strcmp(argv[i], "--gpu-benchmark") && i + 1 < argc)
+      v3d::set_gpu_benchmark(argv[++i]);
+    else if (!strcmp(argv[i], "--inject-fault") && i + 1 < argc)
+    {
+      // <kind>[:renders], to exercise the renderer's recovery
+      char name[32];
+      uint32_t renders = 0;
+      if (sscanf(argv[++i], "%31[a-z-]:%u", name, &renders) < 1)
+        throw std::runtime_error(std::string("bad fault ") + argv[i]);
+      if (!strcmp(name, "device-lost"))
+        v3d::inject_fault(v3d::fault::device_lost, renders);
+      else if (!strcmp(name, "surface-lost"))
+        v3d::inject_fault(v3d::fault::surface_lost, renders);
+      else if (!strcmp(name, "out-of-date"))
+        v3d::inject_fault(v3d::fault::out_of_date, renders);
+      else
+        throw std::runtime_error(std::string("unknown fault ") + name);
+    }
+    else if (!strcmp(argv[i], "--thumbnails") && i + 1 < argc)
+    {
+      thumbnails_mode = true;
+      thumbnails_opts.out_dir = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--thumb-width") && i + 1 < argc &&
+             sscanf(argv[++i], "%u", &thumbnails_opts.width) == 1 && thumbnails_opts.width > 0)
+      continue;
+    else if (!strcmp(argv[i], "--sheet") && i + 1 < argc &&
+             sscanf(argv[++i], "%ux%u", &thumbnails_opts.columns, &thumbnails_opts.rows) == 2 &&
+             thumbnails_opts.columns > 0 && thumbnails_opts.rows > 0)
+      continue;
+    else if (!strcmp(argv[i], "--dump") && i + 1 < argc)
+    {
+      dump_mode = true;
+      dump_opts.out_dir = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--dump-format") && i + 1 < argc)
+    {
+      const char* name = argv[++i];
+      if (!strcmp(name, "y4m"))
+        dump_opts.fmt = rawdump::format::y4m;
+      else if (!strcmp(name, "yuv"))
+        dump_opts.fmt = rawdump::format::yuv;
+      else
+        throw std::runtime_error(std::string("unknown dump format ") + name);
+    }
+    else if (!strcmp(argv[i], "--direct-io"))
+      dump_opts.direct_io = true;
+    else if (!strcmp(argv[i], "--metrics") && i + 1 < argc)
+      metrics_path = argv[++i];
+    else if (!strcmp(argv[i], "--metrics-interval") && i + 1 < argc &&
+             sscanf(argv[++i], "%u", &metrics_interval_ms) == 1)
+      continue;
+    else if (!strcmp(argv[i], "--audio") && i + 1 < argc)
+    {
+      // none, null, device or wav:<file>
+      const char* name = argv[++i];
+      if (!strcmp(name, "none"))
+        audio::set_sink(audio::sink_type::none);
+      else if (!strcmp(name, "null"))
+        audio::set_sink(audio::sink_type::null);
+      else if (!strcmp(name, "device"))
+        audio::set_sink(audio::sink_type::device);
+      else if (!strncmp(name, "wav:", 4) && name[4])
+        audio::set_sink(audio::sink_type::wav, name + 4);
+      else
+        throw std::runtime_error(std::string("unknown audio sink ") + name);
+    }
+    else if (!strcmp(argv[i], "--speed") && i + 1 < argc &&
+             sscanf(argv[++i], "%lf", &start_speed) == 1)
+      continue;
+    else if (!strcmp(argv[i], "--live") && i + 1 < argc)
+      live_path = argv[++i];
+    else if (!strcmp(argv[i], "--live-latency") && i + 1 < argc &&
+             sscanf(argv[++i], "%u", &live_latency_ms) == 1)
+      continue;
+    else if (argv[i][0] != '-')
+      inputs.push_back(argv[i]);
+    else
+      throw std::runtime_error(std::string("unknown argument ") + argv[i]);
   }
 }
 
-int main()
+int main(int argc, char** argv)
 {
+  startup_time = std::chrono::steady_clock::now();
+  tasks::init();
   try {
+    parse_args(argc, argv);
+    tasks::pin_workers(worker_pinning);
+    if (metrics_path)
+      telemetry::start(metrics_path, metrics_interval_ms);
+    if (thumbnails_mode)
+    {
+      unsigned failed = thumbnails::run(thumbnails_opts, inputs);
+      telemetry::stop();
+      tasks::shutdown();
+      return failed ? 1 : 0;
+    }
+    if (dump_mode)
+    {
+      unsigned failed = rawdump::run(dump_opts, inputs);
+      telemetry::stop();
+      tasks::shutdown();
+      return failed ? 1 : 0;
+    }
+
+    // the input opens and decodes its first frames and the window comes up
+    // while the instance, device and pipelines are created
+    if (live_path)
+      input_setup.start([] { live.reset(new playback::live_player(live_path, live_latency_ms)); });
+    else if (!inputs.empty())
+      input_setup.start([]
+        {
+          video.reset(new playback::player(inputs.front().c_str()));
+          if (start_speed != 1.0)
+            video->set_speed(start_speed);
+        });
+    window_setup.start(create_window);
+
     v3d::init("vplay", "fa20");
-    create_window();
+    startup_phase("instance ready");
+    window_setup.join();
+    create_surface();
     v3d::on_window_create(xcb_surface);
+    startup_phase("device and pipelines ready");
+    input_setup.join();
+    startup_phase("input open");
 
     mainloop();
   }
@@ -153,6 +546,11 @@ int main()
   {
     printf("%s\n", e.what());
   }
+  // a failed startup may leave these running
+  tasks::wait(window_setup.group);
+  tasks::wait(input_setup.group);
+  video.reset();
+  live.reset();
   vk::Device& dev = v3d::get_device();
   if (dev)
     dev.waitIdle();
@@ -167,5 +565,7 @@ int main()
   free(atom_wm_delete_window);
 
   v3d::shutdown();
+  telemetry::stop();
+  tasks::shutdown();
   return 0;
 }
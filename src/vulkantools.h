@@ -69,6 +69,11 @@ inline void device_destroy(vk::Semaphore& handle, vk::Device const& device)
   device.destroySemaphore(handle);
 }
 
+inline void device_destroy(vk::Fence& handle, vk::Device const& device)
+{
+  device.destroyFence(handle);
+}
+
 inline void device_destroy(vk::CommandPool& handle, vk::Device const& device)
 {
   device.destroyCommandPool(handle);
@@ -109,6 +114,26 @@ inline void device_destroy(vk::DeviceMemory& handle, vk::Device const& device)
   device.freeMemory(handle);
 }
 
+inline void device_destroy(vk::Buffer& handle, vk::Device const& device)
+{
+  device.destroyBuffer(handle);
+}
+
+inline void device_destroy(vk::Sampler& handle, vk::Device const& device)
+{
+  device.destroySampler(handle);
+}
+
+inline void device_destroy(vk::DescriptorSetLayout& handle, vk::Device const& device)
+{
+  device.destroyDescriptorSetLayout(handle);
+}
+
+inline void device_destroy(vk::DescriptorPool& handle, vk::Device const& device)
+{
+  device.destroyDescriptorPool(handle);
+}
+
 inline void device_destroy(vk::Image& handle, vk::Device const& device)
 {
   device.destroyImage(handle);